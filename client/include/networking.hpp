@@ -4,7 +4,8 @@
 #include <string>
 
 struct UrlParts {
-    std::string host; // domain or IP
+    std::string scheme; // "http", "udp", ... empty if the url had none
+    std::string host;   // domain or IP
     int port;         // -1 means no port specified
 };
 
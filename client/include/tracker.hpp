@@ -1,11 +1,17 @@
 #pragma once
+#include <cstddef>
 #include <cstdint>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include <boost/asio/io_context.hpp>
+#include <boost/beast/core/tcp_stream.hpp>
 
 class TrackerServer {
   public:
+    enum class Protocol { http, udp };
+
     struct AnnounceParams {
         std::string info_hash;
         std::string peer_id;
@@ -22,15 +28,55 @@ class TrackerServer {
         int status_code = 0;
         std::string body;
         std::string error;
+        // When to announce again, in seconds, as the tracker asked (also on
+        // 429/503 replies). 0 if it didn't say
+        std::uint32_t interval = 0;
+        std::uint32_t min_interval = 0;
     };
 
+    /// Most infohashes the tracker takes in one batched announce
+    static constexpr std::size_t kMaxBatch = 128;
+
+    /// HTTP requests go over keep-alive connections pooled per host and
+    /// port for the life of the process, so every TrackerServer for the same
+    /// tracker shares them. UDP trackers likewise share one socket and
+    /// connection id per host and port
     TrackerServer(std::string host, std::string port,
-                  std::string announce_path = "/announce");
+                  std::string announce_path = "/announce",
+                  Protocol protocol = Protocol::http);
 
+    /// Announce over whichever protocol this tracker was built with. UDP
+    /// results carry the same compact body an HTTP compact=1 announce gets
     AnnounceResult announce(const AnnounceParams &params);
 
+    /// Announce every one of `info_hashes` with the rest of `params`
+    /// (params.info_hash is ignored), one result per infohash in the order
+    /// given. Over HTTP they go out kMaxBatch at a time to the batch route
+    /// next to the announce path (`/announce_batch` for `/announce`), on
+    /// one connection, always with compact=1; each result carries that
+    /// swarm's own compact body and interval. Trackers without the batch
+    /// route, and UDP trackers, get one announce per infohash instead
+    std::vector<AnnounceResult>
+    announce_batch(const AnnounceParams &params,
+                   const std::vector<std::string> &info_hashes);
+
   private:
+    class ConnectionPool;
+    class UdpSession;
+
+    AnnounceResult announce_http(const AnnounceParams &params);
+    std::vector<AnnounceResult>
+    announce_http_batch(const AnnounceParams &params,
+                        const std::vector<std::string> &info_hashes);
+    AnnounceResult pooled_get(const std::string &target);
+    AnnounceResult http_get(boost::beast::tcp_stream &stream,
+                            const std::string &target, bool &keep_alive);
+    AnnounceResult announce_udp(const AnnounceParams &params);
+
     std::string host_;
     std::string port_;
     std::string announce_path_;
+    Protocol protocol_;
+    std::shared_ptr<ConnectionPool> pool_; // null for UDP
+    std::shared_ptr<UdpSession> udp_;      // null for HTTP
 };
@@ -1,3 +1,4 @@
+#include "bencode.hpp"
 #include "logger.hpp"
 #include "peer_udp.hpp"
 #include "torrent.hpp"
@@ -130,6 +131,9 @@ struct AppState {
     std::atomic<bool> announce_thread_running{false};
     std::thread announce_thread;
     std::mutex torrent_entries_mutex;
+    // When each synced torrent (by file path) is due to announce again. Only
+    // touched by the announcer thread
+    std::map<std::string, std::chrono::steady_clock::time_point> next_announce;
 
     // For downloading files
     std::map<std::string, std::vector<PeerInfo>> download_peers;
@@ -246,6 +250,72 @@ std::vector<PeerInfo> parse_peers_json(const std::string &body) {
     return peers;
 }
 
+/// Decode a compact (compact=1) tracker response: a bencoded dict whose
+/// "peers" string holds 6-byte IPv4 records and "peers6" 18-byte IPv6 records,
+/// each an address followed by a big-endian port
+std::vector<PeerInfo> parse_peers_compact(const std::string &body) {
+    std::vector<PeerInfo> peers;
+
+    bencode::data root;
+    try {
+        root = bencode::decode(body);
+    } catch (const std::exception &) {
+        return peers;
+    }
+
+    auto *dict = std::get_if<bencode::dict>(&root.base());
+    if (!dict)
+        return peers;
+
+    auto unpack = [&](const char *key, std::size_t addr_len) {
+        auto it = dict->find(key);
+        if (it == dict->end())
+            return;
+        auto *packed = std::get_if<bencode::string>(&it->second.base());
+        if (!packed)
+            return;
+
+        const std::size_t record = addr_len + 2;
+        const auto *raw =
+            reinterpret_cast<const unsigned char *>(packed->data());
+        for (std::size_t off = 0; off + record <= packed->size();
+             off += record) {
+            boost::asio::ip::address addr;
+            if (addr_len == 4) {
+                boost::asio::ip::address_v4::bytes_type b;
+                std::memcpy(b.data(), raw + off, b.size());
+                addr = boost::asio::ip::address_v4(b);
+            } else {
+                boost::asio::ip::address_v6::bytes_type b;
+                std::memcpy(b.data(), raw + off, b.size());
+                addr = boost::asio::ip::address_v6(b);
+            }
+            std::uint16_t port = static_cast<std::uint16_t>(
+                (raw[off + addr_len] << 8) | raw[off + addr_len + 1]);
+            peers.push_back(PeerInfo{addr.to_string(), port});
+        }
+    };
+
+    unpack("peers", 4);
+    unpack("peers6", 16);
+    return peers;
+}
+
+/// Peers of an announce reply. We always ask for compact=1, but a tracker
+/// may ignore it and answer with our JSON peer list instead; a compact reply
+/// is a bencoded dict, so it starts with 'd'
+std::vector<PeerInfo> parse_peers(const std::string &body) {
+    if (!body.empty() && body[0] == 'd')
+        return parse_peers_compact(body);
+    return parse_peers_json(body);
+}
+
+/// udp:// announce urls go over the UDP tracker protocol, anything else HTTP
+TrackerServer::Protocol tracker_protocol(const UrlParts &u) {
+    return u.scheme == "udp" ? TrackerServer::Protocol::udp
+                             : TrackerServer::Protocol::http;
+}
+
 void write_piece_chunk(AppState &state, const std::string &infohash_hex,
                        int piece_index, std::uint64_t offset_in_piece,
                        std::uint64_t total_piece_size,
@@ -425,12 +495,18 @@ Element boolDecorator(Element child, bool synced) {
     }
 }
 
-void announce_all_torrents(AppState &state) {
+/// Announce every synced torrent whose interval has run out, and schedule its
+/// next announce from the interval the tracker answered with. The sync period
+/// from the options is only the fallback for trackers that don't say (or that
+/// couldn't be reached). Due torrents on the same tracker go out together, as
+/// one batched request per TrackerServer::kMaxBatch of them
+void announce_due_torrents(AppState &state) {
     int period_ms = 30000;
     try {
         period_ms = std::stoi(state.cfg.sync_period);
     } catch (...) {
     }
+    const auto now = std::chrono::steady_clock::now();
 
     std::vector<TorrentEntry> entries_copy;
     {
@@ -438,12 +514,28 @@ void announce_all_torrents(AppState &state) {
         entries_copy = state.torrent_entries;
     }
 
+    // Due torrents by tracker (scheme, host and port)
+    struct TrackerGroup {
+        UrlParts url;
+        std::vector<const TorrentEntry *> entries;
+        std::vector<std::string> infohashes;
+    };
+    std::map<std::string, TrackerGroup> groups;
+
     for (const auto &te : entries_copy) {
         // If no torrent, dont sync
         if (!te.synced) {
             continue;
         }
 
+        auto due = state.next_announce.find(te.filepath);
+        if (due != state.next_announce.end() && now < due->second) {
+            continue;
+        }
+        // Whatever happens below, don't retry before the fallback period
+        state.next_announce[te.filepath] =
+            now + std::chrono::milliseconds(period_ms);
+
         std::string torrent_path = te.filepath + ".torrent";
         try {
             TorrentMeta meta = unwrap_torrent_file(torrent_path);
@@ -464,17 +556,44 @@ void announce_all_torrents(AppState &state) {
                 continue;
             }
 
-            TrackerServer tracker(u.host, std::to_string(u.port));
-            TrackerServer::AnnounceParams params;
-            params.peer_id = state.peer_id;
-            params.info_hash.assign(meta.infohash.begin(), meta.infohash.end());
-            params.event = "";
-            params.port = state.peer_port;
-            params.uploaded = 0;
-            params.downloaded = 0;
-            params.left = 0;
+            TrackerGroup &group = groups[u.scheme + "://" + u.host + ":" +
+                                         std::to_string(u.port)];
+            group.url = u;
+            group.entries.push_back(&te);
+            group.infohashes.emplace_back(meta.infohash.begin(),
+                                          meta.infohash.end());
+        } catch (const std::exception &e) {
+            std::ostringstream oss;
+            oss << "[announce] Error for file '" << te.name << "': " << e.what()
+                << "\n";
+            state.logger->log(oss.str());
+        }
+    }
 
-            auto res = tracker.announce(params);
+    for (auto &[name, group] : groups) {
+        TrackerServer tracker(group.url.host, std::to_string(group.url.port),
+                              "/announce", tracker_protocol(group.url));
+        TrackerServer::AnnounceParams params;
+        params.peer_id = state.peer_id;
+        params.event = "";
+        params.port = state.peer_port;
+        params.uploaded = 0;
+        params.downloaded = 0;
+        params.left = 0;
+        params.compact = true;
+
+        auto results = tracker.announce_batch(params, group.infohashes);
+
+        for (std::size_t i = 0; i < results.size(); ++i) {
+            const TorrentEntry &te = *group.entries[i];
+            const auto &res = results[i];
+
+            // Trackers hand out the interval on refusals too (rate limited,
+            // overloaded), and backing off as asked is the point of it
+            if (res.interval > 0) {
+                state.next_announce[te.filepath] =
+                    now + std::chrono::seconds(res.interval);
+            }
 
             if (!res.error.empty()) {
                 std::ostringstream oss;
@@ -483,7 +602,7 @@ void announce_all_torrents(AppState &state) {
                 state.logger->log(oss.str());
 
             } else {
-                std::vector<PeerInfo> peers = parse_peers_json(res.body);
+                std::vector<PeerInfo> peers = parse_peers(res.body);
 
                 // Now we can act as seeder, so we will need to try to keep a
                 // connection open for anyone trying to install the file
@@ -495,20 +614,23 @@ void announce_all_torrents(AppState &state) {
 
                 std::ostringstream oss;
                 oss << "[announce] " << te.name << ": tracker responded ("
-                    << res.status_code << "), peers=" << peers.size() << "\n";
+                    << res.status_code << "), peers=" << peers.size()
+                    << ", next in " << res.interval << "s\n";
                 state.logger->log(oss.str());
             }
-        } catch (const std::exception &e) {
+        }
+
+        if (group.infohashes.size() > 1) {
             std::ostringstream oss;
-            oss << "[announce] Error for file '" << te.name << "': " << e.what()
-                << "\n";
+            oss << "[announce] " << name << ": " << group.infohashes.size()
+                << " torrents in one batch\n";
             state.logger->log(oss.str());
         }
     }
 }
 
 // This will start the announcer thread which will loop through all synced files
-// and re-announce them on a set period
+// and re-announce each of them when the tracker asked it to
 void start_announcer(AppState &state) {
     if (state.announce_thread_running.load()) {
         return;
@@ -518,14 +640,10 @@ void start_announcer(AppState &state) {
 
     state.announce_thread = std::thread([&state]() {
         while (state.announce_thread_running.load()) {
-            announce_all_torrents(state);
-            int period_ms = 30000;
-            try {
-                period_ms = std::stoi(state.cfg.sync_period);
-            } catch (...) {
-            }
-
-            std::this_thread::sleep_for(std::chrono::milliseconds(period_ms));
+            announce_due_torrents(state);
+            // Torrents come due at their own times; wake up often enough to
+            // catch them (and newly synced ones) and to stop promptly
+            std::this_thread::sleep_for(std::chrono::milliseconds(500));
         }
     });
 }
@@ -1046,7 +1164,9 @@ int main(int argc, char **argv) {
 
                             UrlParts u = parse_url(meta.torrent_url);
                             TrackerServer tracker(u.host,
-                                                  std::to_string(u.port));
+                                                  std::to_string(u.port),
+                                                  "/announce",
+                                                  tracker_protocol(u));
 
                             TrackerServer::AnnounceParams params;
                             params.peer_id = state.peer_id;
@@ -1060,6 +1180,7 @@ int main(int argc, char **argv) {
                                 static_cast<std::uint64_t>(meta.file_length);
                             params.event = "started";
                             params.port = state.peer_port;
+                            params.compact = true;
 
                             auto res = tracker.announce(params);
 
@@ -1069,7 +1190,7 @@ int main(int argc, char **argv) {
                             } else {
 
                                 std::vector<PeerInfo> peers =
-                                    parse_peers_json(res.body);
+                                    parse_peers(res.body);
                                 std::string ih_hex = to_hex(meta.infohash);
 
                                 // save peer with new key
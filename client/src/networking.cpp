@@ -12,6 +12,7 @@ UrlParts parse_url(const std::string &url) {
 
     auto pos_scheme = work.find("://");
     if (pos_scheme != std::string::npos) {
+        out.scheme = work.substr(0, pos_scheme);
         work = work.substr(pos_scheme + 3); // remove "<scheme>://"
     }
 
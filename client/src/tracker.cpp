@@ -1,12 +1,25 @@
 #include "tracker.hpp"
+#include <algorithm>
+#include <array>
 #include <boost/asio/connect.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/ip/udp.hpp>
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
 #include <boost/beast/version.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <random>
 #include <sstream>
 #include <stdexcept>
+#include <string_view>
+#include <thread>
+#include <utility>
 
 static std::string url_encode(const std::string &data) {
     // for hex encoding, obviously
@@ -34,12 +47,12 @@ static std::string url_encode(const std::string &data) {
     return out;
 }
 
-static std::string build_query(const TrackerServer::AnnounceParams &p) {
+/// Everything but the infohash, which a batch repeats
+static std::string peer_query(const TrackerServer::AnnounceParams &p) {
     std::ostringstream oss;
 
     // Boom, url parameterers created just like that
-    oss << "infohash=" << url_encode(p.info_hash)
-        << "&peer_id=" << url_encode(p.peer_id) << "&port=" << p.port
+    oss << "peer_id=" << url_encode(p.peer_id) << "&port=" << p.port
         << "&uploaded=" << p.uploaded << "&downloaded=" << p.downloaded
         << "&left=" << p.left;
 
@@ -59,70 +72,748 @@ static std::string build_query(const TrackerServer::AnnounceParams &p) {
     return oss.str();
 }
 
+static std::string build_query(const TrackerServer::AnnounceParams &p) {
+    return "infohash=" + url_encode(p.info_hash) + "&" + peer_query(p);
+}
+
+static std::string request_target(std::string target,
+                                  const std::string &query) {
+    if (!query.empty()) {                       // If query isnt empty
+        if (target.empty() || target[0] != '/') // if target is empty
+            target.insert(target.begin(), '/');
+        target.push_back('?'); // Start parameters
+        target += query;
+    }
+    return target;
+}
+
+using tcp = boost::asio::ip::tcp;
+using udp = boost::asio::ip::udp;
+
+/// Keep-alive connections to one tracker, shared by every TrackerServer
+/// pointed at its host and port, so announcing thousands of torrents doesn't
+/// cost a DNS lookup and a TCP handshake each. A connection is checked out
+/// for one request at a time and comes back afterwards unless the tracker
+/// said to close it. Connections idle for kIdleExpiry are closed instead of
+/// reused, since the tracker will soon close its end (ours does after 15s);
+/// a background sweep every kSweepPeriod closes them even if the pool isn't
+/// used again, so they don't linger half-closed. Announces are 30s or more
+/// apart, so in practice connections are reused within one announce pass
+/// over many torrents, not from one pass to the next. The tracker's
+/// addresses are looked up once per kResolveTtl, or again right away when
+/// none of them takes a connection
+class TrackerServer::ConnectionPool {
+  public:
+    static constexpr std::size_t kMaxIdle = 8;
+    static constexpr std::chrono::seconds kIdleExpiry{10};
+    static constexpr std::chrono::seconds kSweepPeriod{5};
+    static constexpr std::chrono::minutes kResolveTtl{5};
+
+    struct Connection {
+        explicit Connection(boost::asio::io_context &ioc) : stream(ioc) {}
+
+        boost::beast::tcp_stream stream;
+        std::chrono::steady_clock::time_point idle_since;
+        bool reused = false; // Came out of the pool rather than connect()
+    };
+
+    ConnectionPool(std::string host, std::string port)
+        : host_(std::move(host)), port_(std::move(port)) {}
+
+    /// The pool for host:port, made on first use and kept from then on
+    static std::shared_ptr<ConnectionPool> for_tracker(const std::string &host,
+                                                       const std::string &port);
+
+    /// The most recently used idle connection, or a new one. Throws if the
+    /// tracker can't be reached
+    std::unique_ptr<Connection> acquire();
+
+    /// Take back a connection that is good for another request
+    void release(std::unique_ptr<Connection> conn);
+
+    /// Close the connections that have been idle for kIdleExpiry
+    void close_expired();
+
+  private:
+    std::unique_ptr<Connection> connect();
+    tcp::resolver::results_type resolve();
+
+    std::string host_;
+    std::string port_;
+    // Sockets only ever do blocking calls, so nothing runs this
+    boost::asio::io_context ioc_;
+    std::mutex mtx_;
+    std::vector<std::unique_ptr<Connection>> idle_; // Oldest first
+    tcp::resolver::results_type endpoints_;
+    std::chrono::steady_clock::time_point resolved_at_;
+};
+
+std::shared_ptr<TrackerServer::ConnectionPool>
+TrackerServer::ConnectionPool::for_tracker(const std::string &host,
+                                           const std::string &port) {
+    // The pools, and the thread sweeping them, which is stopped before the
+    // pools go at exit
+    static struct Registry {
+        std::mutex mtx;
+        std::condition_variable wake;
+        bool stopping = false;
+        std::map<std::pair<std::string, std::string>,
+                 std::shared_ptr<ConnectionPool>>
+            pools;
+        std::thread sweeper;
+
+        ~Registry() {
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                stopping = true;
+            }
+            wake.notify_all();
+            if (sweeper.joinable())
+                sweeper.join();
+        }
+
+        void sweep() {
+            std::unique_lock<std::mutex> lock(mtx);
+            while (!wake.wait_for(lock, kSweepPeriod,
+                                  [this] { return stopping; })) {
+                for (auto &entry : pools)
+                    entry.second->close_expired();
+            }
+        }
+    } registry;
+
+    std::lock_guard<std::mutex> lock(registry.mtx);
+    auto &pool = registry.pools[{host, port}];
+    if (!pool)
+        pool = std::make_shared<ConnectionPool>(host, port);
+    if (!registry.sweeper.joinable())
+        registry.sweeper = std::thread([] { registry.sweep(); });
+    return pool;
+}
+
+std::unique_ptr<TrackerServer::ConnectionPool::Connection>
+TrackerServer::ConnectionPool::acquire() {
+    close_expired();
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (!idle_.empty()) {
+            std::unique_ptr<Connection> conn = std::move(idle_.back());
+            idle_.pop_back();
+            conn->reused = true;
+            return conn;
+        }
+    }
+    return connect();
+}
+
+void TrackerServer::ConnectionPool::release(std::unique_ptr<Connection> conn) {
+    conn->idle_since = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (idle_.size() < kMaxIdle)
+        idle_.push_back(std::move(conn));
+}
+
+void TrackerServer::ConnectionPool::close_expired() {
+    const auto cutoff = std::chrono::steady_clock::now() - kIdleExpiry;
+    std::vector<std::unique_ptr<Connection>> expired;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        auto it = std::find_if(idle_.begin(), idle_.end(), [&](auto &conn) {
+            return conn->idle_since > cutoff;
+        });
+        expired.assign(std::make_move_iterator(idle_.begin()),
+                       std::make_move_iterator(it));
+        idle_.erase(idle_.begin(), it);
+    }
+    // Closed by their destructors, outside the lock
+}
+
+tcp::resolver::results_type TrackerServer::ConnectionPool::resolve() {
+    tcp::resolver resolver{ioc_};
+    auto endpoints = resolver.resolve(host_, port_);
+    std::lock_guard<std::mutex> lock(mtx_);
+    endpoints_ = endpoints;
+    resolved_at_ = std::chrono::steady_clock::now();
+    return endpoints;
+}
+
+std::unique_ptr<TrackerServer::ConnectionPool::Connection>
+TrackerServer::ConnectionPool::connect() {
+    tcp::resolver::results_type endpoints;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (std::chrono::steady_clock::now() - resolved_at_ < kResolveTtl)
+            endpoints = endpoints_;
+    }
+    const bool cached = !endpoints.empty();
+    if (!cached)
+        endpoints = resolve();
+
+    auto conn = std::make_unique<Connection>(ioc_);
+    boost::system::error_code ec;
+    conn->stream.connect(endpoints, ec);
+    if (ec && cached) {
+        // The tracker may have moved, look it up again before giving up
+        conn->stream.connect(resolve(), ec);
+    }
+    if (ec)
+        throw boost::system::system_error(ec);
+    return conn;
+}
+
+/// The UDP counterpart of ConnectionPool: one socket per tracker, shared by
+/// every TrackerServer pointed at its host and port, along with the
+/// tracker's address and the connection id it handed out. Trackers honour a
+/// connection id for a minute (BEP 15), so until kConnectionIdTtl has passed
+/// an announce is one datagram each way. A new id is asked for once it has
+/// expired or the tracker answered with an error; a tracker that doesn't
+/// answer at all is looked up again next time. Announces to one tracker
+/// take turns on its socket
+class TrackerServer::UdpSession {
+  public:
+    static constexpr std::chrono::seconds kConnectionIdTtl{60};
+    static constexpr std::chrono::minutes kResolveTtl{5};
+
+    UdpSession(std::string host, std::string port)
+        : host_(std::move(host)), port_(std::move(port)), socket_(ioc_),
+          rng_(std::random_device{}()) {}
+
+    /// The session for host:port, made on first use and kept from then on
+    static std::shared_ptr<UdpSession> for_tracker(const std::string &host,
+                                                   const std::string &port);
+
+    /// Send the announce `req` with our connection and transaction ids
+    /// filled in, and read the reply into `reply`. Returns its length, or 0
+    /// if the tracker never answered; `v6` is whether the tracker was
+    /// reached over IPv6. Throws if the tracker can't be resolved or doesn't
+    /// answer connect
+    std::size_t announce(unsigned char *req, std::size_t req_len,
+                         unsigned char *reply, std::size_t reply_cap,
+                         bool &v6);
+
+  private:
+    void resolve();
+    void connect();
+
+    std::string host_;
+    std::string port_;
+    // Only ever run from announce(), under mtx_
+    boost::asio::io_context ioc_;
+    std::mutex mtx_;
+    udp::socket socket_;
+    udp::endpoint endpoint_;
+    std::chrono::steady_clock::time_point resolved_at_;
+    std::array<unsigned char, 8> connection_id_{};
+    std::chrono::steady_clock::time_point id_expires_;
+    std::mt19937 rng_;
+};
+
 /// This is just the basic constructor
 TrackerServer::TrackerServer(std::string host, std::string port,
-                             std::string announce_path)
+                             std::string announce_path, Protocol protocol)
     : host_(std::move(host)), port_(std::move(port)),
-      announce_path_(std::move(announce_path)) {};
-using tcp = boost::asio::ip::tcp;
+      announce_path_(std::move(announce_path)), protocol_(protocol),
+      pool_(protocol == Protocol::http
+                ? ConnectionPool::for_tracker(host_, port_)
+                : nullptr),
+      udp_(protocol == Protocol::udp ? UdpSession::for_tracker(host_, port_)
+                                     : nullptr) {};
+
+/// Integer value of `key` in a tracker reply, whether it is bencoded
+/// (`<len>:<key>i<N>e`) or JSON (`"<key>":N`). 0 if it isn't there
+static std::uint32_t reply_uint(const std::string &body,
+                                const std::string &key) {
+    std::size_t pos = body.find(std::to_string(key.size()) + ":" + key + "i");
+    if (pos != std::string::npos) {
+        pos += std::to_string(key.size()).size() + 1 + key.size() + 1;
+    } else {
+        pos = body.find("\"" + key + "\":");
+        if (pos == std::string::npos)
+            return 0;
+        pos += key.size() + 3;
+        while (pos < body.size() && body[pos] == ' ')
+            ++pos;
+    }
+
+    std::uint64_t v = 0;
+    for (; pos < body.size() && body[pos] >= '0' && body[pos] <= '9'; ++pos) {
+        v = v * 10 + static_cast<std::uint64_t>(body[pos] - '0');
+        if (v > UINT32_MAX)
+            return 0;
+    }
+    return static_cast<std::uint32_t>(v);
+}
 
-/// This will initiate a connection, send a request telling them the file we
-/// own, and then close the stream
 TrackerServer::AnnounceResult
 TrackerServer::announce(const AnnounceParams &params) {
+    AnnounceResult result = protocol_ == Protocol::udp
+                                ? announce_udp(params)
+                                : announce_http(params);
+    result.interval = reply_uint(result.body, "interval");
+    result.min_interval = reply_uint(result.body, "min interval");
+    return result;
+}
+
+/// Send one GET for `target` on an open connection and read the reply,
+/// leaving the connection open for the next one. `keep_alive` is whether the
+/// tracker will take another request on it
+TrackerServer::AnnounceResult
+TrackerServer::http_get(boost::beast::tcp_stream &stream,
+                        const std::string &target, bool &keep_alive) {
+    AnnounceResult result;
+
+    // Create get request
+    boost::beast::http::request<boost::beast::http::empty_body> req{
+        boost::beast::http::verb::get, target, 11};
+
+    // Bog-standard http parameters
+    req.set(boost::beast::http::field::host, host_);
+    req.set(boost::beast::http::field::user_agent, "bt_mini/0.1");
+    req.set(boost::beast::http::field::accept, "*/*");
+
+    // Actually send request now (blocking)
+    boost::beast::http::write(stream, req);
+
+    // Get ready and read response
+    boost::beast::flat_buffer buffer;
+    boost::beast::http::response<boost::beast::http::string_body> res;
+    boost::beast::http::read(stream, buffer, res);
+
+    // Retrieve status
+    keep_alive = res.keep_alive();
+    result.status_code = static_cast<int>(res.result_int());
+    result.body = std::move(res.body());
+
+    // If the status wasn't good, report it
+    if (res.result() != boost::beast::http::status::ok) {
+        std::ostringstream err;
+        err << "Tracker HTTP error: " << res.result_int() << " "
+            << result.body;
+        result.error = err.str();
+    }
+    return result;
+}
+
+// What a pooled connection the tracker closed while it sat idle looks like
+static bool closed_by_peer(const boost::system::error_code &ec) {
+    return ec == boost::beast::http::error::end_of_stream ||
+           ec == boost::asio::error::eof ||
+           ec == boost::asio::error::connection_reset ||
+           ec == boost::asio::error::connection_aborted ||
+           ec == boost::asio::error::broken_pipe;
+}
+
+/// GET `target` on a pooled connection, which goes back to the pool after.
+/// If the tracker closed a reused connection before answering, the request
+/// is sent again on the next one; a new connection failing is an error
+TrackerServer::AnnounceResult
+TrackerServer::pooled_get(const std::string &target) {
+    for (;;) {
+        auto conn = pool_->acquire();
+        try {
+            bool keep_alive = false;
+            AnnounceResult result = http_get(conn->stream, target, keep_alive);
+            if (keep_alive)
+                pool_->release(std::move(conn));
+            return result;
+        } catch (const boost::system::system_error &e) {
+            if (!conn->reused || !closed_by_peer(e.code()))
+                throw;
+        }
+    }
+}
+
+/// Send a request telling the tracker the file we own, on a pooled
+/// connection
+TrackerServer::AnnounceResult
+TrackerServer::announce_http(const AnnounceParams &params) {
+    AnnounceResult result;
+
+    try {
+        result =
+            pooled_get(request_target(announce_path_, build_query(params)));
+    } catch (const std::exception &e) {
+        result.error = e.what();
+    }
+
+    return result;
+}
+
+/// End of the bencoded string at `pos` (`<len>:<bytes>`), with the bytes put
+/// in `out`. npos if there is no complete string there
+static std::size_t bencode_string(const std::string &s, std::size_t pos,
+                                  std::string_view &out) {
+    std::size_t len = 0;
+    std::size_t i = pos;
+    for (; i < s.size() && s[i] >= '0' && s[i] <= '9'; ++i) {
+        len = len * 10 + static_cast<std::size_t>(s[i] - '0');
+        if (len > s.size())
+            return std::string::npos;
+    }
+    if (i == pos || i >= s.size() || s[i] != ':' || s.size() - i - 1 < len)
+        return std::string::npos;
+    out = std::string_view(s).substr(i + 1, len);
+    return i + 1 + len;
+}
+
+/// End of the bencoded value starting at `pos`, or npos if it is malformed
+static std::size_t bencode_skip(const std::string &s, std::size_t pos,
+                                int depth = 0) {
+    if (pos >= s.size() || depth > 32)
+        return std::string::npos;
+    if (s[pos] == 'i') {
+        std::size_t e = s.find('e', pos);
+        return e == std::string::npos ? e : e + 1;
+    }
+    if (s[pos] == 'l' || s[pos] == 'd') {
+        ++pos;
+        while (pos < s.size() && s[pos] != 'e') {
+            pos = bencode_skip(s, pos, depth + 1);
+            if (pos == std::string::npos)
+                return pos;
+        }
+        return pos < s.size() ? pos + 1 : std::string::npos;
+    }
+    std::string_view ignored;
+    return bencode_string(s, pos, ignored);
+}
+
+/// Split the `files` dict of a compact batch reply into each swarm's own
+/// announce body, keyed by raw infohash. False if the reply has no `files`
+/// (a plain announce reply, from a tracker that doesn't know batches)
+static bool split_batch_reply(const std::string &body,
+                              std::map<std::string, std::string> &files) {
+    if (body.empty() || body[0] != 'd')
+        return false;
+
+    std::size_t pos = 1;
+    while (pos < body.size() && body[pos] != 'e') {
+        std::string_view key;
+        pos = bencode_string(body, pos, key);
+        if (pos == std::string::npos)
+            return false;
+        if (key != "files" || pos >= body.size() || body[pos] != 'd') {
+            pos = bencode_skip(body, pos);
+            if (pos == std::string::npos)
+                return false;
+            continue;
+        }
+
+        ++pos;
+        while (pos < body.size() && body[pos] != 'e') {
+            std::string_view ih;
+            pos = bencode_string(body, pos, ih);
+            if (pos == std::string::npos)
+                return true;
+            const std::size_t end = bencode_skip(body, pos);
+            if (end == std::string::npos)
+                return true;
+            files.emplace(ih, body.substr(pos, end - pos));
+            pos = end;
+        }
+        return true;
+    }
+    return false;
+}
+
+/// All of `info_hashes` over pooled connections, kMaxBatch per request (one
+/// after the other, so normally on the same connection). Empty if
+/// the tracker has no batch route, so the caller can go one by one. Older
+/// trackers answer 404, or take /announce_batch for a plain announce of
+/// the first infohash
+std::vector<TrackerServer::AnnounceResult>
+TrackerServer::announce_http_batch(
+    const AnnounceParams &params, const std::vector<std::string> &info_hashes) {
+    std::vector<AnnounceResult> results(info_hashes.size());
+    AnnounceParams shared = params;
+    shared.compact = true;
+    const std::string tail = peer_query(shared);
+    const std::string path = announce_path_ + "_batch";
+
+    std::size_t start = 0;
+    try {
+        for (; start < info_hashes.size(); start += kMaxBatch) {
+            const std::size_t end =
+                std::min(info_hashes.size(), start + kMaxBatch);
+            std::string query;
+            for (std::size_t i = start; i < end; ++i)
+                query += "infohash=" + url_encode(info_hashes[i]) + "&";
+            query += tail;
+
+            AnnounceResult reply = pooled_get(request_target(path, query));
+            if (start == 0 && reply.status_code == 404)
+                return {};
+
+            // A refusal (or anything else not 200) applies to every
+            // infohash in the request
+            if (!reply.error.empty()) {
+                for (std::size_t i = start; i < end; ++i)
+                    results[i] = reply;
+                continue;
+            }
+
+            std::map<std::string, std::string> files;
+            if (!split_batch_reply(reply.body, files) && start == 0)
+                return {};
+            for (std::size_t i = start; i < end; ++i) {
+                results[i].status_code = reply.status_code;
+                auto it = files.find(info_hashes[i]);
+                if (it == files.end()) {
+                    results[i].error = "Tracker left the infohash out of its "
+                                       "batch reply";
+                } else {
+                    results[i].body = std::move(it->second);
+                }
+            }
+        }
+    } catch (const std::exception &e) {
+        // Whatever wasn't answered before the connection went away
+        for (std::size_t i = start; i < info_hashes.size(); ++i)
+            results[i].error = e.what();
+    }
+
+    return results;
+}
+
+std::vector<TrackerServer::AnnounceResult>
+TrackerServer::announce_batch(const AnnounceParams &params,
+                              const std::vector<std::string> &info_hashes) {
+    std::vector<AnnounceResult> results;
+    if (protocol_ == Protocol::http && info_hashes.size() > 1)
+        results = announce_http_batch(params, info_hashes);
+
+    if (results.empty()) {
+        // UDP, a single torrent, or a tracker without the batch route
+        AnnounceParams one = params;
+        for (const auto &ih : info_hashes) {
+            one.info_hash = ih;
+            results.push_back(announce(one));
+        }
+        return results;
+    }
+
+    for (auto &result : results) {
+        result.interval = reply_uint(result.body, "interval");
+        result.min_interval = reply_uint(result.body, "min interval");
+    }
+    return results;
+}
+
+// UDP tracker protocol (BEP 15, with 32-byte infohashes to match ours)
+static constexpr std::uint64_t kUdpProtocolId = 0x41727101980ULL;
+static constexpr std::uint32_t kUdpConnect = 0;
+static constexpr std::uint32_t kUdpAnnounce = 1;
+static constexpr std::uint32_t kUdpError = 3;
+static constexpr int kUdpAttempts = 3;
+static constexpr auto kUdpTimeout = std::chrono::seconds{2};
+
+static void put_u32(unsigned char *p, std::uint32_t v) {
+    p[0] = static_cast<unsigned char>(v >> 24);
+    p[1] = static_cast<unsigned char>(v >> 16);
+    p[2] = static_cast<unsigned char>(v >> 8);
+    p[3] = static_cast<unsigned char>(v);
+}
+
+static void put_u64(unsigned char *p, std::uint64_t v) {
+    put_u32(p, static_cast<std::uint32_t>(v >> 32));
+    put_u32(p + 4, static_cast<std::uint32_t>(v));
+}
+
+static std::uint32_t get_u32(const unsigned char *p) {
+    return (std::uint32_t(p[0]) << 24) | (std::uint32_t(p[1]) << 16) |
+           (std::uint32_t(p[2]) << 8) | std::uint32_t(p[3]);
+}
+
+/// Send `req` and wait for a reply carrying the same transaction id,
+/// resending a few times since UDP may drop either packet. Returns the
+/// reply length, or 0 if the tracker never answered
+static std::size_t udp_exchange(boost::asio::io_context &ioc,
+                                udp::socket &socket, const udp::endpoint &to,
+                                const unsigned char *req, std::size_t req_len,
+                                unsigned char *reply, std::size_t reply_cap) {
+    const std::uint32_t txn = get_u32(req + 12);
+
+    for (int attempt = 0; attempt < kUdpAttempts; ++attempt) {
+        socket.send_to(boost::asio::buffer(req, req_len), to);
+
+        std::size_t got = 0;
+        udp::endpoint from;
+        socket.async_receive_from(
+            boost::asio::buffer(reply, reply_cap), from,
+            [&](boost::system::error_code ec, std::size_t n) {
+                if (!ec)
+                    got = n;
+            });
+
+        ioc.restart();
+        ioc.run_for(kUdpTimeout);
+        if (!ioc.stopped()) {
+            // Timed out, drop the pending receive before retrying
+            socket.cancel();
+            ioc.restart();
+            ioc.run();
+        }
+
+        if (got >= 8 && get_u32(reply + 4) == txn)
+            return got;
+    }
+    return 0;
+}
+
+std::shared_ptr<TrackerServer::UdpSession>
+TrackerServer::UdpSession::for_tracker(const std::string &host,
+                                       const std::string &port) {
+    static std::mutex mtx;
+    static std::map<std::pair<std::string, std::string>,
+                    std::shared_ptr<UdpSession>>
+        sessions;
+
+    std::lock_guard<std::mutex> lock(mtx);
+    auto &session = sessions[{host, port}];
+    if (!session)
+        session = std::make_shared<UdpSession>(host, port);
+    return session;
+}
+
+/// Look the tracker up, reopening the socket if it moved to the other
+/// address family
+void TrackerServer::UdpSession::resolve() {
+    udp::resolver resolver{ioc_};
+    const udp::endpoint to = *resolver.resolve(host_, port_).begin();
+    if (!socket_.is_open() || to.protocol() != endpoint_.protocol()) {
+        boost::system::error_code ignored;
+        socket_.close(ignored);
+        socket_.open(to.protocol());
+    }
+    endpoint_ = to;
+    resolved_at_ = std::chrono::steady_clock::now();
+}
+
+/// Trade the protocol magic for a connection id
+void TrackerServer::UdpSession::connect() {
+    // The id's minute starts when we ask for it
+    const auto asked = std::chrono::steady_clock::now();
+    std::array<unsigned char, 16> req{};
+    put_u64(req.data(), kUdpProtocolId);
+    put_u32(req.data() + 8, kUdpConnect);
+    put_u32(req.data() + 12, static_cast<std::uint32_t>(rng_()));
+
+    std::array<unsigned char, 64> reply{};
+    const std::size_t n = udp_exchange(ioc_, socket_, endpoint_, req.data(),
+                                       req.size(), reply.data(), reply.size());
+    if (n < 16 || get_u32(reply.data()) != kUdpConnect) {
+        resolved_at_ = {};
+        throw std::runtime_error("UDP tracker did not answer connect");
+    }
+    std::memcpy(connection_id_.data(), reply.data() + 8, 8);
+    id_expires_ = asked + kConnectionIdTtl;
+}
+
+std::size_t TrackerServer::UdpSession::announce(unsigned char *req,
+                                                std::size_t req_len,
+                                                unsigned char *reply,
+                                                std::size_t reply_cap,
+                                                bool &v6) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    const auto now = std::chrono::steady_clock::now();
+    if (now - resolved_at_ >= kResolveTtl)
+        resolve();
+    v6 = endpoint_.address().is_v6();
+
+    bool fresh = false;
+    if (now >= id_expires_) {
+        connect();
+        fresh = true;
+    }
+    for (;;) {
+        std::memcpy(req, connection_id_.data(), 8);
+        put_u32(req + 12, static_cast<std::uint32_t>(rng_()));
+        const std::size_t n = udp_exchange(ioc_, socket_, endpoint_, req,
+                                           req_len, reply, reply_cap);
+        if (n == 0) {
+            // It may have moved or restarted, start over next time
+            resolved_at_ = {};
+            id_expires_ = {};
+            return 0;
+        }
+        if (get_u32(reply) != kUdpError)
+            return n;
+
+        // The tracker may have forgotten our id; an error with a new one
+        // is the tracker's answer
+        id_expires_ = {};
+        if (fresh)
+            return n;
+        connect();
+        fresh = true;
+    }
+}
+
+/// Announce, one datagram each way on the tracker's shared UdpSession. The
+/// peer records in the reply are wrapped in the same bencoded dict an HTTP
+/// compact announce returns, so callers decode both the same way
+TrackerServer::AnnounceResult
+TrackerServer::announce_udp(const AnnounceParams &params) {
     AnnounceResult result;
 
-    // Try to initiate connection, and send request
     try {
-        boost::asio::io_context ioc;
-        tcp::resolver resolver{ioc};
-        boost::beast::tcp_stream stream{ioc};
+        std::random_device rd;
+        std::array<unsigned char, 2048> reply{};
 
-        auto const endpoints = resolver.resolve(host_, port_);
-        stream.connect(endpoints);
+        // Connection and transaction ids are filled in by the session
+        std::array<unsigned char, 110> req{};
+        put_u32(req.data() + 8, kUdpAnnounce);
+        std::memcpy(req.data() + 16, params.info_hash.data(),
+                    std::min<std::size_t>(params.info_hash.size(), 32));
+        std::memcpy(req.data() + 48, params.peer_id.data(),
+                    std::min<std::size_t>(params.peer_id.size(), 20));
+        put_u64(req.data() + 68, params.downloaded);
+        put_u64(req.data() + 76, params.left);
+        put_u64(req.data() + 84, params.uploaded);
 
-        std::string query = build_query(params);
-        std::string target = announce_path_;
+        std::uint32_t event = 0;
+        if (params.event == "completed")
+            event = 1;
+        else if (params.event == "started")
+            event = 2;
+        else if (params.event == "stopped")
+            event = 3;
+        put_u32(req.data() + 92, event);
+        put_u32(req.data() + 100, rd()); // key
+        put_u32(req.data() + 104, static_cast<std::uint32_t>(params.num_want));
+        req[108] = static_cast<unsigned char>(params.port >> 8);
+        req[109] = static_cast<unsigned char>(params.port & 0xFF);
 
-        if (!query.empty()) {                       // If query isnt empty
-            if (target.empty() || target[0] != '/') // if target is empty
-                target.insert(target.begin(), '/');
-            target.push_back('?'); // Start parameters
-            target += query;
+        bool v6 = false;
+        const std::size_t n = udp_->announce(req.data(), req.size(),
+                                             reply.data(), reply.size(), v6);
+        if (n == 0) {
+            result.error = "UDP tracker did not answer announce";
+            return result;
         }
 
-        // Create get request
-        boost::beast::http::request<boost::beast::http::empty_body> req{
-            boost::beast::http::verb::get, target, 11};
-
-        // Bog-standard http parameters
-        req.set(boost::beast::http::field::host, host_);
-        req.set(boost::beast::http::field::user_agent, "bt_mini/0.1");
-        req.set(boost::beast::http::field::accept, "*/*");
-
-        // Actually send request now (blocking)
-        boost::beast::http::write(stream, req);
-
-        // Get ready and read response
-        boost::beast::flat_buffer buffer;
-        boost::beast::http::response<boost::beast::http::string_body> res;
-        boost::beast::http::read(stream, buffer, res);
-
-        // Gracefully close socket
-        boost::system::error_code ec;
-        stream.socket().shutdown(tcp::socket::shutdown_both, ec);
-
-        // Retrieve status
-        result.status_code = static_cast<int>(res.result_int());
-        result.body = std::move(res.body());
-
-        // If the status wasn't good, report it
-        if (res.result() != boost::beast::http::status::ok) {
-            std::ostringstream err;
-            err << "Tracker HTTP error: " << res.result_int() << " "
-                << res.body();
-            result.error = err.str();
+        const std::uint32_t action = get_u32(reply.data());
+        if (action == kUdpError) {
+            result.error = "Tracker UDP error: " +
+                           std::string(reinterpret_cast<char *>(reply.data()) +
+                                           8,
+                                       n - 8);
+            return result;
+        }
+        if (action != kUdpAnnounce || n < 20) {
+            result.error = "Malformed UDP announce reply";
+            return result;
         }
+
+        const std::uint32_t interval = get_u32(reply.data() + 8);
+        const std::string packed(reinterpret_cast<char *>(reply.data()) + 20,
+                                 n - 20);
+        std::ostringstream body;
+        body << "d8:intervali" << interval << "e" << (v6 ? "6:peers6" : "5:peers")
+             << packed.size() << ":" << packed << "e";
+
+        result.status_code = 200;
+        result.body = body.str();
     } catch (const std::exception &e) {
         result.error = e.what();
     }
@@ -0,0 +1,227 @@
+#include "tracker.hpp"
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/ip/udp.hpp>
+#include <boost/asio/read_until.hpp>
+#include <boost/asio/streambuf.hpp>
+#include <boost/asio/write.hpp>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Tests for TrackerServer against a scripted tracker on loopback, run by
+// ctest. Each test returns whether it passed; failures are reported on
+// stderr
+
+namespace {
+
+using tcp = boost::asio::ip::tcp;
+using udp = boost::asio::ip::udp;
+
+#define EXPECT(cond)                                                          \
+    do {                                                                      \
+        if (!(cond)) {                                                        \
+            std::cerr << __func__ << ": " << __FILE__ << ":" << __LINE__      \
+                      << ": expected " #cond << "\n";                         \
+            return false;                                                     \
+        }                                                                     \
+    } while (0)
+
+// Read one request head off `sock` and answer it with a keep-alive reply
+void serve_one(tcp::socket &sock) {
+    boost::asio::streambuf buf;
+    boost::asio::read_until(sock, buf, "\r\n\r\n");
+    const std::string body = "d8:intervali60ee";
+    const std::string reply = "HTTP/1.1 200 OK\r\nContent-Length: " +
+                              std::to_string(body.size()) + "\r\n\r\n" +
+                              body;
+    boost::asio::write(sock, boost::asio::buffer(reply));
+}
+
+// The tracker closes a pooled connection while it sits idle. The next
+// announce gets it from the pool, finds it closed and goes again on a new
+// connection, without an error
+bool retries_on_connection_closed_while_idle() {
+    boost::asio::io_context ioc;
+    tcp::acceptor acceptor(ioc,
+                           {boost::asio::ip::make_address("127.0.0.1"), 0});
+    const std::string port = std::to_string(acceptor.local_endpoint().port());
+
+    // Serve the first connection once and close it, then the second one
+    std::promise<void> closed;
+    int accepted = 0;
+    acceptor.async_accept([&](boost::system::error_code ec, tcp::socket s) {
+        if (ec)
+            return;
+        ++accepted;
+        serve_one(s);
+        s.close();
+        closed.set_value();
+        acceptor.async_accept(
+            [&](boost::system::error_code ec, tcp::socket s) {
+                if (ec)
+                    return;
+                ++accepted;
+                serve_one(s);
+            });
+    });
+    // Bounded, so a client that never comes back can't hang the test
+    std::thread tracker([&] { ioc.run_for(std::chrono::seconds{5}); });
+
+    TrackerServer::AnnounceParams params;
+    params.info_hash = std::string(32, 'a');
+    params.peer_id = "-AA0001-000000000001";
+
+    TrackerServer server("127.0.0.1", port);
+    const auto first = server.announce(params);
+    closed.get_future().wait_for(std::chrono::seconds{5});
+    const auto second = server.announce(params);
+    tracker.join();
+
+    EXPECT(first.error.empty() && first.interval == 60);
+    EXPECT(second.error.empty() && second.interval == 60);
+    EXPECT(accepted == 2);
+    return true;
+}
+
+// A batch announce goes out as one /announce_batch request, and the reply's
+// files dict is split into each swarm's own body and interval. A swarm the
+// tracker left out gets an error of its own
+bool batch_reply_split_per_swarm() {
+    boost::asio::io_context ioc;
+    tcp::acceptor acceptor(ioc,
+                           {boost::asio::ip::make_address("127.0.0.1"), 0});
+    const std::string port = std::to_string(acceptor.local_endpoint().port());
+
+    const std::string a(32, 'a'), b(32, 'b'), c(32, 'c');
+    const std::string body_a = "d8:intervali60e5:peers6:\x7f\x01\x01\x01"
+                               "\x1a\xe1"
+                               "e";
+    const std::string body_b = "d8:intervali90e5:peers0:e";
+    const std::string reply_body = "d5:filesd32:" + a + body_a + "32:" + b +
+                                   body_b + "e8:intervali90ee";
+
+    std::string request;
+    acceptor.async_accept([&](boost::system::error_code ec, tcp::socket s) {
+        if (ec)
+            return;
+        boost::asio::streambuf buf;
+        boost::asio::read_until(s, buf, "\r\n\r\n");
+        request.assign(boost::asio::buffers_begin(buf.data()),
+                       boost::asio::buffers_end(buf.data()));
+        const std::string reply = "HTTP/1.1 200 OK\r\nContent-Length: " +
+                                  std::to_string(reply_body.size()) +
+                                  "\r\n\r\n" + reply_body;
+        boost::asio::write(s, boost::asio::buffer(reply));
+    });
+    std::thread tracker([&] { ioc.run_for(std::chrono::seconds{5}); });
+
+    TrackerServer::AnnounceParams params;
+    params.peer_id = "-AA0001-000000000001";
+    TrackerServer server("127.0.0.1", port);
+    const auto results = server.announce_batch(params, {a, b, c});
+    tracker.join();
+
+    EXPECT(request.rfind("GET /announce_batch?infohash=aaaa", 0) == 0);
+    EXPECT(request.find("compact=1") != std::string::npos);
+    EXPECT(results.size() == 3);
+    EXPECT(results[0].error.empty() && results[0].body == body_a &&
+           results[0].interval == 60);
+    EXPECT(results[1].error.empty() && results[1].body == body_b &&
+           results[1].interval == 90);
+    EXPECT(!results[2].error.empty());
+    return true;
+}
+
+std::uint32_t get_u32(const unsigned char *p) {
+    return (std::uint32_t(p[0]) << 24) | (std::uint32_t(p[1]) << 16) |
+           (std::uint32_t(p[2]) << 8) | std::uint32_t(p[3]);
+}
+
+void put_u32(unsigned char *p, std::uint32_t v) {
+    p[0] = static_cast<unsigned char>(v >> 24);
+    p[1] = static_cast<unsigned char>(v >> 16);
+    p[2] = static_cast<unsigned char>(v >> 8);
+    p[3] = static_cast<unsigned char>(v);
+}
+
+// A UDP tracker connects once and announces twice on one connection id.
+// When it then answers an announce with an error, the client asks for a new
+// id and sends the announce again
+bool udp_reuses_connection_id() {
+    boost::asio::io_context ioc;
+    udp::socket sock(ioc, {boost::asio::ip::make_address("127.0.0.1"), 0});
+    const std::string port = std::to_string(sock.local_endpoint().port());
+
+    // Connection ids handed out: 1, then 2. The third announce gets an error
+    std::vector<std::uint32_t> actions;     // as received
+    std::vector<unsigned char> announce_ids; // low byte of the id used
+    std::uint32_t next_id = 1;
+    std::array<unsigned char, 256> in{};
+    udp::endpoint from;
+    std::function<void()> serve = [&] {
+        sock.async_receive_from(
+            boost::asio::buffer(in), from,
+            [&](boost::system::error_code ec, std::size_t n) {
+                if (ec || n < 16)
+                    return;
+                std::array<unsigned char, 20> out{};
+                std::memcpy(out.data() + 4, in.data() + 12, 4); // txn
+                std::size_t len = 16;
+                const std::uint32_t action = get_u32(in.data() + 8);
+                actions.push_back(action);
+                if (action == 0) {
+                    put_u32(out.data() + 12, next_id++);
+                } else {
+                    announce_ids.push_back(in[7]);
+                    if (announce_ids.size() == 3) {
+                        put_u32(out.data(), 3);
+                        std::memcpy(out.data() + 8, "stale id", 8);
+                    } else {
+                        put_u32(out.data(), 1);
+                        put_u32(out.data() + 8, 60);
+                        len = 20;
+                    }
+                }
+                sock.send_to(boost::asio::buffer(out.data(), len), from);
+                serve();
+            });
+    };
+    serve();
+    std::thread tracker([&] { ioc.run_for(std::chrono::seconds{5}); });
+
+    TrackerServer::AnnounceParams params;
+    params.info_hash = std::string(32, 'a');
+    params.peer_id = "-AA0001-000000000001";
+
+    TrackerServer server("127.0.0.1", port, "/announce",
+                         TrackerServer::Protocol::udp);
+    const auto first = server.announce(params);
+    const auto second = server.announce(params);
+    const auto third = server.announce(params);
+    tracker.join();
+
+    EXPECT(first.error.empty() && first.interval == 60);
+    EXPECT(second.error.empty() && second.interval == 60);
+    EXPECT(third.error.empty() && third.interval == 60);
+    EXPECT((actions == std::vector<std::uint32_t>{0, 1, 1, 1, 0, 1}));
+    EXPECT((announce_ids == std::vector<unsigned char>{1, 1, 1, 2}));
+    return true;
+}
+
+} // namespace
+
+int main() {
+    bool passed = retries_on_connection_closed_while_idle();
+    passed = udp_reuses_connection_id() && passed;
+    passed = batch_reply_split_per_swarm() && passed;
+    std::cout << (passed ? "PASS" : "FAIL") << "\n";
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,644 @@
+#include "log.hpp"
+#include "server.hpp"
+#include "tracker_state.hpp"
+#include <algorithm>
+#include <atomic>
+#include <boost/asio.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <pthread.h>
+#include <random>
+#include <string>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+// Benchmarks for the tracker, in two modes.
+//
+// state: TrackerState in-process, no network. Times announces (upsert + peer
+// list body, as http_session does) and upsert + list_peers (the UDP path) as
+// a function of swarm size, and optionally gc(), a snapshot restore and the
+// resident memory each tracked peer costs:
+//
+//   tracker_bench [state] [--ops N] [--sizes 5,50,500,...] [--gc N]
+//                 [--restore N] [--memory N]
+//
+// http: drives a running tracker over loopback with announces from
+// `--swarms` x `--peers` distinct peers. `--rate` caps the total announce
+// rate (0: as fast as the connections go); latency is measured from when a
+// request was due, so a stalled tracker can't hide behind a slow client.
+// Given several ports (a local cluster), connections are dealt out over them
+// round robin and the row shows the aggregate rate. `--in-process` starts a
+// one-thread tracker inside the benchmark on the first port instead, and also
+// reports how many heap allocations the tracker made per request and how much
+// CPU time its thread spent on each, which gives the requests per second one
+// core can serve however much of the machine the load generator takes:
+//
+//   tracker_bench http [--host H] [--port P[,P...]] [--swarms S] [--peers N]
+//                      [--connections C] [--rate R] [--ops N]
+//                      [--mode keepalive|new] [--compact] [--in-process]
+
+using bench_clock = std::chrono::steady_clock;
+using tcp = boost::asio::ip::tcp;
+namespace http = boost::beast::http;
+
+// Heap allocations made by threads that opted in with t_count_allocs, so the
+// load generator's own allocations stay out of the count
+static std::atomic<uint64_t> g_allocs{0};
+static thread_local bool t_count_allocs = false;
+
+// CPU clock of the in-process tracker's thread
+static std::atomic<clockid_t> g_tracker_clock{CLOCK_THREAD_CPUTIME_ID};
+static std::atomic<bool> g_have_tracker_clock{false};
+
+static double cpu_seconds(clockid_t clock) {
+    timespec ts{};
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void *operator new(std::size_t n) {
+    if (t_count_allocs)
+        g_allocs.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(n ? n : 1))
+        return p;
+    throw std::bad_alloc();
+}
+void *operator new[](std::size_t n) { return ::operator new(n); }
+// Out of line, or GCC sees new'd memory reach free() and warns
+[[gnu::noinline]] void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { ::operator delete(p); }
+void operator delete(void *p, std::size_t) noexcept { ::operator delete(p); }
+void operator delete[](void *p, std::size_t) noexcept {
+    ::operator delete(p);
+}
+
+static std::vector<std::size_t> parse_sizes(const std::string &s) {
+    std::vector<std::size_t> out;
+    std::size_t start = 0;
+    while (start < s.size()) {
+        auto comma = s.find(',', start);
+        out.push_back(std::stoul(s.substr(start, comma - start)));
+        if (comma == std::string::npos)
+            break;
+        start = comma + 1;
+    }
+    return out;
+}
+
+static double percentile(std::vector<double> &v, double p) {
+    if (v.empty())
+        return 0.0;
+    auto idx = static_cast<std::size_t>(p * (v.size() - 1));
+    std::nth_element(v.begin(), v.begin() + idx, v.end());
+    return v[idx];
+}
+
+static void print_header(const char *what) {
+    std::printf("%-12s %10s %12s %10s %10s %10s\n", "op", what, "ops/s",
+                "p50(us)", "p99(us)", "p999(us)");
+}
+
+static void print_row(const char *op, std::size_t n, double per_sec,
+                      std::vector<double> &samples) {
+    std::printf("%-12s %10zu %12.0f %10.2f %10.2f %10.2f\n", op, n, per_sec,
+                percentile(samples, 0.50), percentile(samples, 0.99),
+                percentile(samples, 0.999));
+}
+
+// Real peer ids are 20 bytes, too long for the short string buffer
+static std::string bench_peer_id(std::size_t i) {
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "-BT0001-%012zu", i);
+    return buf;
+}
+
+// ---------------------------------------------------------------------------
+// state mode
+
+using state_op = std::function<void(TrackerState &, const std::string &,
+                                    const boost::asio::ip::address &,
+                                    uint16_t, const std::string &)>;
+
+/// Fill one swarm with `swarm_size` peers, then time `ops` runs of `op` from
+/// random existing members
+static void bench_swarm_size(const char *name, std::size_t swarm_size,
+                             std::size_t ops, const state_op &op) {
+    TrackerState state{1};
+    const std::string infohash(32, '\x42');
+    const auto addr = boost::asio::ip::make_address("10.0.0.1");
+
+    std::vector<std::string> ids;
+    ids.reserve(swarm_size);
+    for (std::size_t i = 0; i < swarm_size; ++i) {
+        ids.push_back(bench_peer_id(i));
+        state.upsert_peer(infohash, addr, static_cast<uint16_t>(i), ids.back());
+    }
+
+    std::mt19937 rng{1234};
+    std::uniform_int_distribution<std::size_t> pick(0, swarm_size - 1);
+    std::vector<double> samples;
+    samples.reserve(ops);
+
+    auto total_start = bench_clock::now();
+    for (std::size_t n = 0; n < ops; ++n) {
+        auto i = pick(rng);
+        auto start = bench_clock::now();
+        op(state, infohash, addr, static_cast<uint16_t>(i), ids[i]);
+        auto end = bench_clock::now();
+        samples.push_back(
+            std::chrono::duration<double, std::micro>(end - start).count());
+    }
+    auto total = std::chrono::duration<double>(bench_clock::now() - total_start)
+                     .count();
+    print_row(name, swarm_size, ops / total, samples);
+}
+
+/// Announce `peers` peers in swarms of 50 to `state`
+static void fill_swarms(TrackerState &state, std::size_t peers) {
+    std::string infohash(32, '\0');
+    for (std::size_t i = 0; i < peers; ++i) {
+        if (i % 50 == 0)
+            std::memcpy(infohash.data(), &i, sizeof(i));
+        auto addr = boost::asio::ip::address_v4(
+            static_cast<uint32_t>(0x0a000000 + i));
+        state.upsert_peer(infohash, addr, 6881, bench_peer_id(i));
+    }
+}
+
+/// Let `peers` peers go stale, then time the gc() pass that expires them
+static void bench_gc(std::size_t peers) {
+    TrackerState state{16, std::chrono::seconds{1}};
+    fill_swarms(state, peers);
+
+    // A bucket comes due ttl + one resolution after it was filled
+    std::this_thread::sleep_for(std::chrono::seconds{1} +
+                                2 * TrackerState::expiry_resolution);
+    auto start = bench_clock::now();
+    std::size_t expired = state.gc();
+    auto ms = std::chrono::duration<double, std::milli>(bench_clock::now() -
+                                                        start)
+                  .count();
+    std::printf("gc:       expired %zu of %zu peers in %.1f ms\n", expired,
+                peers, ms);
+}
+
+/// Snapshot `peers` peers, then restore them into a fresh TrackerState the
+/// way a restarting tracker would
+static void bench_restore(std::size_t peers) {
+    const std::size_t shards =
+        4 * std::max(1u, std::thread::hardware_concurrency());
+    std::string snapshot;
+    {
+        TrackerState state{shards};
+        fill_swarms(state, peers);
+        auto start = bench_clock::now();
+        state.write_snapshot(snapshot);
+        auto ms = std::chrono::duration<double, std::milli>(bench_clock::now() -
+                                                            start)
+                      .count();
+        std::printf("snapshot: %zu peers, %zu bytes, written in %.1f ms\n",
+                    peers, snapshot.size(), ms);
+    }
+
+    TrackerState state{shards};
+    auto start = bench_clock::now();
+    std::size_t restored = state.restore_snapshot(snapshot);
+    auto ms = std::chrono::duration<double, std::milli>(bench_clock::now() -
+                                                        start)
+                  .count();
+    std::printf("restore:  %zu peers in %.1f ms\n", restored, ms);
+}
+
+// Resident set size from /proc, 0 where there is no /proc
+static std::size_t resident_bytes() {
+    std::FILE *f = std::fopen("/proc/self/statm", "r");
+    if (!f)
+        return 0;
+    unsigned long pages = 0, resident = 0;
+    const int n = std::fscanf(f, "%lu %lu", &pages, &resident);
+    std::fclose(f);
+    return n == 2 ? resident * static_cast<std::size_t>(sysconf(_SC_PAGESIZE))
+                  : 0;
+}
+
+/// Resident memory growth from tracking `peers` peers in swarms of 50,
+/// expiry wheel included
+static void bench_memory(std::size_t peers) {
+    const std::size_t before = resident_bytes();
+    auto state = std::make_unique<TrackerState>(16);
+    fill_swarms(*state, peers);
+    const std::size_t after = resident_bytes();
+    if (before == 0 || after < before) {
+        std::printf("memory:   no /proc/self/statm, can't measure\n");
+        return;
+    }
+    std::printf("memory:   %zu peers, %.1f MiB resident, %.0f bytes/peer\n",
+                peers, (after - before) / 1048576.0,
+                double(after - before) / peers);
+}
+
+static int run_state(int argc, char **argv, int first) {
+    std::size_t ops = 20000;
+    std::vector<std::size_t> sizes{5, 50, 500, 5000, 50000};
+    std::size_t gc_peers = 0;
+    std::size_t restore = 0;
+    std::size_t memory = 0;
+
+    for (int i = first; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--ops" && i + 1 < argc) {
+            ops = std::stoul(argv[++i]);
+        } else if (arg == "--sizes" && i + 1 < argc) {
+            sizes = parse_sizes(argv[++i]);
+        } else if (arg == "--gc" && i + 1 < argc) {
+            gc_peers = std::stoul(argv[++i]);
+        } else if (arg == "--restore" && i + 1 < argc) {
+            restore = std::stoul(argv[++i]);
+        } else if (arg == "--memory" && i + 1 < argc) {
+            memory = std::stoul(argv[++i]);
+        } else {
+            std::cerr << "usage: tracker_bench [state] [--ops N] "
+                         "[--sizes a,b,c] [--gc N] [--restore N] "
+                         "[--memory N]\n";
+            return 1;
+        }
+    }
+
+    // First, while the heap holds nothing freed by the other runs that the
+    // fill could quietly reuse
+    if (memory > 0)
+        bench_memory(memory);
+
+    print_header("swarm");
+    for (auto size : sizes) {
+        if (size == 0)
+            continue;
+        bench_swarm_size("announce", size, ops,
+                         [](TrackerState &st, const std::string &ih,
+                            const boost::asio::ip::address &addr,
+                            uint16_t port, const std::string &id) {
+                             st.upsert_peer(ih, addr, port, id);
+                             auto body = st.peer_list_body(
+                                 ih, addr, port, id, PeerListFormat::json);
+                         });
+        bench_swarm_size("list_peers", size, ops,
+                         [](TrackerState &st, const std::string &ih,
+                            const boost::asio::ip::address &addr,
+                            uint16_t port, const std::string &id) {
+                             st.upsert_peer(ih, addr, port, id);
+                             auto peers = st.list_peers(ih, addr, port, id);
+                         });
+    }
+    if (gc_peers > 0)
+        bench_gc(gc_peers);
+    if (restore > 0)
+        bench_restore(restore);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// http mode
+
+struct load_options {
+    std::string host = "127.0.0.1";
+    std::vector<std::size_t> ports = {8080};
+    std::size_t swarms = 100;
+    std::size_t peers = 50; // per swarm
+    std::size_t connections = 8;
+    double rate = 0; // announces/s over all connections, 0: unthrottled
+    std::size_t ops = 100000;
+    bool keep_alive = true;
+    bool compact = false;
+    bool in_process = false;
+};
+
+struct load_result {
+    std::vector<double> samples; // us
+    std::size_t errors = 0;
+};
+
+static std::string url_encode_bytes(const std::string &bytes) {
+    static const char *hex = "0123456789ABCDEF";
+    std::string out;
+    out.reserve(bytes.size() * 3);
+    for (unsigned char c : bytes) {
+        out.push_back('%');
+        out.push_back(hex[c >> 4]);
+        out.push_back(hex[c & 0xF]);
+    }
+    return out;
+}
+
+/// One connection's worth of load: announces for randomly picked peers,
+/// spaced `interval` apart (or back to back when it is zero). Reconnects for
+/// every request in new-connection mode, and after any error
+class load_worker {
+  public:
+    load_worker(const load_options &opts, const tcp::endpoint &ep,
+                const std::vector<std::string> &infohashes, unsigned seed)
+        : opts_(opts), ep_(ep), infohashes_(infohashes), socket_(ioc_),
+          rng_(seed) {}
+
+    bool announce(std::size_t peer, load_result &out) {
+        const std::size_t swarm = peer / opts_.peers;
+        std::string target = "/announce?infohash=" + infohashes_[swarm] +
+                             "&peer_id=" + bench_peer_id(peer) + "&port=" +
+                             std::to_string(10000 + peer % 50000) +
+                             "&left=" + (peer % 4 == 0 ? "0" : "1000");
+        if (opts_.compact)
+            target += "&compact=1";
+
+        boost::system::error_code ec;
+        if (!socket_.is_open()) {
+            socket_.connect(ep_, ec);
+            if (ec) {
+                reset();
+                ++out.errors;
+                return false;
+            }
+            socket_.set_option(tcp::no_delay(true), ec);
+        }
+
+        http::request<http::empty_body> req{http::verb::get, target, 11};
+        req.set(http::field::host, opts_.host);
+        req.keep_alive(opts_.keep_alive);
+        http::write(socket_, req, ec);
+
+        http::response<http::string_body> res;
+        if (!ec)
+            http::read(socket_, buffer_, res, ec);
+        if (ec || res.result() != http::status::ok) {
+            reset();
+            ++out.errors;
+            return false;
+        }
+        if (!opts_.keep_alive || !res.keep_alive())
+            reset();
+        return true;
+    }
+
+    void run(std::size_t count, bench_clock::duration interval,
+             bench_clock::time_point start, load_result &out) {
+        std::uniform_int_distribution<std::size_t> pick(
+            0, opts_.swarms * opts_.peers - 1);
+        out.samples.reserve(count);
+        for (std::size_t n = 0; n < count; ++n) {
+            // Open loop when throttled: time from when the request was due
+            auto due = bench_clock::now();
+            if (interval.count() > 0) {
+                due = start + n * interval;
+                std::this_thread::sleep_until(due);
+            }
+            if (announce(pick(rng_), out)) {
+                out.samples.push_back(
+                    std::chrono::duration<double, std::micro>(
+                        bench_clock::now() - due)
+                        .count());
+            }
+        }
+        reset();
+    }
+
+  private:
+    void reset() {
+        boost::system::error_code ignored;
+        socket_.shutdown(tcp::socket::shutdown_both, ignored);
+        socket_.close(ignored);
+        buffer_.clear();
+    }
+
+    const load_options &opts_;
+    tcp::endpoint ep_;
+    const std::vector<std::string> &infohashes_;
+    boost::asio::io_context ioc_;
+    tcp::socket socket_;
+    boost::beast::flat_buffer buffer_;
+    std::mt19937 rng_;
+};
+
+/// Run a one-thread tracker on `ep`'s port on a thread of its own, counting
+/// its allocations. Returns once it accepts connections
+static std::thread start_tracker(const tcp::endpoint &ep) {
+    ServerOptions opts;
+    opts.port = ep.port();
+    opts.udp_port = 0;
+    opts.threads = 1;
+    opts.shards = 4;
+    opts.log_level = LogLevel::off;
+    opts.summary_interval = std::chrono::seconds{0};
+    opts.max_lag = std::chrono::milliseconds{0}; // the bench is the overload
+    std::thread server([opts] {
+        t_count_allocs = true;
+        clockid_t clock;
+        if (pthread_getcpuclockid(pthread_self(), &clock) == 0) {
+            g_tracker_clock = clock;
+            g_have_tracker_clock = true;
+        }
+        run_server(opts);
+    });
+
+    boost::asio::io_context ioc;
+    tcp::socket probe{ioc};
+    for (int attempt = 0; attempt < 200; ++attempt) {
+        boost::system::error_code ec;
+        probe.connect(ep, ec);
+        if (!ec)
+            return server;
+        probe.close(ec);
+        std::this_thread::sleep_for(std::chrono::milliseconds{10});
+    }
+    std::cerr << "tracker_bench: in-process tracker didn't come up on "
+              << ep << "\n";
+    std::raise(SIGTERM);
+    server.join();
+    return {};
+}
+
+static int run_http(int argc, char **argv, int first) {
+    load_options opts;
+    for (int i = first; i < argc; ++i) {
+        std::string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (arg == "--host" && has_value) {
+            opts.host = argv[++i];
+        } else if (arg == "--port" && has_value) {
+            opts.ports = parse_sizes(argv[++i]);
+        } else if (arg == "--swarms" && has_value) {
+            opts.swarms = std::max<std::size_t>(1, std::stoul(argv[++i]));
+        } else if (arg == "--peers" && has_value) {
+            opts.peers = std::max<std::size_t>(1, std::stoul(argv[++i]));
+        } else if (arg == "--connections" && has_value) {
+            opts.connections = std::max<std::size_t>(1, std::stoul(argv[++i]));
+        } else if (arg == "--rate" && has_value) {
+            opts.rate = std::stod(argv[++i]);
+        } else if (arg == "--ops" && has_value) {
+            opts.ops = std::stoul(argv[++i]);
+        } else if (arg == "--mode" && has_value) {
+            std::string mode = argv[++i];
+            if (mode != "keepalive" && mode != "new") {
+                std::cerr << "--mode must be keepalive or new\n";
+                return 1;
+            }
+            opts.keep_alive = mode == "keepalive";
+        } else if (arg == "--compact") {
+            opts.compact = true;
+        } else if (arg == "--in-process") {
+            opts.in_process = true;
+        } else {
+            std::cerr << "usage: tracker_bench http [--host H] "
+                         "[--port P[,P...]] "
+                         "[--swarms S] [--peers N] [--connections C] "
+                         "[--rate R] [--ops N] [--mode keepalive|new] "
+                         "[--compact] [--in-process]\n";
+            return 1;
+        }
+    }
+
+    if (opts.ports.empty()) {
+        std::cerr << "--port needs at least one port\n";
+        return 1;
+    }
+    boost::asio::io_context ioc;
+    tcp::resolver resolver{ioc};
+    std::vector<tcp::endpoint> eps;
+    for (std::size_t port : opts.ports) {
+        eps.push_back(
+            *resolver.resolve(opts.host, std::to_string(port)).begin());
+    }
+
+    std::thread server;
+    if (opts.in_process) {
+        eps.resize(1);
+        server = start_tracker(eps[0]);
+        if (!server.joinable())
+            return 1;
+    }
+
+    std::vector<std::string> infohashes;
+    infohashes.reserve(opts.swarms);
+    for (std::size_t s = 0; s < opts.swarms; ++s) {
+        std::string ih(32, '\0');
+        std::memcpy(ih.data(), &s, sizeof(s));
+        infohashes.push_back(url_encode_bytes(ih));
+    }
+
+    std::vector<std::unique_ptr<load_worker>> workers;
+    for (std::size_t c = 0; c < opts.connections; ++c) {
+        workers.push_back(std::make_unique<load_worker>(
+            opts, eps[c % eps.size()], infohashes,
+            static_cast<unsigned>(1234 + c)));
+    }
+
+    // Announce every peer once first, so the timed run sees full swarms
+    const std::size_t total_peers = opts.swarms * opts.peers;
+    {
+        std::vector<load_result> results(opts.connections);
+        std::vector<std::thread> pool;
+        for (std::size_t c = 0; c < opts.connections; ++c) {
+            pool.emplace_back([&, c] {
+                for (std::size_t p = c; p < total_peers;
+                     p += opts.connections)
+                    workers[c]->announce(p, results[c]);
+            });
+        }
+        for (auto &t : pool)
+            t.join();
+        std::size_t errors = 0;
+        for (auto &r : results)
+            errors += r.errors;
+        if (errors == total_peers) {
+            std::cerr << "tracker_bench: no tracker answering on " << eps[0]
+                      << "\n";
+            return 1;
+        }
+    }
+
+    bench_clock::duration interval{0};
+    if (opts.rate > 0) {
+        interval = std::chrono::duration_cast<bench_clock::duration>(
+            std::chrono::duration<double>(opts.connections / opts.rate));
+    }
+
+    const std::size_t per_worker = opts.ops / opts.connections;
+    std::vector<load_result> results(opts.connections);
+    std::vector<std::thread> pool;
+    const uint64_t allocs_before = g_allocs.load();
+    const double cpu_before =
+        g_have_tracker_clock ? cpu_seconds(g_tracker_clock) : 0;
+    const auto start = bench_clock::now();
+    for (std::size_t c = 0; c < opts.connections; ++c) {
+        pool.emplace_back([&, c] {
+            workers[c]->run(per_worker, interval, start, results[c]);
+        });
+    }
+    for (auto &t : pool)
+        t.join();
+    const double secs =
+        std::chrono::duration<double>(bench_clock::now() - start).count();
+    const uint64_t allocs = g_allocs.load() - allocs_before;
+    const double cpu =
+        g_have_tracker_clock ? cpu_seconds(g_tracker_clock) - cpu_before : 0;
+
+    load_result all;
+    for (auto &r : results) {
+        all.errors += r.errors;
+        all.samples.insert(all.samples.end(), r.samples.begin(),
+                           r.samples.end());
+    }
+
+    std::printf("%zu swarm(s) x %zu peer(s), %zu %s connection(s) to %zu "
+                "node(s), ",
+                opts.swarms, opts.peers, opts.connections,
+                opts.keep_alive ? "keep-alive" : "new-per-request",
+                eps.size());
+    if (opts.rate > 0)
+        std::printf("target rate %.0f/s\n", opts.rate);
+    else
+        std::printf("unthrottled\n");
+    print_header("requests");
+    print_row(opts.keep_alive ? "keepalive" : "new", all.samples.size(),
+              all.samples.size() / secs, all.samples);
+    if (all.errors > 0)
+        std::printf("errors: %zu\n", all.errors);
+
+    if (server.joinable()) {
+        std::printf("allocations: %.2f per request in the tracker (%llu in "
+                    "total)\n",
+                    all.samples.empty() ? 0.0
+                                        : double(allocs) / all.samples.size(),
+                    static_cast<unsigned long long>(allocs));
+        if (cpu > 0 && !all.samples.empty()) {
+            std::printf("tracker cpu: %.2f us per request, %.0f requests/s "
+                        "per core\n",
+                        cpu * 1e6 / all.samples.size(),
+                        all.samples.size() / cpu);
+        }
+        // run_server stops on SIGTERM like the real thing
+        std::raise(SIGTERM);
+        server.join();
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    // Keep TrackerState's trace logging out of the numbers
+    tlog::set_level(LogLevel::off);
+
+    std::string mode = argc > 1 ? argv[1] : "";
+    if (mode == "http")
+        return run_http(argc, argv, 2);
+    if (mode == "state")
+        return run_state(argc, argv, 2);
+    return run_state(argc, argv, 1);
+}
@@ -0,0 +1,155 @@
+#include "admission.hpp"
+#include "log.hpp"
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+// Buckets hold two seconds' worth of tokens, so short bursts (a client
+// announcing several torrents at startup) go through
+constexpr double kBurstSeconds = 2.0;
+
+double burst_of(double rate) { return std::max(1.0, rate * kBurstSeconds); }
+
+std::string http_message(const char *status, const std::string &body,
+                         const std::string &extra_headers) {
+    return std::string("HTTP/1.1 ") + status +
+           "\r\nServer: btmini-tracker\r\nContent-Type: application/json\r\n" +
+           extra_headers + "Content-Length: " + std::to_string(body.size()) +
+           "\r\nConnection: close\r\n\r\n" + body;
+}
+
+} // namespace
+
+std::size_t
+AdmissionControl::AddrKeyHash::operator()(const AddrKey &k) const noexcept {
+    uint64_t hi, lo;
+    std::memcpy(&hi, k.data(), 8);
+    std::memcpy(&lo, k.data() + 8, 8);
+    uint64_t h = (hi ^ (lo * 0x9e3779b97f4a7c15ULL)) * 0xbf58476d1ce4e5b9ULL;
+    return static_cast<std::size_t>(h ^ (h >> 31));
+}
+
+AdmissionControl::AdmissionControl(Limits limits)
+    : limits(limits), shards_(std::make_unique<Shard[]>(kShards)) {
+    const std::string interval =
+        std::to_string(limits.overload_interval.count());
+    overloaded_body_ = R"({"error":"overloaded","interval":)" + interval + "}";
+    limited_body_ = R"({"error":"rate limited","interval":)" + interval + "}";
+    overloaded_ = http_message("503 Service Unavailable", overloaded_body_,
+                               "Retry-After: " + interval + "\r\n");
+    limited_ = http_message("429 Too Many Requests", limited_body_,
+                            "Retry-After: " + interval + "\r\n");
+}
+
+/// Refill the caller's buckets for the time since they were last touched and
+/// take `cost` tokens from the requested one. Refused if it is empty unless
+/// not `may_refuse`; the tokens are then taken anyway, going into debt
+bool AdmissionControl::take(const boost::asio::ip::address &addr,
+                            bool announce, double cost, bool may_refuse,
+                            std::chrono::steady_clock::time_point now) {
+    AddrKey key;
+    if (addr.is_v4()) {
+        key = boost::asio::ip::make_address_v6(boost::asio::ip::v4_mapped,
+                                               addr.to_v4())
+                  .to_bytes();
+    } else {
+        key = addr.to_v6().to_bytes();
+    }
+
+    const std::size_t h = AddrKeyHash{}(key);
+    Shard &shard = shards_[h % kShards];
+    const double conn_burst = burst_of(limits.conn_rate);
+    const double announce_burst = burst_of(limits.announce_rate);
+
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    auto [it, fresh] = shard.buckets.try_emplace(
+        key, Buckets{conn_burst, announce_burst, now});
+    Buckets &b = it->second;
+    if (!fresh && now > b.refilled) {
+        const double secs =
+            std::chrono::duration<double>(now - b.refilled).count();
+        b.conn_tokens =
+            std::min(conn_burst, b.conn_tokens + secs * limits.conn_rate);
+        b.announce_tokens = std::min(
+            announce_burst, b.announce_tokens + secs * limits.announce_rate);
+        b.refilled = now;
+    }
+
+    double &tokens = announce ? b.announce_tokens : b.conn_tokens;
+    if (may_refuse && tokens < 1.0)
+        return false;
+    tokens -= cost;
+    return true;
+}
+
+AdmissionControl::Verdict
+AdmissionControl::admit_connection(const boost::asio::ip::address &addr,
+                                   std::chrono::steady_clock::time_point now) {
+    if (overloaded())
+        return Verdict::overloaded;
+    if (limits.conn_rate > 0 && !take(addr, false, 1.0, true, now))
+        return Verdict::rate_limited;
+    return Verdict::admit;
+}
+
+AdmissionControl::Verdict
+AdmissionControl::admit_announce(const boost::asio::ip::address &addr,
+                                 std::chrono::steady_clock::time_point now) {
+    if (lagging_.load(std::memory_order_relaxed))
+        return Verdict::overloaded;
+    if (limits.announce_rate > 0 && !take(addr, true, 1.0, true, now))
+        return Verdict::rate_limited;
+    return Verdict::admit;
+}
+
+void AdmissionControl::charge_announces(
+    const boost::asio::ip::address &addr, std::size_t count,
+    std::chrono::steady_clock::time_point now) {
+    if (limits.announce_rate > 0 && count > 0)
+        take(addr, true, double(count), false, now);
+}
+
+void AdmissionControl::set_lagging(bool lagging) {
+    if (lagging_.exchange(lagging, std::memory_order_relaxed) != lagging) {
+        TLOG(warn) << "[AdmissionControl] "
+                   << (lagging ? "io threads are lagging, shedding load"
+                               : "io threads caught up, admitting again");
+    }
+}
+
+bool AdmissionControl::overloaded() const {
+    if (lagging_.load(std::memory_order_relaxed))
+        return true;
+    return limits.max_connections > 0 &&
+           active_.load(std::memory_order_relaxed) >= limits.max_connections;
+}
+
+void AdmissionControl::sweep(std::chrono::steady_clock::time_point now) {
+    if (limits.conn_rate <= 0 && limits.announce_rate <= 0)
+        return;
+    Shard &shard =
+        shards_[next_sweep_.fetch_add(1, std::memory_order_relaxed) % kShards];
+
+    // A bucket that would be full again is the same as no bucket. One in
+    // debt has to stay until the debt is paid off
+    const double conn_burst = burst_of(limits.conn_rate);
+    const double announce_burst = burst_of(limits.announce_rate);
+    auto full = [&](const Buckets &b) {
+        const double secs =
+            std::chrono::duration<double>(now - b.refilled).count();
+        return (limits.conn_rate <= 0 ||
+                b.conn_tokens + secs * limits.conn_rate >= conn_burst) &&
+               (limits.announce_rate <= 0 ||
+                b.announce_tokens + secs * limits.announce_rate >=
+                    announce_burst);
+    };
+
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    for (auto it = shard.buckets.begin(); it != shard.buckets.end();) {
+        if (full(it->second))
+            it = shard.buckets.erase(it);
+        else
+            ++it;
+    }
+}
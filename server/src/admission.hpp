@@ -0,0 +1,112 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <boost/asio/ip/address.hpp>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/// Decides what the tracker is willing to serve. Every source IP gets two
+/// token buckets, one for new connections and one for announces, refilled at
+/// a fixed rate up to a burst of two seconds' worth. A batch announce may
+/// take the announce bucket into debt, which holds back the IP's next
+/// announces until it is paid off. On top of that the
+/// tracker counts as overloaded while too many connections are open (new
+/// ones are turned away at accept) or while the io threads fall behind their
+/// timers (announces are turned away too). Whatever is turned away gets a
+/// canned "come back later" answer and never touches TrackerState.
+class AdmissionControl {
+  public:
+    enum class Verdict { admit, overloaded, rate_limited };
+
+    struct Limits {
+        double conn_rate = 0;            // per IP per second, 0: unlimited
+        double announce_rate = 0;        // per IP per second, 0: unlimited
+        std::size_t max_connections = 0; // open at once, 0: unlimited
+        std::chrono::seconds overload_interval{600};
+    };
+
+    explicit AdmissionControl(Limits limits);
+
+    /// Called on accept, before any session is set up
+    Verdict admit_connection(
+        const boost::asio::ip::address &addr,
+        std::chrono::steady_clock::time_point now =
+            std::chrono::steady_clock::now());
+    /// Called for every HTTP or UDP announce
+    Verdict admit_announce(const boost::asio::ip::address &addr,
+                           std::chrono::steady_clock::time_point now =
+                               std::chrono::steady_clock::now());
+    /// Charge `count` more announces to `addr` once admit_announce() has let
+    /// one through, as a batch announcing into `count` more swarms does.
+    /// Never refuses: a batch bigger than the burst goes through and puts
+    /// the bucket into debt instead, so it is paid for by the IP's next
+    /// announces rather than refused forever
+    void charge_announces(const boost::asio::ip::address &addr,
+                          std::size_t count,
+                          std::chrono::steady_clock::time_point now =
+                              std::chrono::steady_clock::now());
+
+    void connection_opened() {
+        active_.fetch_add(1, std::memory_order_relaxed);
+    }
+    void connection_closed() {
+        active_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    /// Fed by the io lag probe: whether timers are firing late
+    void set_lagging(bool lagging);
+    bool overloaded() const;
+
+    /// Drop the buckets of IPs that have been quiet long enough to be full
+    /// again. Does one shard per call, so it can run on every expiry tick
+    void sweep(std::chrono::steady_clock::time_point now =
+                   std::chrono::steady_clock::now());
+
+    /// Pre-built responses for shed requests: a 503 with Retry-After and
+    /// the overload interval, and a 429 for rate-limited sources. The whole
+    /// HTTP message, so they can be written to a socket as is
+    const std::string &overloaded_response() const { return overloaded_; }
+    const std::string &rate_limited_response() const { return limited_; }
+    /// Just the JSON bodies of the above
+    const std::string &overloaded_body() const { return overloaded_body_; }
+    const std::string &rate_limited_body() const { return limited_body_; }
+
+    const Limits limits;
+
+  private:
+    struct Buckets {
+        double conn_tokens;
+        double announce_tokens;
+        std::chrono::steady_clock::time_point refilled;
+    };
+
+    using AddrKey = std::array<unsigned char, 16>; // v4 stored v4-mapped
+
+    struct AddrKeyHash {
+        std::size_t operator()(const AddrKey &k) const noexcept;
+    };
+
+    struct alignas(64) Shard {
+        std::mutex mtx;
+        std::unordered_map<AddrKey, Buckets, AddrKeyHash> buckets;
+    };
+
+    static constexpr std::size_t kShards = 16;
+
+    bool take(const boost::asio::ip::address &addr, bool announce,
+              double cost, bool may_refuse,
+              std::chrono::steady_clock::time_point now);
+
+    std::unique_ptr<Shard[]> shards_;
+    std::atomic<std::size_t> next_sweep_{0};
+    std::atomic<std::size_t> active_{0};
+    std::atomic<bool> lagging_{false};
+
+    std::string overloaded_, limited_;
+    std::string overloaded_body_, limited_body_;
+};
@@ -0,0 +1,74 @@
+#include "announce_interval.hpp"
+#include <algorithm>
+#include <cmath>
+#include <functional>
+
+namespace {
+
+// Swarms up to one peer list keep the base interval; beyond that it grows
+// linearly to double at kLargeSwarm peers
+constexpr std::size_t kListPeers = 50;
+constexpr std::size_t kLargeSwarm = 1000;
+
+// Weight of the newest one-second sample in the smoothed rate
+constexpr double kRateSmoothing = 0.3;
+
+constexpr double kJitter = 0.1;
+
+} // namespace
+
+IntervalPolicy::IntervalPolicy(Config config) : config(config) {}
+
+void IntervalPolicy::update(uint64_t announces,
+                            std::chrono::steady_clock::time_point now) {
+    if (last_update_ == std::chrono::steady_clock::time_point{}) {
+        last_announces_ = announces;
+        last_update_ = now;
+        return;
+    }
+    const double secs =
+        std::chrono::duration<double>(now - last_update_).count();
+    if (secs <= 0)
+        return;
+
+    const double sample = (announces - last_announces_) / secs;
+    const double rate = rate_.load(std::memory_order_relaxed) +
+                        kRateSmoothing *
+                            (sample - rate_.load(std::memory_order_relaxed));
+    rate_.store(rate, std::memory_order_relaxed);
+    last_announces_ = announces;
+    last_update_ = now;
+
+    if (config.target_rate <= 0 || rate <= 0)
+        return;
+
+    // Clients only hear about a new interval on their next announce, so the
+    // rate answers a change about one interval later. Steering the factor
+    // (in log space) with a time constant of two intervals keeps it from
+    // overshooting while the rate catches up
+    double factor = factor_.load(std::memory_order_relaxed);
+    const double interval = config.base.count() * factor;
+    factor *= std::exp(std::log(rate / config.target_rate) * secs /
+                       (2 * interval));
+    const double max_factor =
+        std::max(1.0, double(config.max.count()) / config.base.count());
+    factor_.store(std::clamp(factor, 1.0, max_factor),
+                  std::memory_order_relaxed);
+}
+
+AnnounceTiming IntervalPolicy::timing(std::size_t swarm_size,
+                                      std::string_view peer_id) const {
+    double secs = config.base.count() * factor_.load(std::memory_order_relaxed);
+    if (swarm_size > kListPeers) {
+        secs *= 1.0 + std::min(1.0, double(swarm_size - kListPeers) /
+                                        (kLargeSwarm - kListPeers));
+    }
+
+    // Same peer, same offset: its announces keep their own spacing
+    const std::size_t h = std::hash<std::string_view>{}(peer_id);
+    secs *= 1.0 + kJitter * ((h % 2001) / 1000.0 - 1.0);
+
+    secs = std::clamp(secs, 1.0, double(config.max.count()));
+    const auto interval = static_cast<uint32_t>(secs);
+    return {interval, std::max<uint32_t>(1, interval / 2)};
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include "peer_list.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+/// Picks the re-announce interval handed out with every announce response.
+/// It starts from a base interval and stretches it
+///  - by a load factor, steered once a second so the measured announce rate
+///    settles at `target_rate` (every peer re-announcing half as often halves
+///    the rate), never shrinking below the base;
+///  - for swarms bigger than one peer list, whose peers gain little from
+///    fresh lists;
+///  - by a fixed per-peer jitter of up to +-10%, so peers that all showed up
+///    at once (a restart, a popular release) drift apart instead of coming
+///    back in lockstep.
+/// `min interval` is half the interval.
+class IntervalPolicy {
+  public:
+    struct Config {
+        std::chrono::seconds base{60};
+        std::chrono::seconds max{1800};
+        double target_rate = 10000; // announces per second, 0: no load factor
+    };
+
+    explicit IntervalPolicy(Config config);
+
+    /// Fed once a second, always from the same timer, with the running
+    /// announce total
+    void update(uint64_t announces, std::chrono::steady_clock::time_point now);
+
+    /// Timing for `peer_id` announcing into a swarm of `swarm_size` peers
+    AnnounceTiming timing(std::size_t swarm_size,
+                          std::string_view peer_id) const;
+
+    /// Smoothed announce rate and current load factor, for logging
+    double rate() const { return rate_.load(std::memory_order_relaxed); }
+    double load_factor() const {
+        return factor_.load(std::memory_order_relaxed);
+    }
+
+    const Config config;
+
+  private:
+    std::atomic<double> rate_{0};
+    std::atomic<double> factor_{1};
+    uint64_t last_announces_ = 0;
+    std::chrono::steady_clock::time_point last_update_;
+};
@@ -0,0 +1,145 @@
+#include "announce_query.hpp"
+
+namespace {
+
+int from_hex(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+// Parameter names are plain ASCII in practice; only decode the rare one
+// that was escaped anyway
+bool key_is(std::string_view raw, std::string_view name) {
+    if (raw.find_first_of("%+") == std::string_view::npos)
+        return raw == name;
+    char buf[16];
+    long n = percent_decode(raw, buf, sizeof(buf));
+    return n >= 0 && std::string_view(buf, static_cast<std::size_t>(n)) == name;
+}
+
+template <typename T> bool parse_uint(std::string_view raw, T max, T &out) {
+    if (raw.empty() || raw.size() > 20)
+        return false;
+    uint64_t v = 0;
+    for (char c : raw) {
+        if (c < '0' || c > '9')
+            return false;
+        uint64_t next = v * 10 + static_cast<uint64_t>(c - '0');
+        if (next < v)
+            return false; // overflowed uint64_t
+        v = next;
+    }
+    if (v > static_cast<uint64_t>(max))
+        return false;
+    out = static_cast<T>(v);
+    return true;
+}
+
+AnnounceEvent parse_event(std::string_view raw) {
+    if (raw == "started")
+        return AnnounceEvent::started;
+    if (raw == "completed")
+        return AnnounceEvent::completed;
+    if (raw == "stopped")
+        return AnnounceEvent::stopped;
+    return AnnounceEvent::none; // empty or unknown: a regular announce
+}
+
+} // namespace
+
+long percent_decode(std::string_view in, char *out, std::size_t cap) {
+    std::size_t n = 0;
+    for (std::size_t i = 0; i < in.size(); ++i) {
+        if (n == cap)
+            return -1;
+        char c = in[i];
+        if (c == '%' && i + 2 < in.size()) {
+            int hi = from_hex(in[i + 1]);
+            int lo = from_hex(in[i + 2]);
+            if (hi >= 0 && lo >= 0) {
+                out[n++] = static_cast<char>((hi << 4) | lo);
+                i += 2;
+                continue;
+            }
+            // malformed % sequence, keep as-is
+        } else if (c == '+') {
+            // application/x-www-form-urlencoded space
+            c = ' ';
+        }
+        out[n++] = c;
+    }
+    return static_cast<long>(n);
+}
+
+const char *query_error_body(QueryError err) {
+    switch (err) {
+    case QueryError::missing:
+        return R"({"error":"missing infohash|peer_id|port"})";
+    case QueryError::bad_infohash:
+        return R"({"error":"bad infohash"})";
+    case QueryError::bad_peer_id:
+        return R"({"error":"bad peer_id"})";
+    case QueryError::bad_port:
+        return R"({"error":"bad port"})";
+    case QueryError::none:
+        break;
+    }
+    return R"({"error":"bad request"})";
+}
+
+QueryError parse_announce_query(std::string_view target, AnnounceQuery &out) {
+    bool have_infohash = false, have_peer_id = false, have_port = false;
+    bool have_event = false, have_compact = false, have_left = false;
+    bool have_num_want = false;
+    QueryError err = QueryError::none;
+
+    for_each_query_param(target, [&](std::string_view key,
+                                     std::string_view raw) {
+        if (!have_infohash && key_is(key, "infohash")) {
+            have_infohash = true;
+            long n = percent_decode(raw, out.infohash.data(),
+                                    out.infohash.size());
+            if (n != static_cast<long>(out.infohash.size()))
+                err = QueryError::bad_infohash;
+        } else if (!have_peer_id && key_is(key, "peer_id")) {
+            have_peer_id = true;
+            long n = percent_decode(raw, out.peer_id_buf.data(),
+                                    out.peer_id_buf.size());
+            if (n <= 0)
+                err = QueryError::bad_peer_id;
+            else
+                out.peer_id_len = static_cast<std::size_t>(n);
+        } else if (!have_port && key_is(key, "port")) {
+            have_port = true;
+            if (!parse_uint<uint16_t>(raw, 65535, out.port))
+                err = QueryError::bad_port;
+        } else if (!have_event && key_is(key, "event")) {
+            have_event = true;
+            out.event = parse_event(raw);
+        } else if (!have_compact && key_is(key, "compact")) {
+            have_compact = true;
+            out.compact = raw == "1";
+        } else if (!have_left && key_is(key, "left")) {
+            have_left = true;
+            // An unparsable left is treated like a missing one
+            out.has_left = parse_uint<uint64_t>(raw, UINT64_MAX, out.left);
+        } else if (!have_num_want && key_is(key, "numwant")) {
+            have_num_want = true;
+            unsigned v = 0;
+            if (parse_uint<unsigned>(raw, 100000, v))
+                out.num_want = static_cast<int>(v);
+        }
+        return err == QueryError::none;
+    });
+
+    if (err != QueryError::none)
+        return err;
+    if (!have_infohash || !have_peer_id || !have_port)
+        return QueryError::missing;
+    return QueryError::none;
+}
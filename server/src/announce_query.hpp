@@ -0,0 +1,74 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+enum class AnnounceEvent { none, started, completed, stopped };
+
+/// The parameters of an announce, decoded straight out of the request target
+/// into fixed-size storage. Parsing one never touches the heap
+struct AnnounceQuery {
+    static constexpr std::size_t kInfohashLen = 32; // SHA-256
+    static constexpr std::size_t kMaxPeerIdLen = 20;
+
+    std::array<char, kInfohashLen> infohash{};
+    std::array<char, kMaxPeerIdLen> peer_id_buf{};
+    std::size_t peer_id_len = 0;
+    uint16_t port = 0;
+    AnnounceEvent event = AnnounceEvent::none;
+    bool compact = false;
+    bool has_left = false;
+    uint64_t left = 0;
+    int num_want = -1; // -1: not given
+
+    std::string_view infohash_view() const {
+        return {infohash.data(), infohash.size()};
+    }
+    std::string_view peer_id() const {
+        return {peer_id_buf.data(), peer_id_len};
+    }
+};
+
+enum class QueryError {
+    none,
+    missing,      // infohash, peer_id or port not given
+    bad_infohash, // not exactly 32 bytes once decoded
+    bad_peer_id,  // empty or longer than 20 bytes once decoded
+    bad_port,
+};
+
+/// JSON error body matching a QueryError, for the 400 response
+const char *query_error_body(QueryError err);
+
+/// One pass over the query string of `target`. Unknown parameters are
+/// skipped without being decoded; when a parameter repeats, the first one
+/// wins
+QueryError parse_announce_query(std::string_view target, AnnounceQuery &out);
+
+/// Percent-decode `in` (with '+' as space) into `out`, which holds `cap`
+/// bytes. Returns the decoded length, or -1 if it would not fit
+long percent_decode(std::string_view in, char *out, std::size_t cap);
+
+/// Call `fn(key, raw_value)` for every key=value pair in the query string of
+/// `target`, stopping early if it returns false. Keys and values are handed
+/// over still encoded
+template <typename Fn>
+void for_each_query_param(std::string_view target, Fn &&fn) {
+    auto pos = target.find('?');
+    if (pos == std::string_view::npos)
+        return;
+    std::string_view q = target.substr(pos + 1);
+    while (!q.empty()) {
+        auto amp = q.find('&');
+        auto pair = q.substr(0, amp);
+        auto eq = pair.find('=');
+        if (eq != std::string_view::npos &&
+            !fn(pair.substr(0, eq), pair.substr(eq + 1)))
+            return;
+        if (amp == std::string_view::npos)
+            return;
+        q.remove_prefix(amp + 1);
+    }
+}
@@ -0,0 +1,133 @@
+#include "announce_request.hpp"
+#include <array>
+
+namespace {
+
+constexpr std::string_view kPrefix = "GET /announce?";
+
+// RFC 9110 token characters, which header names are made of
+constexpr auto kTchar = [] {
+    std::array<bool, 256> t{};
+    for (unsigned char c : std::string_view("!#$%&'*+-.^_`|~"))
+        t[c] = true;
+    for (int c = '0'; c <= '9'; ++c)
+        t[c] = true;
+    for (int c = 'a'; c <= 'z'; ++c)
+        t[c] = t[c - 'a' + 'A'] = true;
+    return t;
+}();
+
+// `lower` is all lower case letters and '-'
+bool iequals(std::string_view s, std::string_view lower) {
+    if (s.size() != lower.size())
+        return false;
+    for (std::size_t i = 0; i < s.size(); ++i) {
+        if ((s[i] | 0x20) != lower[i])
+            return false;
+    }
+    return true;
+}
+
+std::string_view trim(std::string_view s) {
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+        s.remove_prefix(1);
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t'))
+        s.remove_suffix(1);
+    return s;
+}
+
+} // namespace
+
+// One pass, a line at a time: memchr finds each line feed, and a line only
+// counts if a carriage return comes right before it. Bytes are otherwise
+// only looked at where they mean something: the target is handed to the
+// query parser as is, which copes with anything, and values of headers
+// that aren't read are skipped unseen. Checking those byte by byte would
+// cost more than the rest of the parse
+HeadParse parse_announce_request(std::string_view data, AnnounceRequest &out) {
+    if (data.size() < kPrefix.size()) {
+        return kPrefix.substr(0, data.size()) == data ? HeadParse::need_more
+                                                      : HeadParse::fallback;
+    }
+    if (data.substr(0, kPrefix.size()) != kPrefix)
+        return HeadParse::fallback;
+
+    const std::string_view head = data.substr(0, kMaxAnnounceHead);
+    const HeadParse incomplete = head.size() < kMaxAnnounceHead
+                                     ? HeadParse::need_more
+                                     : HeadParse::fallback;
+
+    // GET <target> HTTP/1.x
+    std::size_t eol = head.find('\n');
+    if (eol == std::string_view::npos)
+        return incomplete;
+    if (head[eol - 1] != '\r')
+        return HeadParse::fallback;
+    std::string_view line = head.substr(0, eol - 1);
+    const std::size_t space = line.find(' ', 4);
+    if (space == std::string_view::npos)
+        return HeadParse::fallback;
+    const std::string_view target = line.substr(4, space - 4);
+    const std::string_view proto = line.substr(space + 1);
+    unsigned version;
+    if (proto == "HTTP/1.1")
+        version = 11;
+    else if (proto == "HTTP/1.0")
+        version = 10;
+    else
+        return HeadParse::fallback;
+
+    bool seen_connection = false;
+    bool close = false;
+    bool keep_alive = false;
+    std::size_t pos = eol + 1;
+    for (;;) {
+        eol = head.find('\n', pos);
+        if (eol == std::string_view::npos)
+            return incomplete;
+        // A bare line feed, a blank line made of one included
+        if (head[eol - 1] != '\r')
+            return HeadParse::fallback;
+        line = head.substr(pos, eol - 1 - pos);
+        pos = eol + 1;
+        if (line.empty())
+            break;
+
+        const std::size_t colon = line.find(':');
+        if (colon == 0 || colon == std::string_view::npos)
+            return HeadParse::fallback;
+        const std::string_view name = line.substr(0, colon);
+        for (unsigned char c : name) {
+            if (!kTchar[c])
+                return HeadParse::fallback;
+        }
+        std::string_view value = trim(line.substr(colon + 1));
+
+        if (iequals(name, "content-length")) {
+            if (value != "0")
+                return HeadParse::fallback;
+        } else if (iequals(name, "transfer-encoding")) {
+            return HeadParse::fallback;
+        } else if (iequals(name, "connection")) {
+            // Beast only reads the first one
+            if (seen_connection)
+                return HeadParse::fallback;
+            seen_connection = true;
+            for (;;) {
+                const std::size_t comma = value.find(',');
+                const std::string_view token = trim(value.substr(0, comma));
+                close = close || iequals(token, "close");
+                keep_alive = keep_alive || iequals(token, "keep-alive");
+                if (comma == std::string_view::npos)
+                    break;
+                value.remove_prefix(comma + 1);
+            }
+        }
+    }
+
+    out.target = target;
+    out.version = version;
+    out.keep_alive = version == 11 ? !close : keep_alive;
+    out.size = pos;
+    return HeadParse::done;
+}
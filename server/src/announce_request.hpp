@@ -0,0 +1,29 @@
+#pragma once
+#include <cstddef>
+#include <string_view>
+
+/// The head of a `GET /announce?...` request as nearly every client sends
+/// it, read in place from the connection's buffer. Only what serving an
+/// announce needs is kept; `target` points into that buffer
+struct AnnounceRequest {
+    std::string_view target;
+    unsigned version = 11; // 10 or 11, the way Beast counts
+    bool keep_alive = true;
+    std::size_t size = 0; // Bytes up to and including the blank line
+};
+
+enum class HeadParse {
+    done,      // `out` holds the request
+    need_more, // could still be one, read more
+    fallback,  // something else, or something unusual: let Beast have it
+};
+
+/// Heads longer than this go to Beast, which applies its own limit
+constexpr std::size_t kMaxAnnounceHead = 8192;
+
+/// Parse the request head at the start of `data` if it is a GET of
+/// /announce with a query, HTTP/1.0 or 1.1, CRLF line endings and no body.
+/// Header names have to be tokens; Connection, Content-Length and
+/// Transfer-Encoding are the only headers read. Anything else, from another
+/// route to a folded header line, is left to the general parser
+HeadParse parse_announce_request(std::string_view data, AnnounceRequest &out);
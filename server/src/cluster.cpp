@@ -0,0 +1,448 @@
+#include "cluster.hpp"
+#include "hashing.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+
+// Datagram: "BTGS" | u8 version | u8 reserved | u16 count | deltas...
+// Delta:    u8 flags | u8 ihlen | ih | u8 family (4/6) | addr | u16 port |
+//           u8 idlen | id
+// Multi-byte integers are big-endian, as on the UDP announce port
+constexpr char kMagic[4] = {'B', 'T', 'G', 'S'};
+constexpr uint8_t kVersion = 1;
+constexpr std::size_t kHeaderLen = 8;
+// Stays under a typical path MTU so datagrams aren't fragmented
+constexpr std::size_t kMaxDatagram = 1400;
+
+enum : uint8_t {
+    kFlagRemove = 1,
+    kFlagSeeder = 2,
+    kFlagCompleted = 4,
+};
+
+// How many hash buckets of each shard's subscriptions one sweep() looks at
+constexpr std::size_t kSweepBuckets = 64;
+
+// FNV-1a, so every node puts a given string at the same ring position
+// (std::hash is free to differ between builds)
+uint64_t ring_hash(std::string_view s) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (unsigned char c : s) {
+        h ^= c;
+        h *= 0x100000001b3ULL;
+    }
+    return mix64(h);
+}
+
+std::vector<std::string>
+node_names(const std::vector<boost::asio::ip::udp::endpoint> &nodes) {
+    std::vector<std::string> names;
+    for (const auto &ep : nodes) {
+        std::ostringstream oss;
+        oss << ep;
+        names.push_back(oss.str());
+    }
+    return names;
+}
+
+} // namespace
+
+HashRing::HashRing(const std::vector<std::string> &nodes)
+    : nodes_(nodes.size()) {
+    points_.reserve(nodes.size() * kPointsPerNode);
+    for (std::size_t n = 0; n < nodes.size(); ++n) {
+        for (std::size_t i = 0; i < kPointsPerNode; ++i) {
+            points_.push_back(
+                {ring_hash(nodes[n] + "#" + std::to_string(i)), n});
+        }
+    }
+    std::sort(points_.begin(), points_.end(),
+              [](const Point &a, const Point &b) { return a.hash < b.hash; });
+}
+
+std::size_t HashRing::owners(std::string_view infohash, std::size_t n,
+                             Owners &out) const {
+    n = std::min({n, nodes_, kMaxReplicas});
+    std::size_t count = 0;
+    if (n == 0)
+        return count;
+
+    const uint64_t h = ring_hash(infohash);
+    auto it = std::lower_bound(
+        points_.begin(), points_.end(), h,
+        [](const Point &p, uint64_t v) { return p.hash < v; });
+    for (std::size_t seen = 0; seen < points_.size() && count < n;
+         ++seen, ++it) {
+        if (it == points_.end())
+            it = points_.begin();
+        if (std::find(out.begin(), out.begin() + count, it->node) ==
+            out.begin() + count)
+            out[count++] = it->node;
+    }
+    return count;
+}
+
+std::vector<boost::asio::ip::udp::endpoint>
+parse_cluster_nodes(const std::string &list) {
+    std::vector<boost::asio::ip::udp::endpoint> nodes;
+    std::size_t start = 0;
+    while (start <= list.size()) {
+        std::size_t comma = list.find(',', start);
+        if (comma == std::string::npos)
+            comma = list.size();
+        const std::string item = list.substr(start, comma - start);
+        start = comma + 1;
+        if (item.empty())
+            continue;
+
+        // host:port, with IPv6 hosts in brackets
+        const std::size_t colon = item.rfind(':');
+        if (colon == std::string::npos || colon + 1 == item.size())
+            throw std::invalid_argument("cluster node without port: " + item);
+        std::string host = item.substr(0, colon);
+        if (host.size() > 2 && host.front() == '[' && host.back() == ']')
+            host = host.substr(1, host.size() - 2);
+        boost::system::error_code ec;
+        auto addr = boost::asio::ip::make_address(host, ec);
+        if (ec)
+            throw std::invalid_argument("bad cluster node address: " + item);
+        nodes.emplace_back(addr,
+                           static_cast<uint16_t>(std::stoi(item.substr(
+                               colon + 1))));
+    }
+    return nodes;
+}
+
+cluster_node::cluster_node(boost::asio::io_context &ioc,
+                           std::vector<udp::endpoint> nodes, std::size_t self,
+                           std::size_t replicas, TrackerState &state,
+                           std::chrono::seconds ttl)
+    : socket_(ioc), flush_timer_(ioc), nodes_(std::move(nodes)), self_(self),
+      replicas_(std::max<std::size_t>(1, replicas)), ring_(node_names(nodes_)),
+      state_(state), ttl_(ttl),
+      outboxes_(std::make_unique<Outbox[]>(nodes_.size())),
+      sub_shards_(std::make_unique<SubShard[]>(kSubShards)),
+      recv_buffer_(kMaxDatagram) {
+    if (self_ >= nodes_.size())
+        throw std::invalid_argument("node id is not in the cluster list");
+    if (replicas_ > HashRing::kMaxReplicas) {
+        throw std::invalid_argument(
+            "at most " + std::to_string(HashRing::kMaxReplicas) +
+            " replicas per swarm");
+    }
+    TLOG(info) << "[cluster_node] Node " << self_ << " of " << nodes_.size()
+               << ", gossiping on " << nodes_[self_] << ", " << replicas_
+               << " replica(s) per swarm";
+
+    const udp::endpoint bind_ep(nodes_[self_].protocol() == udp::v4()
+                                    ? udp::endpoint(udp::v4(),
+                                                    nodes_[self_].port())
+                                    : udp::endpoint(udp::v6(),
+                                                    nodes_[self_].port()));
+    boost::system::error_code ec;
+    socket_.open(bind_ep.protocol(), ec);
+    if (ec)
+        throw boost::system::system_error(ec);
+    socket_.bind(bind_ep, ec);
+    if (ec)
+        throw boost::system::system_error(ec);
+    // See flush()
+    socket_.non_blocking(true, ec);
+    if (ec)
+        throw boost::system::system_error(ec);
+
+    for (std::size_t n = 0; n < nodes_.size(); ++n)
+        outboxes_[n].buf.reserve(kMaxDatagram);
+}
+
+void cluster_node::run() {
+    TLOG(info) << "[cluster_node::run] Starting gossip";
+    do_receive();
+    schedule_flush();
+}
+
+void cluster_node::publish(const PeerDelta &delta) {
+    HashRing::Owners owners;
+    const std::size_t count = ring_.owners(delta.infohash, replicas_, owners);
+    for (std::size_t i = 0; i < count; ++i) {
+        if (owners[i] != self_)
+            send_to(owners[i], delta);
+    }
+    if (count > 0 && owners[0] == self_) {
+        for (std::size_t node : subscribers(delta.infohash, self_))
+            send_to(node, delta);
+    }
+}
+
+void cluster_node::send_to(std::size_t node, const PeerDelta &delta) {
+    const std::size_t ihlen = std::min<std::size_t>(delta.infohash.size(), 255);
+    const std::size_t idlen = std::min<std::size_t>(delta.peer_id.size(), 255);
+    const std::size_t len =
+        1 + 1 + ihlen + 1 + (delta.addr.is_v4() ? 4 : 16) + 2 + 1 + idlen;
+
+    Outbox &box = outboxes_[node];
+    std::lock_guard<std::mutex> lock(box.mtx);
+    if (box.buf.size() + len > kMaxDatagram)
+        flush(node, box);
+    if (box.buf.empty()) {
+        box.buf.resize(kHeaderLen);
+        std::memcpy(box.buf.data(), kMagic, sizeof(kMagic));
+        box.buf[4] = kVersion;
+        box.buf[5] = 0;
+    }
+
+    auto &b = box.buf;
+    uint8_t flags = 0;
+    if (delta.kind == PeerDelta::Kind::remove)
+        flags |= kFlagRemove;
+    if (delta.seeder)
+        flags |= kFlagSeeder;
+    if (delta.completed)
+        flags |= kFlagCompleted;
+    b.push_back(flags);
+
+    b.push_back(static_cast<unsigned char>(ihlen));
+    b.insert(b.end(), delta.infohash.begin(), delta.infohash.begin() + ihlen);
+
+    if (delta.addr.is_v4()) {
+        b.push_back(4);
+        auto bytes = delta.addr.to_v4().to_bytes();
+        b.insert(b.end(), bytes.begin(), bytes.end());
+    } else {
+        b.push_back(6);
+        auto bytes = delta.addr.to_v6().to_bytes();
+        b.insert(b.end(), bytes.begin(), bytes.end());
+    }
+    b.push_back(static_cast<unsigned char>(delta.port >> 8));
+    b.push_back(static_cast<unsigned char>(delta.port));
+
+    b.push_back(static_cast<unsigned char>(idlen));
+    b.insert(b.end(), delta.peer_id.begin(), delta.peer_id.begin() + idlen);
+    ++box.count;
+}
+
+// Called with box.mtx held. A send_to on a UDP socket is a single
+// sendto(2), safe next to the pending receive and other outboxes' sends.
+// The socket is non-blocking, so an announce that fills a datagram never
+// waits on the network: if the send buffer is full the datagram is dropped,
+// as the network could have, and counted in gossip_dropped
+void cluster_node::flush(std::size_t node, Outbox &box) {
+    if (box.count == 0)
+        return;
+    box.buf[6] = static_cast<unsigned char>(box.count >> 8);
+    box.buf[7] = static_cast<unsigned char>(box.count);
+
+    boost::system::error_code ec;
+    socket_.send_to(boost::asio::buffer(box.buf), nodes_[node], 0, ec);
+    if (ec == boost::asio::error::would_block) {
+        metrics::gossip_dropped.add();
+    } else if (ec) {
+        TLOG(debug) << "[cluster_node::flush] Error sending to node " << node
+                    << ": " << ec.message();
+    } else {
+        metrics::gossip_deltas_out.add(box.count);
+        metrics::gossip_bytes_out.add(box.buf.size());
+    }
+    box.buf.clear();
+    box.count = 0;
+}
+
+void cluster_node::schedule_flush() {
+    flush_timer_.expires_after(kFlushInterval);
+    flush_timer_.async_wait(
+        [self = shared_from_this()](boost::system::error_code ec) {
+            if (ec)
+                return;
+            for (std::size_t n = 0; n < self->nodes_.size(); ++n) {
+                Outbox &box = self->outboxes_[n];
+                std::lock_guard<std::mutex> lock(box.mtx);
+                self->flush(n, box);
+            }
+            self->schedule_flush();
+        });
+}
+
+void cluster_node::do_receive() {
+    socket_.async_receive_from(
+        boost::asio::buffer(recv_buffer_), remote_,
+        [self = shared_from_this()](boost::system::error_code ec,
+                                    std::size_t n) {
+            if (!ec) {
+                self->handle_datagram(n);
+            } else if (ec == boost::asio::error::operation_aborted) {
+                return;
+            } else {
+                TLOG(warn) << "[cluster_node::do_receive] Error receiving: "
+                           << ec.message();
+            }
+            self->do_receive();
+        });
+}
+
+void cluster_node::handle_datagram(std::size_t n) {
+    // Only listen to the nodes we were told about
+    auto from = std::find(nodes_.begin(), nodes_.end(), remote_);
+    if (from == nodes_.end() || from - nodes_.begin() == long(self_)) {
+        TLOG(debug) << "[cluster_node::handle_datagram] Dropping datagram "
+                       "from "
+                    << remote_;
+        metrics::gossip_dropped.add();
+        return;
+    }
+    const std::size_t sender = from - nodes_.begin();
+
+    const unsigned char *p = recv_buffer_.data();
+    if (n < kHeaderLen || std::memcmp(p, kMagic, sizeof(kMagic)) != 0 ||
+        p[4] != kVersion) {
+        metrics::gossip_dropped.add();
+        return;
+    }
+    metrics::gossip_bytes_in.add(n);
+    const std::size_t count = (std::size_t(p[6]) << 8) | p[7];
+    const unsigned char *end = p + n;
+    p += kHeaderLen;
+
+    PeerDelta d;
+    for (std::size_t i = 0; i < count; ++i) {
+        // flags, ihlen
+        if (end - p < 2)
+            break;
+        const uint8_t flags = p[0];
+        const std::size_t ihlen = p[1];
+        p += 2;
+        if (std::size_t(end - p) < ihlen + 1)
+            break;
+        d.infohash.assign(reinterpret_cast<const char *>(p), ihlen);
+        p += ihlen;
+
+        const uint8_t family = *p++;
+        const std::size_t alen = family == 4 ? 4 : family == 6 ? 16 : 0;
+        if (alen == 0 || std::size_t(end - p) < alen + 3)
+            break;
+        if (alen == 4) {
+            boost::asio::ip::address_v4::bytes_type b;
+            std::memcpy(b.data(), p, b.size());
+            d.addr = boost::asio::ip::address_v4(b);
+        } else {
+            boost::asio::ip::address_v6::bytes_type b;
+            std::memcpy(b.data(), p, b.size());
+            d.addr = boost::asio::ip::address_v6(b);
+        }
+        p += alen;
+        d.port = static_cast<uint16_t>((p[0] << 8) | p[1]);
+        const std::size_t idlen = p[2];
+        p += 3;
+        if (std::size_t(end - p) < idlen)
+            break;
+        d.peer_id.assign(reinterpret_cast<const char *>(p), idlen);
+        p += idlen;
+
+        d.kind = flags & kFlagRemove ? PeerDelta::Kind::remove
+                                     : PeerDelta::Kind::upsert;
+        d.seeder = flags & kFlagSeeder;
+        d.completed = flags & kFlagCompleted;
+        metrics::gossip_deltas_in.add();
+        apply(d);
+
+        // As the primary owner, pass it on to the swarm's other servers
+        HashRing::Owners owners;
+        const std::size_t n_owners =
+            ring_.owners(d.infohash, replicas_, owners);
+        if (n_owners == 0 || owners[0] != self_)
+            continue;
+        if (std::find(owners.begin(), owners.begin() + n_owners, sender) ==
+            owners.begin() + n_owners)
+            subscribe(d.infohash, sender);
+        for (std::size_t node : subscribers(d.infohash, sender))
+            send_to(node, d);
+    }
+}
+
+void cluster_node::apply(const PeerDelta &d) {
+    // The node the client announced to has already counted it
+    if (d.kind == PeerDelta::Kind::remove) {
+        state_.remove_peer(d.infohash, d.addr, d.port, d.peer_id,
+                           /*count=*/false);
+    } else {
+        state_.upsert_peer(d.infohash, d.addr, d.port, d.peer_id, d.seeder,
+                           d.completed, /*count=*/false);
+    }
+}
+
+// The high bits, so shards don't all see the same low bits the maps bucket
+// by
+cluster_node::SubShard &cluster_node::sub_shard(std::string_view infohash) {
+    return sub_shards_[(mix64(std::hash<std::string_view>{}(infohash)) >> 32) %
+                       kSubShards];
+}
+
+void cluster_node::subscribe(const std::string &infohash, std::size_t node) {
+    const auto until = steady_clock::now() + ttl_;
+    SubShard &shard = sub_shard(infohash);
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    auto &subs = shard.subs[infohash];
+    for (auto &s : subs) {
+        if (s.node == node) {
+            s.until = until;
+            return;
+        }
+    }
+    TLOG(debug) << "[cluster_node::subscribe] Node " << node
+                << " now serves infohash=" << to_hex(infohash);
+    subs.push_back({node, until});
+}
+
+std::vector<std::size_t>
+cluster_node::subscribers(const std::string &infohash, std::size_t except) {
+    std::vector<std::size_t> out;
+    const auto now = steady_clock::now();
+    SubShard &shard = sub_shard(infohash);
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    auto it = shard.subs.find(infohash);
+    if (it == shard.subs.end())
+        return out;
+    for (const auto &s : it->second) {
+        if (s.until > now && s.node != except)
+            out.push_back(s.node);
+    }
+    return out;
+}
+
+void cluster_node::sweep() {
+    const auto now = steady_clock::now();
+    std::vector<std::string> idle;
+    for (std::size_t s = 0; s < kSubShards; ++s)
+        sweep_shard(sub_shards_[s], now, idle);
+}
+
+void cluster_node::sweep_shard(SubShard &shard, steady_clock::time_point now,
+                               std::vector<std::string> &idle) {
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    const std::size_t buckets = shard.subs.bucket_count();
+    if (shard.subs.empty() || buckets == 0)
+        return;
+
+    idle.clear();
+    for (std::size_t i = 0; i < kSweepBuckets; ++i) {
+        const std::size_t b = (shard.sweep_bucket + i) % buckets;
+        for (auto it = shard.subs.begin(b); it != shard.subs.end(b); ++it) {
+            auto &subs = it->second;
+            subs.erase(std::remove_if(subs.begin(), subs.end(),
+                                      [&](const Subscriber &s) {
+                                          return s.until <= now;
+                                      }),
+                       subs.end());
+            if (subs.empty())
+                idle.push_back(it->first);
+        }
+    }
+    shard.sweep_bucket = (shard.sweep_bucket + kSweepBuckets) % buckets;
+    for (const auto &ih : idle)
+        shard.subs.erase(ih);
+}
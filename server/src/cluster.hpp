@@ -0,0 +1,156 @@
+#pragma once
+#include "tracker_state.hpp"
+#include <array>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/// Consistent hashing of infohashes onto cluster nodes. Every node owns a
+/// number of points on a 64-bit ring; an infohash belongs to the nodes owning
+/// the first points clockwise of its hash. Adding or removing a node only
+/// moves the swarms next to its points
+class HashRing {
+  public:
+    static constexpr std::size_t kPointsPerNode = 64;
+    /// Most nodes a swarm can be owned by
+    static constexpr std::size_t kMaxReplicas = 8;
+    using Owners = std::array<std::size_t, kMaxReplicas>;
+
+    /// `nodes` are node names (their gossip endpoints), index = node id
+    explicit HashRing(const std::vector<std::string> &nodes);
+
+    /// Put the first `n` (at most kMaxReplicas) distinct nodes for
+    /// `infohash` in `out`, primary first, and return how many there are
+    std::size_t owners(std::string_view infohash, std::size_t n,
+                       Owners &out) const;
+
+    std::size_t size() const { return nodes_; }
+
+  private:
+    struct Point {
+        uint64_t hash;
+        std::size_t node;
+    };
+
+    std::size_t nodes_;
+    std::vector<Point> points_; // sorted by hash
+};
+
+/// One change to a swarm, as gossiped between nodes
+struct PeerDelta {
+    enum class Kind : uint8_t { upsert, remove };
+
+    Kind kind = Kind::upsert;
+    bool seeder = false;
+    bool completed = false;
+    std::string infohash;
+    boost::asio::ip::address addr;
+    uint16_t port = 0;
+    std::string peer_id;
+};
+
+/// Clustered mode: several trackers share the swarms. Each swarm is owned by
+/// `replicas` nodes on a HashRing, which always hold all of its peers.
+///
+/// Every node answers announces for any swarm from its own TrackerState and
+/// then publishes the change: to the swarm's owners, and, when it is the
+/// swarm's primary owner, to every non-owner that served the swarm within
+/// the peer TTL. So a swarm's state lives on its owners plus the nodes its
+/// clients actually hit, and a node that starts serving a swarm has the full
+/// peer list once its peers have re-announced.
+///
+/// Deltas travel as UDP datagrams between the nodes listed in --cluster,
+/// batched per destination for up to `kFlushInterval`. Datagrams from any
+/// other address are dropped, and so are datagrams that would have to wait
+/// for room in our socket's send buffer. Lost datagrams cost at most one
+/// announce interval of staleness; the next announce carries the same
+/// information.
+///
+/// The subscriptions of non-owners are sharded by infohash like the swarms,
+/// so announces for different swarms don't contend on them.
+/// If a swarm's primary owner is down, its other owners still get every
+/// delta, but non-owners only see the peers that announced to them.
+class cluster_node : public std::enable_shared_from_this<cluster_node> {
+  public:
+    using udp = boost::asio::ip::udp;
+
+    static constexpr auto kFlushInterval = std::chrono::milliseconds{5};
+
+    /// `nodes` lists every node's gossip endpoint, this one at `self`.
+    /// `replicas` is at most HashRing::kMaxReplicas
+    cluster_node(boost::asio::io_context &ioc, std::vector<udp::endpoint> nodes,
+                 std::size_t self, std::size_t replicas, TrackerState &state,
+                 std::chrono::seconds ttl);
+
+    void run();
+
+    /// A local announce changed a swarm; pass it on to whoever needs it
+    void publish(const PeerDelta &delta);
+
+    /// Forget non-owner nodes that stopped serving a swarm. Does a slice
+    /// of the subscriptions per call, so it can run on every expiry tick
+    void sweep();
+
+    std::size_t self() const { return self_; }
+
+  private:
+    struct Outbox {
+        std::mutex mtx;
+        std::vector<unsigned char> buf; // datagram being filled
+        std::size_t count = 0;
+    };
+
+    struct Subscriber {
+        std::size_t node;
+        steady_clock::time_point until;
+    };
+
+    // Swarms this node is primary for -> non-owners serving them
+    struct alignas(64) SubShard {
+        std::mutex mtx;
+        std::unordered_map<std::string, std::vector<Subscriber>> subs;
+        std::size_t sweep_bucket = 0;
+    };
+
+    static constexpr std::size_t kSubShards = 16;
+
+    void do_receive();
+    void handle_datagram(std::size_t n);
+    void apply(const PeerDelta &delta);
+    void send_to(std::size_t node, const PeerDelta &delta);
+    void flush(std::size_t node, Outbox &box);
+    void schedule_flush();
+    SubShard &sub_shard(std::string_view infohash);
+    void sweep_shard(SubShard &shard, steady_clock::time_point now,
+                     std::vector<std::string> &idle);
+    void subscribe(const std::string &infohash, std::size_t node);
+    std::vector<std::size_t> subscribers(const std::string &infohash,
+                                         std::size_t except);
+
+    udp::socket socket_;
+    boost::asio::steady_timer flush_timer_;
+    const std::vector<udp::endpoint> nodes_;
+    const std::size_t self_;
+    const std::size_t replicas_;
+    const HashRing ring_;
+    TrackerState &state_;
+    const std::chrono::seconds ttl_;
+
+    std::unique_ptr<Outbox[]> outboxes_; // one per node
+
+    std::unique_ptr<SubShard[]> sub_shards_;
+
+    udp::endpoint remote_;
+    std::vector<unsigned char> recv_buffer_;
+};
+
+/// Parse "host:port,host:port,..." into endpoints; throws on bad input
+std::vector<boost::asio::ip::udp::endpoint>
+parse_cluster_nodes(const std::string &list);
@@ -0,0 +1,12 @@
+#pragma once
+#include <cstdint>
+
+/// splitmix64 finaliser: every input bit affects every output bit. Spreads
+/// keys over shards, hash tables and the cluster ring, and scrambles the
+/// inputs of UDP connection ids
+inline uint64_t mix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
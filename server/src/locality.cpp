@@ -0,0 +1,110 @@
+#include "locality.hpp"
+#include <algorithm>
+#include <boost/asio/ip/address.hpp>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+
+void load_words(const unsigned char *bytes, uint64_t (&words)[2]) {
+    std::memcpy(words, bytes, sizeof(words));
+}
+
+} // namespace
+
+AddressPrefix::AddressPrefix(const PeerEndpoint &ep, unsigned bits)
+    : bits(std::min(bits, 128u)) {
+    unsigned char m[16] = {};
+    for (unsigned i = 0; i < this->bits; ++i)
+        m[i / 8] |= static_cast<unsigned char>(0x80 >> (i % 8));
+    load_words(m, mask);
+    load_words(ep.bytes.data(), addr);
+    addr[0] &= mask[0];
+    addr[1] &= mask[1];
+}
+
+SiteMap SiteMap::parse(std::string_view text) {
+    SiteMap map;
+    std::istringstream in{std::string(text)};
+    std::string line;
+    for (std::size_t n = 1; std::getline(in, line); ++n) {
+        std::istringstream fields(line);
+        std::string cidr, name, extra;
+        if (!(fields >> cidr) || cidr[0] == '#')
+            continue;
+        if (!(fields >> name) || (fields >> extra && extra[0] != '#')) {
+            throw std::invalid_argument("site map line " + std::to_string(n) +
+                                        ": expected <prefix> <site>");
+        }
+
+        const std::size_t slash = cidr.find('/');
+        boost::system::error_code ec;
+        const auto addr =
+            boost::asio::ip::make_address(cidr.substr(0, slash), ec);
+        if (ec) {
+            throw std::invalid_argument("site map line " + std::to_string(n) +
+                                        ": bad address " + cidr);
+        }
+        // IPv4 prefixes count from the start of the v4-mapped form
+        const unsigned offset = addr.is_v4() ? 96 : 0;
+        unsigned bits = addr.is_v4() ? 32 : 128;
+        if (slash != std::string::npos) {
+            try {
+                bits = static_cast<unsigned>(
+                    std::stoul(cidr.substr(slash + 1)));
+            } catch (const std::exception &) {
+                bits = 129;
+            }
+            if (bits > (addr.is_v4() ? 32u : 128u)) {
+                throw std::invalid_argument("site map line " +
+                                            std::to_string(n) +
+                                            ": bad prefix length " + cidr);
+            }
+        }
+
+        auto site = std::find_if(map.sites_.begin(), map.sites_.end(),
+                                 [&](const Site &s) { return s.name == name; });
+        if (site == map.sites_.end())
+            site = map.sites_.insert(map.sites_.end(), Site{name, {}});
+        site->prefixes.emplace_back(PeerEndpoint(addr, 0), offset + bits);
+    }
+    return map;
+}
+
+SiteMap SiteMap::load(const std::string &path) {
+    std::ifstream in(path);
+    if (!in)
+        throw std::invalid_argument("cannot read site map " + path);
+    std::ostringstream text;
+    text << in.rdbuf();
+    return parse(text.str());
+}
+
+const std::vector<AddressPrefix> *
+SiteMap::site_of(const PeerEndpoint &ep) const {
+    const Site *best = nullptr;
+    unsigned best_bits = 0;
+    for (const Site &site : sites_) {
+        for (const AddressPrefix &p : site.prefixes) {
+            if ((!best || p.bits > best_bits) && p.contains(ep)) {
+                best = &site;
+                best_bits = p.bits;
+            }
+        }
+    }
+    return best ? &best->prefixes : nullptr;
+}
+
+std::size_t SiteMap::prefixes() const {
+    std::size_t n = 0;
+    for (const Site &site : sites_)
+        n += site.prefixes.size();
+    return n;
+}
+
+Nearness::Nearness(const PeerEndpoint &self, const SiteMap &sites)
+    : subnet_(self, self.is_v4() ? 120 : 64),
+      wide_subnet_(self, self.is_v4() ? 112 : 48),
+      site_(sites.site_of(self)) {}
@@ -0,0 +1,79 @@
+#pragma once
+#include "tracker_state.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// The first `bits` of a PeerEndpoint's 16 address bytes. IPv4 addresses
+/// are stored v4-mapped, so an IPv4 /24 is a /120 here
+struct AddressPrefix {
+    uint64_t addr[2] = {0, 0}; // already masked
+    uint64_t mask[2] = {0, 0};
+    unsigned bits = 0;
+
+    AddressPrefix() = default;
+    AddressPrefix(const PeerEndpoint &ep, unsigned bits);
+
+    bool contains(const PeerEndpoint &ep) const {
+        uint64_t a[2];
+        std::memcpy(a, ep.bytes.data(), sizeof(a));
+        return (((a[0] & mask[0]) ^ addr[0]) |
+                ((a[1] & mask[1]) ^ addr[1])) == 0;
+    }
+};
+
+/// Which site (datacenter, office, rack) addresses belong to, as a list of
+/// prefixes per site. An address belongs to the site of its longest
+/// matching prefix
+class SiteMap {
+  public:
+    /// One "<address>[/<prefix length>] <site name>" per line; blank lines
+    /// and lines starting with '#' are skipped. Throws
+    /// std::invalid_argument on anything else
+    static SiteMap parse(std::string_view text);
+    static SiteMap load(const std::string &path);
+
+    /// Prefixes of the site `ep` is in, or null if it isn't in any
+    const std::vector<AddressPrefix> *site_of(const PeerEndpoint &ep) const;
+
+    std::size_t sites() const { return sites_.size(); }
+    std::size_t prefixes() const;
+
+  private:
+    struct Site {
+        std::string name;
+        std::vector<AddressPrefix> prefixes;
+    };
+    std::vector<Site> sites_;
+};
+
+/// How near a peer is to one announcer, for locality mode: 3 in the same
+/// /24 (IPv6: /64), 2 in the same /16 (/48), 1 at the same site, 0 none of
+/// those
+struct Nearness {
+    static constexpr unsigned kRanks = 4;
+
+    Nearness(const PeerEndpoint &self, const SiteMap &sites);
+
+    unsigned rank(const PeerEndpoint &ep) const {
+        if (subnet_.contains(ep))
+            return 3;
+        if (wide_subnet_.contains(ep))
+            return 2;
+        if (site_) {
+            for (const AddressPrefix &p : *site_) {
+                if (p.contains(ep))
+                    return 1;
+            }
+        }
+        return 0;
+    }
+
+  private:
+    AddressPrefix subnet_;
+    AddressPrefix wide_subnet_;
+    const std::vector<AddressPrefix> *site_;
+};
@@ -0,0 +1,159 @@
+#include "log.hpp"
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <thread>
+
+namespace tlog {
+
+std::atomic<int> g_level{static_cast<int>(LogLevel::error)};
+
+namespace {
+
+/// Bounded multi-producer queue (Vyukov's sequence-numbered ring). Producers
+/// claim a slot with one CAS; the single writer thread drains it
+class line_queue {
+  public:
+    static constexpr std::size_t kCapacity = 8192; // power of two
+
+    line_queue() {
+        for (std::size_t i = 0; i < kCapacity; ++i)
+            slots_[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    bool try_push(LogLevel level, std::string &&msg) {
+        std::size_t pos = head_.load(std::memory_order_relaxed);
+        for (;;) {
+            Slot &slot = slots_[pos & (kCapacity - 1)];
+            std::size_t seq = slot.seq.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(seq) -
+                        static_cast<std::ptrdiff_t>(pos);
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1,
+                                                std::memory_order_relaxed)) {
+                    slot.level = level;
+                    slot.msg = std::move(msg);
+                    slot.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false; // full
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool try_pop(LogLevel &level, std::string &msg) {
+        Slot &slot = slots_[tail_ & (kCapacity - 1)];
+        std::size_t seq = slot.seq.load(std::memory_order_acquire);
+        if (seq != tail_ + 1)
+            return false; // empty
+        level = slot.level;
+        msg = std::move(slot.msg);
+        slot.seq.store(tail_ + kCapacity, std::memory_order_release);
+        ++tail_;
+        return true;
+    }
+
+  private:
+    struct Slot {
+        std::atomic<std::size_t> seq;
+        LogLevel level;
+        std::string msg;
+    };
+
+    std::array<Slot, kCapacity> slots_;
+    alignas(64) std::atomic<std::size_t> head_{0};
+    alignas(64) std::size_t tail_ = 0; // writer thread only
+};
+
+line_queue &queue() {
+    static auto *q = new line_queue();
+    return *q;
+}
+
+std::atomic<uint64_t> g_dropped{0};
+std::atomic<bool> g_running{false};
+std::thread g_writer;
+
+const char *level_name(LogLevel level) {
+    switch (level) {
+    case LogLevel::trace:
+        return "trace";
+    case LogLevel::debug:
+        return "debug";
+    case LogLevel::info:
+        return "info";
+    case LogLevel::warn:
+        return "warn";
+    case LogLevel::error:
+        return "error";
+    case LogLevel::summary:
+        return "summary";
+    case LogLevel::off:
+        break;
+    }
+    return "off";
+}
+
+// Write out everything queued so far; returns whether there was anything
+bool drain() {
+    LogLevel level;
+    std::string msg;
+    bool any = false;
+    while (queue().try_pop(level, msg)) {
+        std::fprintf(stdout, "[%s] %s", level_name(level), msg.c_str());
+        if (msg.empty() || msg.back() != '\n')
+            std::fputc('\n', stdout);
+        any = true;
+    }
+    if (any)
+        std::fflush(stdout);
+    return any;
+}
+
+} // namespace
+
+void set_level(LogLevel level) {
+    g_level.store(static_cast<int>(level), std::memory_order_relaxed);
+}
+
+bool parse_level(std::string_view name, LogLevel &out) {
+    for (int i = 0; i <= static_cast<int>(LogLevel::off); ++i) {
+        if (name == level_name(static_cast<LogLevel>(i))) {
+            out = static_cast<LogLevel>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+void start() {
+    if (g_running.exchange(true))
+        return;
+    g_writer = std::thread([] {
+        while (g_running.load(std::memory_order_relaxed)) {
+            if (!drain())
+                std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+        drain();
+    });
+}
+
+void stop() {
+    if (!g_running.exchange(false))
+        return;
+    if (g_writer.joinable())
+        g_writer.join();
+}
+
+void submit(LogLevel level, std::string &&msg) {
+    if (!queue().try_push(level, std::move(msg)))
+        g_dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t dropped() { return g_dropped.load(std::memory_order_relaxed); }
+
+} // namespace tlog
@@ -0,0 +1,59 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <string_view>
+
+/// Tracker log levels, least to most important. `summary` is for the periodic
+/// status lines and startup banner, so it sits above `error` and still shows
+/// at the default level; `off` silences everything
+enum class LogLevel : int { trace, debug, info, warn, error, summary, off };
+
+namespace tlog {
+
+extern std::atomic<int> g_level;
+
+inline bool enabled(LogLevel level) {
+    return static_cast<int>(level) >= g_level.load(std::memory_order_relaxed);
+}
+
+void set_level(LogLevel level);
+bool parse_level(std::string_view name, LogLevel &out);
+
+/// Start/stop the background writer. Lines submitted while it isn't running
+/// wait in the queue (or are dropped once it is full)
+void start();
+void stop();
+
+/// Hand a finished line to the writer thread. Never blocks; if the queue is
+/// full the line is dropped and counted
+void submit(LogLevel level, std::string &&msg);
+
+/// Lines lost to a full queue since startup
+uint64_t dropped();
+
+/// Collects one log line and submits it when it goes out of scope
+class line {
+  public:
+    explicit line(LogLevel level) : level_(level) {}
+    ~line() { submit(level_, std::move(os_).str()); }
+
+    template <typename T> line &operator<<(const T &v) {
+        os_ << v;
+        return *this;
+    }
+
+  private:
+    LogLevel level_;
+    std::ostringstream os_;
+};
+
+} // namespace tlog
+
+/// TLOG(debug) << "..." << x; -- nothing after TLOG(level) is evaluated
+/// unless that level is enabled
+#define TLOG(level)                                                            \
+    if (!tlog::enabled(LogLevel::level)) {                                     \
+    } else                                                                     \
+        tlog::line(LogLevel::level)
@@ -0,0 +1,285 @@
+#include "metrics.hpp"
+#include "log.hpp"
+#include <cstdio>
+
+namespace metrics {
+
+namespace {
+
+const char *const kRouteNames[kRoutes] = {"announce", "scrape", "metrics",
+                                          "other"};
+const char *const kUdpActionNames[kUdpActions] = {"connect", "announce",
+                                                  "scrape", "error"};
+
+// One counter per route and status, the last status column being `other`
+std::array<std::array<counter, kStatuses.size() + 1>, kRoutes> g_requests;
+std::array<counter, kUdpActions> g_udp_requests;
+histogram g_announce_http;
+histogram g_announce_udp;
+histogram g_gc_duration;
+counter g_gc_runs;
+std::atomic<uint64_t> g_gc_last_expired{0};
+
+void append_value(std::string &out, const char *name,
+                  const std::string &labels, uint64_t value) {
+    out += name;
+    if (!labels.empty()) {
+        out += '{';
+        out += labels;
+        out += '}';
+    }
+    out += ' ';
+    out += std::to_string(value);
+    out += '\n';
+}
+
+void append_help(std::string &out, const char *name, const char *type,
+                 const char *help) {
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+}
+
+} // namespace
+
+counter http_bytes_in;
+counter http_bytes_out;
+counter udp_bytes_in;
+counter udp_bytes_out;
+counter udp_replies_dropped;
+counter connections_opened;
+counter connections_closed;
+counter shed_overloaded;
+counter shed_rate_limited;
+counter gossip_deltas_in;
+counter gossip_deltas_out;
+counter gossip_bytes_in;
+counter gossip_bytes_out;
+counter gossip_dropped;
+
+std::size_t stripe() {
+    static std::atomic<std::size_t> next{0};
+    thread_local const std::size_t mine =
+        next.fetch_add(1, std::memory_order_relaxed) % kStripes;
+    return mine;
+}
+
+uint64_t counter::value() const {
+    uint64_t total = 0;
+    for (const auto &c : cells_)
+        total += c.v.load(std::memory_order_relaxed);
+    return total;
+}
+
+void histogram::observe(std::chrono::nanoseconds d) {
+    const double secs = std::chrono::duration<double>(d).count();
+    std::size_t b = 0;
+    while (b < kBounds.size() && secs > kBounds[b])
+        ++b;
+    cell &c = cells_[stripe()];
+    c.buckets[b].fetch_add(1, std::memory_order_relaxed);
+    c.sum_ns.fetch_add(static_cast<uint64_t>(d.count()),
+                       std::memory_order_relaxed);
+}
+
+void histogram::render(std::string &out, const char *name,
+                       const std::string &labels) const {
+    std::array<uint64_t, kBounds.size() + 1> counts{};
+    uint64_t sum_ns = 0;
+    for (const auto &c : cells_) {
+        for (std::size_t b = 0; b < counts.size(); ++b)
+            counts[b] += c.buckets[b].load(std::memory_order_relaxed);
+        sum_ns += c.sum_ns.load(std::memory_order_relaxed);
+    }
+
+    const std::string sep = labels.empty() ? "" : labels + ",";
+    const std::string bucket = std::string(name) + "_bucket";
+    uint64_t cumulative = 0;
+    char le[32];
+    for (std::size_t b = 0; b < kBounds.size(); ++b) {
+        cumulative += counts[b];
+        std::snprintf(le, sizeof(le), "%g", kBounds[b]);
+        append_value(out, bucket.c_str(), sep + "le=\"" + le + "\"",
+                     cumulative);
+    }
+    cumulative += counts.back();
+    append_value(out, bucket.c_str(), sep + "le=\"+Inf\"", cumulative);
+
+    char sum[64];
+    std::snprintf(sum, sizeof(sum), "%.9f", sum_ns / 1e9);
+    out += name;
+    out += "_sum";
+    if (!labels.empty())
+        out += '{' + labels + '}';
+    out += ' ';
+    out += sum;
+    out += '\n';
+    append_value(out, (std::string(name) + "_count").c_str(), labels,
+                 cumulative);
+}
+
+void count_request(route r, unsigned status) {
+    std::size_t s = 0;
+    while (s < kStatuses.size() && kStatuses[s] != status)
+        ++s;
+    g_requests[static_cast<std::size_t>(r)][s].add();
+}
+
+void observe_announce(bool udp, std::chrono::nanoseconds d) {
+    (udp ? g_announce_udp : g_announce_http).observe(d);
+}
+
+void count_udp(udp_action a) {
+    g_udp_requests[static_cast<std::size_t>(a)].add();
+}
+
+void observe_gc(std::chrono::nanoseconds d, std::size_t expired) {
+    g_gc_runs.add();
+    g_gc_duration.observe(d);
+    g_gc_last_expired.store(expired, std::memory_order_relaxed);
+}
+
+std::string render(const TrackerState::Stats &stats) {
+    std::string out;
+    out.reserve(8192);
+
+    append_help(out, "tracker_http_requests_total", "counter",
+                "HTTP requests by route and response status");
+    for (std::size_t r = 0; r < kRoutes; ++r) {
+        for (std::size_t s = 0; s <= kStatuses.size(); ++s) {
+            uint64_t v = g_requests[r][s].value();
+            if (v == 0)
+                continue;
+            std::string status = s < kStatuses.size()
+                                     ? std::to_string(kStatuses[s])
+                                     : std::string("other");
+            append_value(out, "tracker_http_requests_total",
+                         std::string("route=\"") + kRouteNames[r] +
+                             "\",status=\"" + status + "\"",
+                         v);
+        }
+    }
+
+    append_help(out, "tracker_udp_requests_total", "counter",
+                "UDP requests by action");
+    for (std::size_t a = 0; a < kUdpActions; ++a) {
+        append_value(out, "tracker_udp_requests_total",
+                     std::string("action=\"") + kUdpActionNames[a] + "\"",
+                     g_udp_requests[a].value());
+    }
+
+    append_help(out, "tracker_announce_duration_seconds", "histogram",
+                "Time to handle an announce, excluding network I/O");
+    g_announce_http.render(out, "tracker_announce_duration_seconds",
+                           "proto=\"http\"");
+    g_announce_udp.render(out, "tracker_announce_duration_seconds",
+                          "proto=\"udp\"");
+
+    const uint64_t opened = connections_opened.value();
+    const uint64_t closed = connections_closed.value();
+    append_help(out, "tracker_http_connections_active", "gauge",
+                "Open HTTP connections");
+    append_value(out, "tracker_http_connections_active", "",
+                 opened > closed ? opened - closed : 0);
+    append_help(out, "tracker_http_connections_total", "counter",
+                "HTTP connections accepted");
+    append_value(out, "tracker_http_connections_total", "", opened);
+
+    append_help(out, "tracker_shed_connections_total", "counter",
+                "Connections answered with a canned response at accept");
+    append_value(out, "tracker_shed_connections_total",
+                 "reason=\"overloaded\"", shed_overloaded.value());
+    append_value(out, "tracker_shed_connections_total",
+                 "reason=\"rate_limited\"", shed_rate_limited.value());
+
+    append_help(out, "tracker_received_bytes_total", "counter",
+                "Bytes received by protocol");
+    append_value(out, "tracker_received_bytes_total", "proto=\"http\"",
+                 http_bytes_in.value());
+    append_value(out, "tracker_received_bytes_total", "proto=\"udp\"",
+                 udp_bytes_in.value());
+    append_value(out, "tracker_received_bytes_total", "proto=\"gossip\"",
+                 gossip_bytes_in.value());
+    append_help(out, "tracker_sent_bytes_total", "counter",
+                "Bytes sent by protocol");
+    append_value(out, "tracker_sent_bytes_total", "proto=\"http\"",
+                 http_bytes_out.value());
+    append_value(out, "tracker_sent_bytes_total", "proto=\"udp\"",
+                 udp_bytes_out.value());
+    append_value(out, "tracker_sent_bytes_total", "proto=\"gossip\"",
+                 gossip_bytes_out.value());
+
+    append_help(out, "tracker_udp_replies_dropped_total", "counter",
+                "UDP replies dropped because the socket's send buffer was "
+                "full");
+    append_value(out, "tracker_udp_replies_dropped_total", "",
+                 udp_replies_dropped.value());
+
+    append_help(out, "tracker_gossip_deltas_total", "counter",
+                "Peer changes exchanged with other cluster nodes");
+    append_value(out, "tracker_gossip_deltas_total", "direction=\"in\"",
+                 gossip_deltas_in.value());
+    append_value(out, "tracker_gossip_deltas_total", "direction=\"out\"",
+                 gossip_deltas_out.value());
+    append_help(out, "tracker_gossip_dropped_total", "counter",
+                "Gossip datagrams dropped: unknown sender, malformed, "
+                "or the send buffer was full");
+    append_value(out, "tracker_gossip_dropped_total", "",
+                 gossip_dropped.value());
+
+    append_help(out, "tracker_swarms", "gauge", "Swarms tracked");
+    append_value(out, "tracker_swarms", "", stats.swarms);
+    append_help(out, "tracker_peers", "gauge", "Peers tracked");
+    append_value(out, "tracker_peers", "", stats.peers);
+    append_help(out, "tracker_announces_total", "counter",
+                "Announces applied to the swarm state (HTTP and UDP)");
+    append_value(out, "tracker_announces_total", "", stats.announces);
+
+    append_help(out, "tracker_swarms_evicted_total", "counter",
+                "Idle swarms dropped to stay within the caps");
+    append_value(out, "tracker_swarms_evicted_total", "", stats.evicted);
+    append_help(out, "tracker_cap_refused_total", "counter",
+                "New swarms and peers not tracked for lack of room");
+    append_value(out, "tracker_cap_refused_total", "", stats.refused);
+
+    const TrackerState::MemoryUsage &mem = stats.memory;
+    append_help(out, "tracker_memory_bytes", "gauge",
+                "Approximate heap bytes held by the swarm state, by "
+                "structure");
+    append_value(out, "tracker_memory_bytes", "structure=\"peers\"",
+                 mem.swarms.peers);
+    append_value(out, "tracker_memory_bytes", "structure=\"peer_index\"",
+                 mem.swarms.index);
+    append_value(out, "tracker_memory_bytes", "structure=\"peer_lists\"",
+                 mem.swarms.caches);
+    append_value(out, "tracker_memory_bytes", "structure=\"swarm_table\"",
+                 mem.table);
+    append_value(out, "tracker_memory_bytes", "structure=\"expiry_wheel\"",
+                 mem.wheel);
+
+    append_help(out, "tracker_gc_runs_total", "counter", "Expiry ticks run");
+    append_value(out, "tracker_gc_runs_total", "", g_gc_runs.value());
+    append_help(out, "tracker_gc_duration_seconds", "histogram",
+                "Time spent in one expiry tick");
+    g_gc_duration.render(out, "tracker_gc_duration_seconds", "");
+    append_help(out, "tracker_gc_expired_total", "counter",
+                "Peers expired for not re-announcing");
+    append_value(out, "tracker_gc_expired_total", "", stats.expired);
+    append_help(out, "tracker_gc_last_expired", "gauge",
+                "Peers expired by the most recent expiry tick");
+    append_value(out, "tracker_gc_last_expired", "",
+                 g_gc_last_expired.load(std::memory_order_relaxed));
+
+    append_help(out, "tracker_log_dropped_total", "counter",
+                "Log lines dropped because the log queue was full");
+    append_value(out, "tracker_log_dropped_total", "", tlog::dropped());
+    return out;
+}
+
+} // namespace metrics
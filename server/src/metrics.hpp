@@ -0,0 +1,96 @@
+#pragma once
+#include "tracker_state.hpp"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/// Process-wide tracker metrics, rendered in the Prometheus text format by
+/// the /metrics route. Everything on the request path is a relaxed add into
+/// one of a few cache-line sized stripes picked per thread, so io threads
+/// bumping the same counter don't bounce a shared line between cores; reads
+/// sum the stripes.
+namespace metrics {
+
+constexpr std::size_t kStripes = 16;
+
+/// Stripe for the calling thread, fixed for the thread's lifetime
+std::size_t stripe();
+
+class counter {
+  public:
+    void add(uint64_t n = 1) {
+        cells_[stripe()].v.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t value() const;
+
+  private:
+    struct alignas(64) cell {
+        std::atomic<uint64_t> v{0};
+    };
+    std::array<cell, kStripes> cells_;
+};
+
+/// Latency histogram with fixed buckets from 10us to 100ms
+class histogram {
+  public:
+    static constexpr std::array<double, 12> kBounds = {
+        0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005,
+        0.001,   0.0025,   0.005,   0.01,   0.025,   0.1}; // seconds
+
+    void observe(std::chrono::nanoseconds d);
+
+    /// Append `name`_bucket/_sum/_count lines with `labels` (may be empty)
+    void render(std::string &out, const char *name,
+                const std::string &labels) const;
+
+  private:
+    struct alignas(64) cell {
+        std::array<std::atomic<uint64_t>, kBounds.size() + 1> buckets{};
+        std::atomic<uint64_t> sum_ns{0};
+    };
+    std::array<cell, kStripes> cells_;
+};
+
+enum class route { announce, scrape, metrics, other };
+constexpr std::size_t kRoutes = 4;
+
+/// HTTP statuses the tracker answers with; anything else counts as `other`
+constexpr std::array<unsigned, 6> kStatuses = {200, 400, 404, 405, 429, 503};
+
+enum class udp_action { connect, announce, scrape, error };
+constexpr std::size_t kUdpActions = 4;
+
+/// HTTP request finished with `status`
+void count_request(route r, unsigned status);
+
+/// Time spent handling one announce, from parsed request to queued response
+void observe_announce(bool udp, std::chrono::nanoseconds d);
+
+void count_udp(udp_action a);
+
+extern counter http_bytes_in;
+extern counter http_bytes_out;
+extern counter udp_bytes_in;
+extern counter udp_bytes_out;
+extern counter udp_replies_dropped; // socket send buffer full
+extern counter connections_opened;
+extern counter connections_closed;
+extern counter shed_overloaded;   // connections turned away at accept
+extern counter shed_rate_limited; // ditto, for their IP's connection rate
+extern counter gossip_deltas_in;
+extern counter gossip_deltas_out;
+extern counter gossip_bytes_in;
+extern counter gossip_bytes_out;
+extern counter gossip_dropped; // bad sender or datagram, or send buffer full
+
+/// One gc() tick: how long it took and how many peers it expired
+void observe_gc(std::chrono::nanoseconds d, std::size_t expired);
+
+/// Everything above plus the swarm totals from `stats`
+std::string render(const TrackerState::Stats &stats);
+
+} // namespace metrics
@@ -0,0 +1,204 @@
+#include "peer_list.hpp"
+#include "tracker_state.hpp"
+#include <charconv>
+#include <cstring>
+#include <string_view>
+
+static constexpr std::string_view kJsonIp = "{\"ip\":\"";
+static constexpr std::string_view kJsonPort = "\",\"port\":";
+static constexpr std::string_view kJsonEnd = "},";
+// Longest IPv4 record: 255.255.255.255 and port 65535
+static constexpr std::size_t kMaxJsonV4Record =
+    kJsonIp.size() + 15 + kJsonPort.size() + 5 + kJsonEnd.size();
+
+/// One peer as a JSON object, with the trailing comma every record but the
+/// last needs. IPv4 addresses and ports are formatted by hand: sampled
+/// peer lists format every record per request, and going through
+/// address::to_string() allocates twice per record
+static void append_json_record(std::string &out, const PeerEndpoint &peer) {
+    char buf[64];
+    static_assert(kMaxJsonV4Record <= sizeof(buf));
+    char *p = buf;
+    char *const end = buf + sizeof(buf);
+    auto put = [&p](std::string_view s) {
+        std::memcpy(p, s.data(), s.size());
+        p += s.size();
+    };
+    // Can't fail with the buffer sized as above
+    auto put_number = [&p, end](unsigned n) {
+        const auto [ptr, ec] = std::to_chars(p, end, n);
+        if (ec == std::errc{})
+            p = ptr;
+    };
+
+    if (peer.is_v4()) {
+        put(kJsonIp);
+        for (int i = 12; i < 16; ++i) {
+            if (i > 12)
+                *p++ = '.';
+            put_number(peer.bytes[i]);
+        }
+    } else {
+        out += kJsonIp;
+        out += peer.addr().to_string();
+    }
+    put(kJsonPort);
+    put_number(peer.port());
+    put(kJsonEnd);
+    out.append(buf, p);
+}
+
+/// One peer as raw address bytes + big-endian port, into lane 0 for IPv4
+/// or lane 1 for IPv6. The endpoint is already laid out that way
+static uint8_t append_compact_record(std::string (&lanes)[2],
+                                     const PeerEndpoint &peer) {
+    const char *bytes = reinterpret_cast<const char *>(peer.bytes.data());
+    if (peer.is_v4()) {
+        lanes[0].append(bytes + 12, 6);
+        return 0;
+    }
+    lanes[1].append(bytes, 18);
+    return 1;
+}
+
+/// Everything a JSON body has before its peer records
+static void append_json_head(std::string &out, AnnounceTiming timing) {
+    out += "{\"interval\":";
+    out += std::to_string(timing.interval);
+    out += ", \"min interval\":";
+    out += std::to_string(timing.min_interval);
+    out += ", \"peers\":[";
+}
+
+/// Everything a compact body has before its packed IPv4 peers, which take
+/// `v4_bytes`. Keys have to stay in sorted order for this to be valid bencode
+static void append_compact_head(std::string &out, AnnounceTiming timing,
+                                std::size_t v4_bytes) {
+    out += "d8:intervali";
+    out += std::to_string(timing.interval);
+    out += "e12:min intervali";
+    out += std::to_string(timing.min_interval);
+    out += "e5:peers";
+    out += std::to_string(v4_bytes);
+    out += ':';
+}
+
+void write_peer_list(std::string &out, const PeerEndpoint *peers,
+                     const uint32_t *slots, std::size_t count,
+                     PeerListFormat format, AnnounceTiming timing) {
+    if (format == PeerListFormat::json) {
+        append_json_head(out, timing);
+        for (std::size_t i = 0; i < count; ++i)
+            append_json_record(out, peers[slots[i]]);
+        if (count > 0)
+            out.pop_back();
+        out += "]}\n";
+        return;
+    }
+
+    // Two passes over the picks, IPv4 then IPv6, so no lane buffers
+    std::size_t v4 = 0;
+    for (std::size_t i = 0; i < count; ++i)
+        v4 += peers[slots[i]].is_v4();
+    append_compact_head(out, timing, v4 * 6);
+    for (std::size_t i = 0; i < count; ++i) {
+        const PeerEndpoint &peer = peers[slots[i]];
+        if (peer.is_v4())
+            out.append(reinterpret_cast<const char *>(peer.bytes.data()) + 12,
+                       6);
+    }
+    if (v4 < count) {
+        out += "6:peers6";
+        out += std::to_string((count - v4) * 18);
+        out += ':';
+        for (std::size_t i = 0; i < count; ++i) {
+            const PeerEndpoint &peer = peers[slots[i]];
+            if (!peer.is_v4())
+                out.append(reinterpret_cast<const char *>(peer.bytes.data()),
+                           18);
+        }
+    }
+    out += 'e';
+}
+
+void PeerListCache::rebuild(const std::vector<PeerEndpoint> &peers,
+                            std::size_t max_peers, PeerListFormat format,
+                            uint64_t version) {
+    valid_ = true;
+    version_ = version;
+    max_peers_ = max_peers;
+    format_ = format;
+    lanes_[0].clear();
+    lanes_[1].clear();
+    records_.clear();
+
+    const std::size_t count = std::min(peers.size(), max_peers + 1);
+    records_.reserve(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        uint8_t lane = 0;
+        std::size_t before;
+        if (format == PeerListFormat::json) {
+            before = lanes_[0].size();
+            append_json_record(lanes_[0], peers[i]);
+        } else {
+            std::size_t sizes[2] = {lanes_[0].size(), lanes_[1].size()};
+            lane = append_compact_record(lanes_, peers[i]);
+            before = sizes[lane];
+        }
+        records_.push_back(Record{
+            lane, static_cast<uint32_t>(before),
+            static_cast<uint32_t>(lanes_[lane].size() - before)});
+    }
+}
+
+std::size_t PeerListCache::skip_for(std::size_t self_slot) const {
+    if (self_slot < records_.size())
+        return self_slot;
+    // Announcer isn't cached; drop the spare record if we have it
+    if (records_.size() > max_peers_)
+        return records_.size() - 1;
+    return npos;
+}
+
+void PeerListCache::write_body(std::string &out, std::size_t skip,
+                               AnnounceTiming timing) const {
+    // Copy a lane with (at most) the skipped record cut out of it
+    auto lane_without = [&](uint8_t lane, std::string &dst) {
+        const std::string &src = lanes_[lane];
+        if (skip < records_.size() && records_[skip].lane == lane) {
+            const Record &r = records_[skip];
+            dst.append(src, 0, r.offset);
+            dst.append(src, r.offset + r.length, std::string::npos);
+        } else {
+            dst.append(src);
+        }
+    };
+
+    if (format_ == PeerListFormat::json) {
+        append_json_head(out, timing);
+        const std::size_t start = out.size();
+        lane_without(0, out);
+        // Every record carries a trailing comma; the last one mustn't
+        if (out.size() > start)
+            out.pop_back();
+        out += "]}\n";
+        return;
+    }
+
+    auto lane_size = [&](uint8_t lane) {
+        std::size_t n = lanes_[lane].size();
+        if (skip < records_.size() && records_[skip].lane == lane)
+            n -= records_[skip].length;
+        return n;
+    };
+
+    append_compact_head(out, timing, lane_size(0));
+    lane_without(0, out);
+    if (lane_size(1) > 0) {
+        out += "6:peers6";
+        out += std::to_string(lane_size(1));
+        out += ':';
+        lane_without(1, out);
+    }
+    out += 'e';
+}
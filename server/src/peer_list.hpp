@@ -0,0 +1,77 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct PeerEndpoint;
+
+/// When the client should announce again, in seconds
+struct AnnounceTiming {
+    uint32_t interval = 60;
+    uint32_t min_interval = 30;
+};
+
+enum class PeerListFormat {
+    json, // {"interval":N, "min interval":M, "peers":[{"ip":..,"port":N},..]}
+    compact, // BEP 23 / BEP 7 bencoded dict with packed peers/peers6 strings
+};
+
+/// Append a full response body listing peers[slots[0..count)], for peer
+/// lists picked per request rather than served from a cache
+void write_peer_list(std::string &out, const PeerEndpoint *peers,
+                     const uint32_t *slots, std::size_t count,
+                     PeerListFormat format, AnnounceTiming timing);
+
+/// Pre-serialized peer records for the first few peers of a swarm, rebuilt
+/// only when the swarm's membership version moves. A response is the cached
+/// records with at most one of them cut out (the announcer, or the spare
+/// record when the announcer isn't among them), so serving a hot swarm is a
+/// couple of buffer copies instead of formatting every peer again.
+///
+/// Only serves small swarms: TrackerState::peer_list_body uses it when a
+/// leecher's response holds every other peer (at most max_peers of them)
+/// and no locality ranking applies. Bigger swarms are sampled per request,
+/// since one cached window would hand every announcer the same peers.
+class PeerListCache {
+  public:
+    static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+    bool fresh(uint64_t version, std::size_t max_peers) const {
+        return valid_ && version_ == version && max_peers_ == max_peers;
+    }
+
+    /// Serialize the first max_peers + 1 peers (one spare, so the announcer
+    /// can be left out and still return max_peers)
+    void rebuild(const std::vector<PeerEndpoint> &peers, std::size_t max_peers,
+                 PeerListFormat format, uint64_t version);
+
+    /// Which cached record to leave out for an announcer sitting in swarm
+    /// slot `self_slot` (npos if they aren't in the swarm)
+    std::size_t skip_for(std::size_t self_slot) const;
+
+    /// Append a full response body to `out`, leaving out record `skip`
+    void write_body(std::string &out, std::size_t skip,
+                    AnnounceTiming timing) const;
+
+    /// Heap bytes held by the cached records
+    std::size_t memory() const {
+        return lanes_[0].capacity() + lanes_[1].capacity() +
+               records_.capacity() * sizeof(Record);
+    }
+
+  private:
+    struct Record {
+        uint8_t lane;
+        uint32_t offset;
+        uint32_t length;
+    };
+
+    bool valid_ = false;
+    uint64_t version_ = 0;
+    std::size_t max_peers_ = 0;
+    PeerListFormat format_ = PeerListFormat::json;
+    // json: lane 0 holds every record. compact: lane 0 IPv4, lane 1 IPv6
+    std::string lanes_[2];
+    std::vector<Record> records_;
+};
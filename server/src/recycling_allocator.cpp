@@ -0,0 +1,66 @@
+#include "recycling_allocator.hpp"
+#include <new>
+
+namespace recycling {
+namespace {
+
+constexpr std::size_t kClasses = kMaxBlock / kGranule;
+
+// A cached block doubles as its own list node
+struct free_block {
+    free_block *next;
+};
+
+struct thread_cache {
+    free_block *heads[kClasses] = {};
+    std::size_t counts[kClasses] = {};
+
+    ~thread_cache() {
+        for (free_block *&head : heads) {
+            while (head) {
+                free_block *next = head->next;
+                ::operator delete(head);
+                head = next;
+            }
+        }
+    }
+};
+
+thread_local thread_cache cache;
+
+// Blocks of 1..kGranule bytes are class 0
+std::size_t class_of(std::size_t bytes) {
+    return (bytes + kGranule - 1) / kGranule - 1;
+}
+
+} // namespace
+
+void *allocate(std::size_t bytes) {
+    if (bytes == 0 || bytes > kMaxBlock)
+        return ::operator new(bytes);
+    const std::size_t c = class_of(bytes);
+    if (free_block *b = cache.heads[c]) {
+        cache.heads[c] = b->next;
+        --cache.counts[c];
+        return b;
+    }
+    return ::operator new((c + 1) * kGranule);
+}
+
+void deallocate(void *p, std::size_t bytes) noexcept {
+    if (bytes == 0 || bytes > kMaxBlock) {
+        ::operator delete(p);
+        return;
+    }
+    const std::size_t c = class_of(bytes);
+    if (cache.counts[c] >= kMaxCached) {
+        ::operator delete(p);
+        return;
+    }
+    auto *b = static_cast<free_block *>(p);
+    b->next = cache.heads[c];
+    cache.heads[c] = b;
+    ++cache.counts[c];
+}
+
+} // namespace recycling
@@ -0,0 +1,47 @@
+#pragma once
+#include <cstddef>
+#include <type_traits>
+
+/// Per-thread free lists of small blocks, for memory that is allocated and
+/// freed over and over on the request path: HTTP sessions, header fields,
+/// response buffers. Sizes are rounded up to kGranule; each thread keeps up
+/// to kMaxCached blocks of every size, and anything bigger than kMaxBlock
+/// goes straight to operator new. A block freed on another thread than the
+/// one that allocated it just joins that thread's lists.
+namespace recycling {
+
+constexpr std::size_t kGranule = 64;
+constexpr std::size_t kMaxBlock = 8192;
+constexpr std::size_t kMaxCached = 256;
+
+void *allocate(std::size_t bytes);
+void deallocate(void *p, std::size_t bytes) noexcept;
+
+} // namespace recycling
+
+/// Standard allocator over recycling::allocate. Stateless, so every instance
+/// can free what any other allocated
+template <typename T> class recycling_allocator {
+  public:
+    using value_type = T;
+    using is_always_equal = std::true_type;
+
+    recycling_allocator() noexcept = default;
+    template <typename U>
+    recycling_allocator(const recycling_allocator<U> &) noexcept {}
+
+    T *allocate(std::size_t n) {
+        static_assert(alignof(T) <= alignof(std::max_align_t),
+                      "recycled blocks are only max_align_t aligned");
+        return static_cast<T *>(recycling::allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T *p, std::size_t n) noexcept {
+        recycling::deallocate(p, n * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const recycling_allocator<U> &) const noexcept {
+        return true;
+    }
+};
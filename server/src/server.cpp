@@ -1,460 +1,662 @@
-#include <algorithm> // for std::remove_if
+#include "server.hpp"
+#include "admission.hpp"
+#include "announce_interval.hpp"
+#include "announce_query.hpp"
+#include "announce_request.hpp"
+#include "cluster.hpp"
+#include "locality.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+#include "recycling_allocator.hpp"
+#include "snapshot.hpp"
+#include "tracker_state.hpp"
+#include "udp_tracker.hpp"
+#include <algorithm>
+#include <array>
 #include <boost/asio.hpp>
 #include <boost/asio/generic/detail/endpoint.hpp>
 #include <boost/beast.hpp>
 #include <boost/beast/http.hpp>
 #include <boost/beast/version.hpp>
-#include <boost/lexical_cast.hpp>
 #include <chrono>
+#include <cmath>
+#include <csignal>
 #include <iostream>
 #include <map>
 #include <optional>
 #include <string>
-#include <unordered_map>
+#include <string_view>
+#include <thread>
 #include <vector>
 
 using tcp = boost::asio::ip::tcp;
 namespace http = boost::beast::http;
-using steady_clock = std::chrono::steady_clock;
-
-static int from_hex(char c) {
-    if (c >= '0' && c <= '9')
-        return c - '0';
-    if (c >= 'a' && c <= 'f')
-        return c - 'a' + 10;
-    if (c >= 'A' && c <= 'F')
-        return c - 'A' + 10;
-    return -1;
-}
 
-static std::string to_hex(const std::string &data) {
-    static const char *hex = "0123456789ABCDEF";
-    std::string out;
-    out.reserve(data.size() * 2);
+// Every connection runs on a strand of its own. Sessions name the strand type
+// rather than the type-erased any_io_executor, which is too small to hold a
+// strand and would allocate whenever an operation copies the executor
+using session_executor =
+    boost::asio::strand<boost::asio::io_context::executor_type>;
+using session_socket = tcp::socket::rebind_executor<session_executor>::other;
+using session_timer =
+    boost::asio::basic_waitable_timer<steady_clock,
+                                      boost::asio::wait_traits<steady_clock>,
+                                      session_executor>;
+template <typename T = void>
+using session_task = boost::asio::awaitable<T, session_executor>;
+
+// Header fields of requests and responses come and go with every request, so
+// they live in recycled memory
+using fields_type = http::basic_fields<recycling_allocator<char>>;
+using request_type = http::request<http::string_body, fields_type>;
+using response_type = http::response<http::string_body, fields_type>;
+
+// One connection, served by a coroutine that reads a request, builds the
+// response in place and writes it, for as long as the client keeps the
+// connection alive. The session, its parser and its response are reused
+// from one request to the next and the session itself sits in recycled
+// memory, so a steady stream of announces doesn't touch the heap.
+//
+// Announces take a shortcut past Beast's parser: the request head is read
+// into the connection's buffer and, if it has the one shape announces come
+// in, served straight from there (see parse_announce_request). Anything
+// else is handed to Beast's parser, which starts from the same buffer.
+//
+// A second coroutine watches for idle connections: every read and write
+// moves a deadline forward, and the watchdog closes the socket once the
+// deadline has passed. Moving the deadline is a store, unlike re-arming a
+// timer per operation.
+class http_session : public std::enable_shared_from_this<http_session> {
+    // local variables
+    session_socket socket_;
+    session_timer idle_timer_;
+    steady_clock::time_point deadline_;
+    // Holds anything read past the current request, so pipelined requests
+    // are picked up by the next read
+    boost::beast::flat_buffer buffer_;
+    static constexpr std::size_t kReadSize = 1024;
+    std::optional<http::request_parser<http::string_body,
+                                       recycling_allocator<char>>>
+        parser_;
+    response_type res_;
+    std::string scratch_; // announce body, reused
+    TrackerState &state_;
+    const ServerOptions &opts_;
+    AdmissionControl &admission_;
+    const IntervalPolicy &intervals_;
+    cluster_node *cluster_; // null when standalone
+    // Remote address observed by server (more trustworthy than client
+    // param), looked up once per connection
+    tcp::endpoint remote_;
+    // What the current request is, and when we started handling it
+    metrics::route route_ = metrics::route::other;
+    steady_clock::time_point started_;
+    // The current request's HTTP version, and whether it asked to keep the
+    // connection open
+    unsigned version_ = 11;
+    bool keep_alive_ = false;
+    // Set when shedding an announce, so the connection isn't kept around
+    bool close_after_ = false;
+    bool done_ = false; // serve() has returned
 
-    for (unsigned char c : data) {
-        out.push_back(hex[c >> 4]);
-        out.push_back(hex[c & 0xF]);
+  public:
+    http_session(session_socket &&s, tcp::endpoint remote, TrackerState &st,
+                 const ServerOptions &opts, AdmissionControl &admission,
+                 const IntervalPolicy &intervals, cluster_node *cluster)
+        : socket_(std::move(s)), idle_timer_(socket_.get_executor()),
+          state_(st), opts_(opts), admission_(admission),
+          intervals_(intervals), cluster_(cluster), remote_(remote) {
+        TLOG(trace) << "[http_session] New session constructed";
+        metrics::connections_opened.add();
+        admission_.connection_opened();
     }
-    return out;
-}
 
-static std::string url_decode(const std::string &in) {
-    std::string out;
-    out.reserve(in.size());
-
-    for (size_t i = 0; i < in.size(); ++i) {
-        char c = in[i];
-        if (c == '%' && i + 2 < in.size()) {
-            int hi = from_hex(in[i + 1]);
-            int lo = from_hex(in[i + 2]);
-            if (hi >= 0 && lo >= 0) {
-                char decoded = static_cast<char>((hi << 4) | lo);
-                out.push_back(decoded);
-                i += 2;
-            } else {
-                // malformed % sequence, keep as-is
-                out.push_back(c);
-            }
-        } else if (c == '+') {
-            // application/x-www-form-urlencoded space
-            out.push_back(' ');
-        } else {
-            out.push_back(c);
-        }
+    ~http_session() {
+        metrics::connections_closed.add();
+        admission_.connection_closed();
     }
 
-    return out;
-}
-
-struct Peer {
-    // Peer connection information
-    boost::asio::ip::address addr;
-    uint16_t port;
-    std::string
-        peer_id; // This will be the id associated with what they have to offer
-    steady_clock::time_point
-        last_seen; // Keep track of when they were last connected
-};
-
-struct TrackerState {
-    // infohash -> list of peers
-    std::unordered_map<std::string, std::vector<Peer>> swarms;
-    std::chrono::seconds ttl{120}; // How long until peer is considered stale
-
-    void gc() {
-        const auto now = steady_clock::now();
-        std::cout << "[TrackerState::gc] Running GC over " << swarms.size()
-                  << " swarm(s)\n";
-        for (auto &[ih, peers] : swarms) {
-            auto before = peers.size();
-            std::string ih_hex = to_hex(ih);
-            peers.erase(
-                std::remove_if(peers.begin(), peers.end(),
-                               [&](const Peer &p) {
-                                   auto age = now - p.last_seen;
-                                   bool stale = age > ttl;
-                                   if (stale) {
-                                       std::cout
-                                           << "[TrackerState::gc] Removing "
-                                              "stale peer in swarm "
-                                           << ih_hex << " ip=" << p.addr
-                                           << " port=" << p.port
-                                           << " peer_id=" << p.peer_id << "\n";
-                                   }
-                                   return stale;
-                               }),
-                peers.end());
-            std::cout << "[TrackerState::gc] Swarm " << ih_hex
-                      << " peers before=" << before << " after=" << peers.size()
-                      << "\n";
-        }
+    void run() {
+        TLOG(trace) << "[http_session::run] Starting session";
+        deadline_ = steady_clock::now() + opts_.idle_timeout;
+        auto ex = socket_.get_executor();
+        boost::asio::co_spawn(
+            ex, [self = shared_from_this()] { return self->serve(); },
+            boost::asio::detached);
+        boost::asio::co_spawn(
+            ex, [self = shared_from_this()] { return self->watch_idle(); },
+            boost::asio::detached);
     }
 
-    /// Upon connection, if the peer exists in the list for a certain infohash,
-    /// update their last_seen variable, otherwise add them to the end
-    void upsert_peer(const std::string &infohash,
-                     const boost::asio::ip::address &addr, uint16_t port,
-                     const std::string &peer_id) {
-        auto &peers = swarms[infohash];
-        const auto now = steady_clock::now();
-        std::string ih_hex = to_hex(infohash);
-        std::cout << "[TrackerState::upsert_peer] infohash=" << ih_hex
-                  << " ip=" << addr << " port=" << port
-                  << " peer_id=" << peer_id
-                  << " current_peer_count=" << peers.size() << "\n";
-
-        // Iterate list of peers matching the infohash given
-        for (auto &p : peers) {
-            // if the peer we are at matches the given one, update their time
-            if (p.addr == addr && p.port == port && p.peer_id == peer_id) {
-                std::cout << "[TrackerState::upsert_peer] Updating existing "
-                             "peer last_seen\n";
-                p.last_seen = now;
-                return;
+  private:
+    session_task<> serve() {
+        boost::system::error_code ec;
+        auto token = boost::asio::redirect_error(
+            boost::asio::use_awaitable_t<session_executor>{}, ec);
+        for (;;) {
+            TLOG(trace) << "[http_session::serve] Waiting for request...";
+            AnnounceRequest announce;
+            HeadParse head;
+            while ((head = parse_announce_request(buffered(), announce)) ==
+                   HeadParse::need_more) {
+                const std::size_t n = co_await socket_.async_read_some(
+                    buffer_.prepare(kReadSize), token);
+                buffer_.commit(n);
+                if (ec)
+                    break;
+            }
+            if (ec == boost::asio::error::eof && buffer_.size() == 0) {
+                // Client is done with the connection
+                do_close();
+                break;
+            }
+            if (ec) {
+                TLOG(debug) << "[http_session::serve] Error in reading "
+                               "client request: "
+                            << ec.message() << " (" << ec.value() << ")";
+                break;
             }
-        }
-
-        std::cout << "[TrackerState::upsert_peer] Adding new peer\n";
-        peers.push_back(Peer{addr, port, peer_id, now});
-    }
-
-    /// Go through all peers and if peer matches description, remove it from
-    /// infohash
-    void remove_peer(const std::string &infohash,
-                     const boost::asio::ip::address &addr, uint16_t port,
-                     const std::string &peer_id) {
-        auto it = swarms.find(infohash);
-        std::string ih_hex = to_hex(infohash);
-        if (it == swarms.end()) {
-            std::cout
-                << "[TrackerState::remove_peer] No swarm found for infohash="
-                << ih_hex << "\n";
-            return;
-        }
-        auto &peers = it->second;
-        auto before = peers.size();
-        peers.erase(std::remove_if(peers.begin(), peers.end(),
-                                   [&](const Peer &p) {
-                                       return p.addr == addr &&
-                                              p.port == port &&
-                                              p.peer_id == peer_id;
-                                   }),
-                    peers.end());
-        std::cout << "[TrackerState::remove_peer] infohash=" << infohash
-                  << " removed_peers=" << (before - peers.size())
-                  << " remaining=" << peers.size() << "\n";
-    }
-
-    // Returns a list of peers excluding your own, with a bound on the size of
-    // the list
-    std::vector<Peer> list_peers(const std::string &infohash,
-                                 const boost::asio::ip::address &self_addr,
-                                 uint16_t self_port,
-                                 const std::string &self_peer_id,
-                                 size_t max_peers = 50) {
-        std::vector<Peer> out;
-        auto it = swarms.find(infohash);
-        std::string ih_hex = to_hex(infohash);
-        if (it == swarms.end()) {
-            std::cout << "[TrackerState::list_peers] No swarm for infohash="
-                      << ih_hex << "\n";
-            return out;
-        }
-
-        std::cout
-            << "[TrackerState::list_peers] Building peer list for infohash="
-            << ih_hex << " total_peers_in_swarm=" << it->second.size()
-            << " max_peers=" << max_peers << "\n";
 
-        for (auto &p : it->second) {
-            if (p.peer_id == self_peer_id && p.addr == self_addr &&
-                p.port == self_port) {
-                continue;
+            if (head == HeadParse::done) {
+                TLOG(trace) << "[http_session::serve] Read "
+                            << announce.size << " bytes (announce)";
+                metrics::http_bytes_in.add(announce.size);
+                deadline_ = steady_clock::now() + opts_.idle_timeout;
+                handle_announce_request(announce);
+                // The response holds its own copy of anything it needs
+                buffer_.consume(announce.size);
+            } else {
+                // Parsers are single-use; a fresh one reuses the same
+                // storage
+                parser_.emplace();
+                const std::size_t read = co_await http::async_read(
+                    socket_, buffer_, *parser_, token);
+                if (ec == http::error::end_of_stream) {
+                    do_close();
+                    break;
+                }
+                if (ec) {
+                    TLOG(debug) << "[http_session::serve] Error in reading "
+                                   "client request: "
+                                << ec.message() << " (" << ec.value() << ")";
+                    break;
+                }
+                TLOG(trace) << "[http_session::serve] Read " << read
+                            << " bytes";
+                metrics::http_bytes_in.add(read);
+                deadline_ = steady_clock::now() + opts_.idle_timeout;
+                handle_request();
             }
-            out.push_back(p);
-            if (out.size() >= max_peers)
+
+            http::response_serializer<http::string_body, fields_type> sr{res_};
+            const std::size_t written =
+                co_await http::async_write(socket_, sr, token);
+            TLOG(trace) << "[http_session::serve] async_write completed: "
+                        << "bytes=" << written
+                        << " ec=" << (ec ? ec.message() : "OK");
+            metrics::http_bytes_out.add(written);
+            if (ec)
+                break;
+            deadline_ = steady_clock::now() + opts_.idle_timeout;
+            // Go back for the next (possibly already pipelined) request
+            if (!res_.keep_alive()) {
+                do_close();
                 break;
+            }
         }
-
-        std::cout << "[TrackerState::list_peers] Returning " << out.size()
-                  << " peer(s)\n";
-        return out;
+        // Wakes the watchdog, which lets go of the session
+        done_ = true;
+        idle_timer_.cancel();
     }
-};
-
-static std::optional<std::string> query_param(const std::string &target,
-                                              const std::string &key) {
-    // crude query extractor with URL decoding
-    auto pos = target.find('?');
-    if (pos == std::string::npos)
-        return std::nullopt;
-
-    auto q = target.substr(pos + 1);
-    size_t start = 0;
-
-    while (start < q.size()) {
-        auto eq = q.find('=', start);
-        if (eq == std::string::npos)
-            break;
-
-        auto amp = q.find('&', eq + 1);
 
-        std::string raw_k = q.substr(start, eq - start);
-        std::string raw_v =
-            q.substr(eq + 1, amp == std::string::npos ? std::string::npos
-                                                      : amp - (eq + 1));
-
-        // Decode key and value
-        std::string dec_k = url_decode(raw_k);
-        std::string dec_v = url_decode(raw_v);
-
-        if (dec_k == key) {
-            return dec_v;
+    // Close the connection once it has sat idle past its deadline
+    session_task<> watch_idle() {
+        boost::system::error_code ec;
+        auto token = boost::asio::redirect_error(
+            boost::asio::use_awaitable_t<session_executor>{}, ec);
+        while (!done_) {
+            if (deadline_ <= steady_clock::now()) {
+                TLOG(debug) << "[http_session::watch_idle] Closing idle "
+                               "connection from "
+                            << remote_;
+                socket_.close(ec);
+                break;
+            }
+            idle_timer_.expires_at(deadline_);
+            co_await idle_timer_.async_wait(token);
         }
-
-        if (amp == std::string::npos)
-            break;
-        start = amp + 1;
     }
 
-    return std::nullopt;
-}
-class http_session : public std::enable_shared_from_this<http_session> {
-    // local variables
-    tcp::socket socket_;
-    boost::beast::flat_buffer buffer_;
-    http::request<http::string_body> req_;
-    TrackerState &state_;
-
-  public:
-    http_session(tcp::socket &&s, TrackerState &st)
-        : socket_(std::move(s)), state_(st) {
-        std::cout << "[http_session] New session constructed\n";
+    void do_close() {
+        boost::beast::error_code ec_shutdown;
+        socket_.shutdown(tcp::socket::shutdown_send, ec_shutdown);
+        if (ec_shutdown) {
+            TLOG(debug) << "[http_session::do_close] shutdown error: "
+                        << ec_shutdown.message();
+        } else {
+            TLOG(trace) << "[http_session::do_close] Connection "
+                           "shutdown cleanly";
+        }
     }
 
-    void run() {
-        std::cout << "[http_session::run] Starting session\n";
-        do_read();
+    std::string_view buffered() const {
+        return {static_cast<const char *>(buffer_.data().data()),
+                buffer_.size()};
     }
 
-  private:
-    // Read client message and handle request if not errors
-    void do_read() {
-        std::cout << "[http_session::do_read] Waiting for request...\n";
-        http::async_read(socket_, buffer_, req_,
-                         [self = shared_from_this()](
-                             boost::beast::error_code ec, std::size_t bytes) {
-                             if (!ec) {
-                                 std::cout << "[http_session::do_read] Read "
-                                           << bytes << " bytes\n";
-                                 self->handle_request();
-                             } else {
-                                 std::cout << "[http_session::do_read] Error "
-                                              "in reading client request: "
-                                           << ec.message() << " (" << ec.value()
-                                           << ")\n";
-                             }
-                         });
+    // Handle an announce read by parse_announce_request, leaving the
+    // response in res_
+    void handle_announce_request(const AnnounceRequest &req) {
+        started_ = steady_clock::now();
+        route_ = metrics::route::announce;
+        version_ = req.version;
+        keep_alive_ = req.keep_alive;
+        TLOG(trace) << "[http_session::handle_announce_request] Request "
+                       "line: GET "
+                    << req.target << " HTTP/" << req.version;
+        dispatch(req.target);
     }
 
+    // Handle the request the parser holds, leaving the response in res_
     void handle_request() {
-        std::cout << "[http_session::handle_request] Handling request\n";
+        const request_type &req = parser_->get();
+        TLOG(trace) << "[http_session::handle_request] Handling request";
+        started_ = steady_clock::now();
+        version_ = req.version();
+        keep_alive_ = req.keep_alive();
+
+        const std::string_view target(req.target().data(),
+                                      req.target().size());
+        if (target.rfind("/announce", 0) == 0) {
+            route_ = metrics::route::announce;
+        } else if (target.rfind("/scrape", 0) == 0) {
+            route_ = metrics::route::scrape;
+        } else if (target.rfind("/metrics", 0) == 0) {
+            route_ = metrics::route::metrics;
+        } else {
+            route_ = metrics::route::other;
+        }
 
-        std::cout << "[http_session::handle_request] Request line: "
-                  << req_.method_string() << " " << req_.target() << " HTTP/"
-                  << req_.version() << "\n";
+        TLOG(trace) << "[http_session::handle_request] Request line: "
+                    << req.method_string() << " " << req.target() << " HTTP/"
+                    << req.version();
 
-        std::cout << "[http_session::handle_request] Headers:\n";
-        for (auto const &field : req_) {
-            std::cout << "  " << field.name_string() << ": " << field.value()
-                      << "\n";
+        if (tlog::enabled(LogLevel::trace)) {
+            tlog::line headers(LogLevel::trace);
+            headers << "[http_session::handle_request] Headers:";
+            for (auto const &field : req) {
+                headers << "\n  " << field.name_string() << ": "
+                        << field.value();
+            }
         }
 
-        std::cout << "[http_session::handle_request] Body: '" << req_.body()
-                  << "'\n";
+        TLOG(trace) << "[http_session::handle_request] Body: '" << req.body()
+                    << "'";
 
-        if (req_.method() != http::verb::get) {
-            std::cout
-                << "[http_session::handle_request] Error: non-GET request\n";
+        if (req.method() != http::verb::get) {
+            TLOG(debug)
+                << "[http_session::handle_request] Error: non-GET request";
             return write_response(http::status::method_not_allowed,
                                   R"({"error":"use GET"})");
         }
+        dispatch(target);
+    }
 
-        const auto target = std::string(req_.target());
-        std::cout << "[http_session::handle_request] Target string: " << target
-                  << "\n";
+    // Serve a GET of `target`, route_ already set
+    void dispatch(std::string_view target) {
+        TLOG(trace) << "[http_session::dispatch] Target string: " << target;
 
-        if (target.rfind("/announce", 0) != 0) {
-            std::cout << "[http_session::handle_request] Error: target does "
-                         "not start with /announce\n";
+        if (route_ == metrics::route::scrape)
+            return handle_scrape(target);
+        if (route_ == metrics::route::metrics) {
+            return write_response(http::status::ok,
+                                  metrics::render(state_.stats()),
+                                  "text/plain; version=0.0.4");
+        }
+
+        if (route_ != metrics::route::announce) {
+            TLOG(debug) << "[http_session::dispatch] Error: target does "
+                           "not start with /announce, /scrape or /metrics";
             return write_response(http::status::not_found,
                                   R"({"error":"not found"})");
         }
 
-        // Extract parameters
-        auto ih = query_param(target, "infohash");
-        auto pid = query_param(target, "peer_id");
-        auto port = query_param(target, "port");
-        auto ev = query_param(target, "event");
-
-        if (!ih || !pid || !port) {
-            std::cout << "[http_session::handle_request] Missing one or more "
-                         "required params: "
-                      << "infohash=" << (ih ? to_hex(ih.value()) : "<none>")
-                      << ", "
-                      << "peer_id=" << (pid ? *pid : "<none>") << ", "
-                      << "port=" << (port ? *port : "<none>") << "\n";
-            return write_response(
-                http::status::bad_request,
-                R"({"error":"missing infohash|peer_id|port"})");
-        }
+        // Shed before parsing, a turned-away announce should cost next to
+        // nothing
+        if (!admit_announce())
+            return;
 
-        std::string ih_hex = to_hex(ih.value());
-
-        std::cout << "[http_session::handle_request] Parameters: {\n"
-                  << "  infohash: " << ih_hex << "\n"
-                  << "  peer_id: " << pid.value() << "\n"
-                  << "  port: " << port.value() << "\n"
-                  << "  event: " << (ev ? ev.value() : "<none>") << "\n"
-                  << "}\n";
-
-        uint16_t p = 0;
-        // try to cast the given port number to uint16_t
-        try {
-            p = boost::lexical_cast<uint16_t>(*port);
-            std::cout << "[http_session::handle_request] Parsed port as " << p
-                      << "\n";
-        } catch (const std::exception &ex) {
-            std::cout << "[http_session::handle_request] Error parsing port: "
-                      << ex.what() << "\n";
-            return write_response(http::status::bad_request,
-                                  R"({"error":"bad port"})");
-        } catch (...) {
-            std::cout << "[http_session::handle_request] Unknown error parsing "
-                         "port\n";
+        AnnounceQuery q;
+        QueryError err = parse_announce_query(target, q);
+        if (err != QueryError::none) {
+            TLOG(debug) << "[http_session::dispatch] Bad announce "
+                           "query: "
+                        << query_error_body(err);
             return write_response(http::status::bad_request,
-                                  R"({"error":"bad port"})");
+                                  query_error_body(err));
         }
 
-        // Remote address observed by server (more trustworthy than client
-        // param)
-        boost::beast::error_code ep_ec;
-        auto ep = socket_.remote_endpoint(ep_ec);
-        if (ep_ec) {
-            std::cout << "[http_session::handle_request] Error getting "
-                         "remote_endpoint: "
-                      << ep_ec.message() << "\n";
+        TLOG(trace) << "[http_session::dispatch] Parameters: {\n"
+                    << "  infohash: " << to_hex(q.infohash_view()) << "\n"
+                    << "  peer_id: " << q.peer_id() << "\n"
+                    << "  port: " << q.port << "\n"
+                    << "  event: " << static_cast<int>(q.event) << "\n"
+                    << "}";
+
+        const auto addr = remote_.address();
+        TLOG(trace) << "[http_session::dispatch] Remote endpoint: ip="
+                    << addr << " port=" << remote_.port();
+
+        if (target.rfind("/announce_batch", 0) == 0)
+            return handle_announce_batch(target, q);
+
+        const std::string_view ih = q.infohash_view();
+        const std::string_view pid = q.peer_id();
+        const std::size_t swarm_size = announce_peer(ih, q, addr);
+
+        // Now get the list of peers that aren't the one we're communicating
+        // with, already serialized
+        const bool compact = q.compact;
+        scratch_.clear();
+        state_.peer_list_body(
+            scratch_, ih, addr, q.port, pid,
+            compact ? PeerListFormat::compact : PeerListFormat::json,
+            intervals_.timing(swarm_size, pid), num_want(q),
+            q.has_left && q.left == 0);
+
+        TLOG(trace) << "[http_session::dispatch] Response body length="
+                    << scratch_.size() << " compact=" << compact;
+
+        // Send the peer list back to the client
+        write_response(http::status::ok, scratch_,
+                       compact ? "text/plain" : "application/json");
+    }
+
+    // Whether the peer may announce. If not, answers 503 or 429 and
+    // returns false
+    bool admit_announce() {
+        switch (admission_.admit_announce(remote_.address())) {
+        case AdmissionControl::Verdict::admit:
+            return true;
+        case AdmissionControl::Verdict::overloaded:
+            TLOG(debug) << "[http_session::admit_announce] Overloaded, "
+                           "shedding announce from "
+                        << remote_.address();
+            close_after_ = true;
+            write_response(http::status::service_unavailable,
+                           admission_.overloaded_body());
+            return false;
+        case AdmissionControl::Verdict::rate_limited:
+            TLOG(debug) << "[http_session::admit_announce] Rate limiting "
+                        << remote_.address();
+            write_response(http::status::too_many_requests,
+                           admission_.rate_limited_body());
+            return false;
         }
-        auto addr = ep.address();
+        return false;
+    }
 
-        std::cout << "[http_session::handle_request] Remote endpoint: ip="
-                  << addr << " port=" << ep.port() << "\n";
+    static std::size_t num_want(const AnnounceQuery &q) {
+        return q.num_want < 0 ? TrackerState::kDefaultNumWant
+                              : static_cast<std::size_t>(q.num_want);
+    }
 
-        // Maintain state
-        std::cout << "[http_session::handle_request] Calling state_.gc()\n";
-        state_.gc();
+    // Add, refresh or (on event=stopped) remove the announcing peer in one
+    // swarm and tell the cluster. Returns the swarm size after the announce
+    std::size_t announce_peer(std::string_view ih, const AnnounceQuery &q,
+                              const boost::asio::ip::address &addr) {
+        const std::string_view pid = q.peer_id();
 
         // if action is "stopped", remove peer else update its time
-        if (ev && *ev == "stopped") {
-            std::cout << "[http_session::handle_request] Event=stopped, "
-                         "removing peer from swarm\n";
-            state_.remove_peer(*ih, addr, p, *pid);
+        std::size_t swarm_size = 0;
+        if (q.event == AnnounceEvent::stopped) {
+            TLOG(trace) << "[http_session::announce_peer] Event=stopped, "
+                           "removing peer from swarm";
+            state_.remove_peer(ih, addr, q.port, pid);
         } else {
-            std::cout << "[http_session::handle_request] Upserting peer (event="
-                      << (ev ? *ev : "none") << ")\n";
-            state_.upsert_peer(*ih, addr, p, *pid);
+            TLOG(trace) << "[http_session::announce_peer] Upserting peer "
+                           "(event="
+                        << static_cast<int>(q.event) << ")";
+            // Clients that don't send left are counted as leechers
+            swarm_size = state_.upsert_peer(
+                ih, addr, q.port, pid, q.has_left && q.left == 0,
+                q.event == AnnounceEvent::completed);
         }
+        if (cluster_) {
+            cluster_->publish(
+                {q.event == AnnounceEvent::stopped ? PeerDelta::Kind::remove
+                                                   : PeerDelta::Kind::upsert,
+                 q.has_left && q.left == 0,
+                 q.event == AnnounceEvent::completed, std::string(ih), addr,
+                 q.port, std::string(pid)});
+        }
+        return swarm_size;
+    }
 
-        // Now get the list of peers that aren't the one we're communicating
-        // with
-        std::cout << "[http_session::handle_request] Listing peers for swarm\n";
-        auto peers = state_.list_peers(*ih, addr, p, *pid);
-
-        std::cout << "[http_session::handle_request] Got " << peers.size()
-                  << " peer(s) to send back\n";
-
-        // Start our response
-        std::string body = R"({"interval":60, "peers":[)";
-
-        // Go through peers that match infohash and build a string with their
-        // information
-        for (size_t i = 0; i < peers.size(); ++i) {
-            const auto &peer = peers[i];
-            body += "{\"ip\":\"" + peer.addr.to_string() +
-                    "\",\"port\":" + std::to_string(peer.port) + "}";
-            if (i + 1 < peers.size()) {
-                body += ",";
+    // One announce into every infohash= in the query, sharing peer_id,
+    // port, left and event, so a client seeding many torrents on this
+    // tracker needs one request instead of one per torrent. Each swarm gets
+    // the body a single announce would have, keyed by infohash:
+    // {"files":{"<HEX>":{"interval":..,"peers":[..]},..},"interval":N,..}
+    // or with compact=1 a bencoded dict keyed by the raw infohash. The
+    // top-level interval is the longest of the swarms'
+    void handle_announce_batch(std::string_view target,
+                               const AnnounceQuery &q) {
+        static constexpr std::size_t kMaxBatchHashes = 128;
+
+        std::vector<std::string> hashes;
+        if (!collect_infohashes(target, kMaxBatchHashes, hashes))
+            return;
+        // Bencoded dict keys have to be sorted, and announcing twice into
+        // one swarm would only list the peer to itself
+        std::sort(hashes.begin(), hashes.end());
+        hashes.erase(std::unique(hashes.begin(), hashes.end()), hashes.end());
+        // Every swarm costs an announce token; dispatch() took the first
+        admission_.charge_announces(remote_.address(), hashes.size() - 1);
+
+        const auto addr = remote_.address();
+        const bool compact = q.compact;
+        AnnounceTiming longest{0, 0};
+        scratch_.clear();
+        scratch_ += compact ? "d5:filesd" : R"({"files":{)";
+        for (std::size_t i = 0; i < hashes.size(); ++i) {
+            const std::string_view ih = hashes[i];
+            const std::size_t swarm_size = announce_peer(ih, q, addr);
+            const AnnounceTiming timing =
+                intervals_.timing(swarm_size, q.peer_id());
+            longest.interval = std::max(longest.interval, timing.interval);
+            longest.min_interval =
+                std::max(longest.min_interval, timing.min_interval);
+
+            if (compact) {
+                scratch_ += std::to_string(ih.size());
+                scratch_ += ':';
+                scratch_ += ih;
+            } else {
+                if (i > 0)
+                    scratch_ += ',';
+                scratch_ += '"';
+                scratch_ += to_hex(ih);
+                scratch_ += R"(":)";
             }
+            state_.peer_list_body(
+                scratch_, ih, addr, q.port, q.peer_id(),
+                compact ? PeerListFormat::compact : PeerListFormat::json,
+                timing, num_want(q), q.has_left && q.left == 0);
+            if (!compact && scratch_.back() == '\n')
+                scratch_.pop_back();
         }
+        if (compact) {
+            scratch_ += "e8:intervali";
+            scratch_ += std::to_string(longest.interval);
+            scratch_ += "e12:min intervali";
+            scratch_ += std::to_string(longest.min_interval);
+            scratch_ += "ee";
+        } else {
+            scratch_ += R"(},"interval":)";
+            scratch_ += std::to_string(longest.interval);
+            scratch_ += R"(,"min interval":)";
+            scratch_ += std::to_string(longest.min_interval);
+            scratch_ += "}\n";
+        }
+
+        TLOG(trace) << "[http_session::handle_announce_batch] Announced into "
+                    << hashes.size() << " swarm(s), body length="
+                    << scratch_.size();
+        write_response(http::status::ok, scratch_,
+                       compact ? "text/plain" : "application/json");
+    }
+
+    // Decode every infohash= in the query into `hashes`. Answers 400 and
+    // returns false if one is malformed, none is given or there are more
+    // than `max`
+    bool collect_infohashes(std::string_view target, std::size_t max,
+                            std::vector<std::string> &hashes) {
+        bool bad = false;
+        for_each_query_param(target, [&](std::string_view key,
+                                         std::string_view raw) {
+            if (key != "infohash")
+                return true;
+            if (hashes.size() == max + 1)
+                return false;
+            char ih[AnnounceQuery::kInfohashLen];
+            bad = percent_decode(raw, ih, sizeof(ih)) !=
+                  static_cast<long>(sizeof(ih));
+            hashes.emplace_back(ih, sizeof(ih));
+            return !bad;
+        });
+        if (bad) {
+            write_response(http::status::bad_request,
+                           query_error_body(QueryError::bad_infohash));
+            return false;
+        }
+        if (hashes.empty()) {
+            TLOG(debug) << "[http_session::collect_infohashes] Error: no "
+                           "infohash";
+            write_response(http::status::bad_request,
+                           R"({"error":"missing infohash"})");
+            return false;
+        }
+        if (hashes.size() > max) {
+            TLOG(debug) << "[http_session::collect_infohashes] Error: "
+                        << hashes.size() << " infohashes";
+            write_response(http::status::bad_request,
+                           R"({"error":"too many infohashes"})");
+            return false;
+        }
+        return true;
+    }
+
+    // Seeder/leecher/completed counts for each infohash= in the query,
+    // straight from the swarm counters:
+    // {"files":{"<HEX>":{"complete":S,"incomplete":L,"downloaded":C},...}}
+    void handle_scrape(std::string_view target) {
+        static constexpr std::size_t kMaxScrapeHashes = 128;
 
-        body += "]}\n";
+        std::vector<std::string> hashes;
+        if (!collect_infohashes(target, kMaxScrapeHashes, hashes))
+            return;
 
-        std::cout << "[http_session::handle_request] Response body length="
-                  << body.size() << "\n";
+        std::string body = R"({"files":{)";
+        for (std::size_t i = 0; i < hashes.size(); ++i) {
+            auto counts = state_.scrape(hashes[i]);
+            if (i > 0)
+                body += ',';
+            body += '"';
+            body += to_hex(hashes[i]);
+            body += R"(":{"complete":)";
+            body += std::to_string(counts.seeders);
+            body += R"(,"incomplete":)";
+            body += std::to_string(counts.leechers);
+            body += R"(,"downloaded":)";
+            body += std::to_string(counts.completed);
+            body += '}';
+        }
+        body += "}}";
 
-        // Send that json document back to the client
-        write_response(http::status::ok, body, "application/json");
+        TLOG(trace) << "[http_session::handle_scrape] Scraped "
+                    << hashes.size() << " infohash(es)";
+        write_response(http::status::ok, body);
     }
 
-    // Send a message to the connected client
-    void write_response(boost::beast::http::status s, std::string body,
-                        std::string content_type = "application/json") {
-        std::cout << "[http_session::write_response] Sending response status="
-                  << static_cast<unsigned>(s) << " body_length=" << body.size()
-                  << " content_type=" << content_type << "\n";
+    // Build the response to the current request in res_, reusing its
+    // fields and body storage
+    void write_response(http::status s, std::string_view body,
+                        std::string_view content_type = "application/json") {
+        TLOG(trace) << "[http_session::write_response] Sending response "
+                       "status="
+                    << static_cast<unsigned>(s)
+                    << " body_length=" << body.size()
+                    << " content_type=" << content_type;
+
+        metrics::count_request(route_, static_cast<unsigned>(s));
+        if (route_ == metrics::route::announce)
+            metrics::observe_announce(false, steady_clock::now() - started_);
 
-        auto res = std::make_shared<http::response<http::string_body>>(
-            s, req_.version());
+        res_.clear();
+        res_.result(s);
+        res_.version(version_);
 
         // Setup http fields
-        res->set(http::field::server, "btmini-tracker");
-        res->set(http::field::content_type, content_type);
-        // We dont want to keep the connection
-        res->keep_alive(false);
+        if (s == http::status::service_unavailable ||
+            s == http::status::too_many_requests) {
+            res_.set(http::field::retry_after,
+                     std::to_string(
+                         admission_.limits.overload_interval.count()));
+        }
+        res_.set(http::field::server, "btmini-tracker");
+        res_.set(http::field::content_type,
+                 boost::beast::string_view(content_type.data(),
+                                           content_type.size()));
+        // Keep the connection if the client asked for it
+        res_.keep_alive(keep_alive_ && !close_after_);
         // Set the message to the given message
-        res->body() = std::move(body);
+        res_.body().assign(body.data(), body.size());
         // Update payload parameters
-        res->prepare_payload();
-        // Begin an asynchronous write
-        http::async_write(
-            socket_, *res,
-            [self = shared_from_this(), res](boost::beast::error_code ec,
-                                             std::size_t bytes) {
-                std::cout
-                    << "[http_session::write_response] async_write completed: "
-                    << "bytes=" << bytes << " ec=" << (ec ? ec.message() : "OK")
-                    << "\n";
+        res_.prepare_payload();
+    }
+};
+
+// A connection turned away at accept. Writes one canned response without
+// reading or parsing anything, then lingers just long enough to drain what
+// the client already sent, so closing doesn't reset the connection before
+// the response is read
+class shed_session : public std::enable_shared_from_this<shed_session> {
+    boost::beast::tcp_stream stream_;
+    const std::string &response_;
+    std::array<char, 512> drain_;
+
+    static constexpr std::chrono::seconds kLinger{2};
+
+  public:
+    shed_session(tcp::socket &&s, const std::string &response)
+        : stream_(std::move(s)), response_(response) {}
+
+    void run() {
+        stream_.expires_after(kLinger);
+        boost::asio::async_write(
+            stream_, boost::asio::buffer(response_),
+            [self = shared_from_this()](boost::beast::error_code ec,
+                                        std::size_t bytes) {
+                metrics::http_bytes_out.add(bytes);
+                if (ec)
+                    return;
                 boost::beast::error_code ec_shutdown;
-                self->socket_.shutdown(tcp::socket::shutdown_send, ec_shutdown);
-                if (ec_shutdown) {
-                    std::cout
-                        << "[http_session::write_response] shutdown error: "
-                        << ec_shutdown.message() << "\n";
-                } else {
-                    std::cout << "[http_session::write_response] Connection "
-                                 "shutdown cleanly\n";
-                }
+                self->stream_.socket().shutdown(tcp::socket::shutdown_send,
+                                                ec_shutdown);
+                self->do_drain();
+            });
+    }
+
+  private:
+    // Until the client closes its side or the linger timer runs out
+    void do_drain() {
+        stream_.async_read_some(
+            boost::asio::buffer(drain_),
+            [self = shared_from_this()](boost::beast::error_code ec,
+                                        std::size_t) {
+                if (!ec)
+                    self->do_drain();
             });
     }
 };
@@ -463,82 +665,441 @@ class listener : public std::enable_shared_from_this<listener> {
     boost::asio::io_context &ioc_;
     tcp::acceptor acceptor_;
     TrackerState &state_;
+    const ServerOptions &opts_;
+    AdmissionControl &admission_;
+    const IntervalPolicy &intervals_;
+    cluster_node *cluster_;
 
   public:
-    listener(boost::asio::io_context &ioc, tcp::endpoint ep, TrackerState &st)
-        : ioc_(ioc), acceptor_(ioc), state_(st) {
-        std::cout << "[listener] Constructing listener on " << ep << "\n";
+    listener(boost::asio::io_context &ioc, tcp::endpoint ep, TrackerState &st,
+             const ServerOptions &opts, AdmissionControl &admission,
+             const IntervalPolicy &intervals, cluster_node *cluster)
+        : ioc_(ioc), acceptor_(ioc), state_(st), opts_(opts),
+          admission_(admission), intervals_(intervals), cluster_(cluster) {
+        TLOG(info) << "[listener] Constructing listener on " << ep;
 
         boost::beast::error_code ec;
         acceptor_.open(ep.protocol(), ec);
         if (ec)
             throw boost::system::system_error(ec);
-        std::cout << "[listener] Acceptor opened\n";
+        TLOG(info) << "[listener] Acceptor opened";
 
         // We want to be able to reuse the socket
         acceptor_.set_option(boost::asio::socket_base::reuse_address(true), ec);
         if (ec)
             throw boost::system::system_error(ec);
-        std::cout << "[listener] Reuse address enabled\n";
+        TLOG(info) << "[listener] Reuse address enabled";
+
+        // Several acceptors on one port, the kernel picks one per connection
+        if (opts_.reuse_port) {
+#ifdef SO_REUSEPORT
+            using reuse_port = boost::asio::detail::socket_option::boolean<
+                SOL_SOCKET, SO_REUSEPORT>;
+            acceptor_.set_option(reuse_port(true), ec);
+            if (ec)
+                throw boost::system::system_error(ec);
+            TLOG(info) << "[listener] Reuse port enabled";
+#else
+            throw std::runtime_error("SO_REUSEPORT is not supported here");
+#endif
+        }
 
         // Bind the acceptor to the endpoint on the machine
         acceptor_.bind(ep, ec);
         if (ec)
             throw boost::system::system_error(ec);
-        std::cout << "[listener] Acceptor bound to endpoint\n";
+        TLOG(info) << "[listener] Acceptor bound to endpoint";
 
         // Start listening on that port
         acceptor_.listen(boost::asio::socket_base::max_listen_connections, ec);
         if (ec)
             throw boost::system::system_error(ec);
-        std::cout << "[listener] Acceptor listening\n";
+        TLOG(info) << "[listener] Acceptor listening";
     }
 
     // Wrapper to do_accept, which starts the listener
     void run() {
-        std::cout << "[listener::run] Starting accept loop\n";
+        TLOG(info) << "[listener::run] Starting accept loop";
         do_accept();
     }
 
   private:
     void do_accept() {
-        std::cout << "[listener::do_accept] Waiting for new connection...\n";
+        TLOG(trace) << "[listener::do_accept] Waiting for new connection...";
+        // Each connection gets its own strand so its handlers never run
+        // concurrently, whichever pool thread picks them up
         acceptor_.async_accept(
+            boost::asio::make_strand(ioc_),
             [self = shared_from_this()](boost::system::error_code ec,
-                                        tcp::socket s) {
+                                        session_socket s) {
                 if (!ec) {
-                    auto e = s.remote_endpoint();
-                    std::cout
-                        << "[listener::do_accept] Connection request from: "
-                        << e.address() << ":" << e.port() << std::endl;
-                    std::make_shared<http_session>(std::move(s), self->state_)
-                        ->run();
+                    self->on_accept(std::move(s));
                 } else {
-                    std::cout
+                    TLOG(error)
                         << "[listener::do_accept] Error accepting connection: "
-                        << ec.message() << " (" << ec.value() << ")\n";
+                        << ec.message() << " (" << ec.value() << ")";
                 }
                 self->do_accept(); // keep accepting
             });
     }
+
+    void on_accept(session_socket s) {
+        boost::system::error_code ep_ec;
+        auto remote = s.remote_endpoint(ep_ec);
+        if (ep_ec) {
+            // Already gone, nothing to serve
+            TLOG(debug) << "[listener::on_accept] Error getting "
+                           "remote_endpoint: "
+                        << ep_ec.message();
+            return;
+        }
+        TLOG(trace) << "[listener::on_accept] Connection request from: "
+                    << remote;
+
+        switch (admission_.admit_connection(remote.address())) {
+        case AdmissionControl::Verdict::admit:
+            std::allocate_shared<http_session>(
+                recycling_allocator<http_session>{}, std::move(s), remote,
+                state_, opts_, admission_, intervals_, cluster_)
+                ->run();
+            return;
+        case AdmissionControl::Verdict::overloaded:
+            metrics::shed_overloaded.add();
+            std::make_shared<shed_session>(std::move(s),
+                                           admission_.overloaded_response())
+                ->run();
+            return;
+        case AdmissionControl::Verdict::rate_limited:
+            TLOG(debug) << "[listener::on_accept] Rate limiting " << remote;
+            metrics::shed_rate_limited.add();
+            std::make_shared<shed_session>(std::move(s),
+                                           admission_.rate_limited_response())
+                ->run();
+            return;
+        }
+    }
 };
 
+// Expire stale peers once per expiry tick. Each run only drains the buckets
+// that just came due, so this stays cheap however many peers are tracked
+static void schedule_expiry(boost::asio::steady_timer &timer,
+                            TrackerState &state, AdmissionControl &admission,
+                            cluster_node *cluster) {
+    timer.expires_after(TrackerState::expiry_resolution);
+    timer.async_wait([&timer, &state, &admission,
+                      cluster](boost::system::error_code ec) {
+        if (ec)
+            return;
+        const auto start = steady_clock::now();
+        std::size_t expired = state.gc();
+        metrics::observe_gc(steady_clock::now() - start, expired);
+        admission.sweep();
+        if (cluster)
+            cluster->sweep();
+        schedule_expiry(timer, state, admission, cluster);
+    });
+}
+
+// Measure how late a short timer fires. With every io thread busy the
+// handler waits in the queue behind the backlog, so the delay is how far
+// behind the tracker is. Overload mode starts when it passes max_lag and
+// only ends after a few consecutive on-time ticks, so it doesn't flap
+static void schedule_lag_probe(boost::asio::steady_timer &timer,
+                               AdmissionControl &admission,
+                               std::chrono::milliseconds max_lag,
+                               unsigned on_time) {
+    static constexpr std::chrono::milliseconds kProbeInterval{50};
+    static constexpr unsigned kOnTimeToRecover = 20; // one second
+
+    timer.expires_after(kProbeInterval);
+    timer.async_wait([&timer, &admission, max_lag,
+                      on_time](boost::system::error_code ec) {
+        if (ec)
+            return;
+        const auto lag = steady_clock::now() - timer.expiry();
+        unsigned streak = on_time;
+        if (lag > max_lag) {
+            TLOG(debug) << "[run_server] Lag probe fired "
+                        << std::chrono::duration_cast<
+                               std::chrono::milliseconds>(lag)
+                               .count()
+                        << "ms late";
+            admission.set_lagging(true);
+            streak = 0;
+        } else if (++streak >= kOnTimeToRecover) {
+            admission.set_lagging(false);
+        }
+        schedule_lag_probe(timer, admission, max_lag, streak);
+    });
+}
+
+// Steer the announce interval from the last second's announce count
+static void schedule_interval_update(boost::asio::steady_timer &timer,
+                                     TrackerState &state,
+                                     IntervalPolicy &intervals) {
+    timer.expires_after(std::chrono::seconds{1});
+    timer.async_wait([&timer, &state,
+                      &intervals](boost::system::error_code ec) {
+        if (ec)
+            return;
+        intervals.update(state.stats().announces, steady_clock::now());
+        schedule_interval_update(timer, state, intervals);
+    });
+}
+
+// Log one status line per interval: swarm/peer totals plus what happened
+// since the last line. This is all the default log level shows
+static void schedule_summary(boost::asio::steady_timer &timer,
+                             TrackerState &state,
+                             std::chrono::seconds interval,
+                             TrackerState::Stats &last) {
+    timer.expires_after(interval);
+    timer.async_wait([&timer, &state, interval,
+                      &last](boost::system::error_code ec) {
+        if (ec)
+            return;
+        TrackerState::Stats now = state.stats();
+        const uint64_t announces = now.announces - last.announces;
+        // To a tenth, so a trickle of announces doesn't show as 0/s
+        const double rate =
+            std::round(10.0 * announces / interval.count()) / 10;
+        TLOG(summary) << "[run_server] swarms=" << now.swarms
+                      << " peers=" << now.peers << " announces=+"
+                      << announces << " (" << rate
+                      << "/s) expired=+" << (now.expired - last.expired)
+                      << " evicted=+" << (now.evicted - last.evicted)
+                      << " refused=+" << (now.refused - last.refused)
+                      << " memory=" << (now.memory.total() >> 20) << "MB"
+                      << " log_dropped=" << tlog::dropped();
+        last = now;
+        schedule_summary(timer, state, interval, last);
+    });
+}
+
+ServerOptions parse_server_options(int argc, char **argv) {
+    ServerOptions opts;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto next = [&]() -> std::string {
+            if (i + 1 >= argc)
+                throw std::invalid_argument("missing value for " + arg);
+            return argv[++i];
+        };
+
+        if (arg == "--threads") {
+            opts.threads = static_cast<unsigned>(std::stoul(next()));
+        } else if (arg == "--reuseport") {
+            opts.reuse_port = true;
+        } else if (arg == "--shards") {
+            opts.shards = std::stoul(next());
+        } else if (arg == "--ttl") {
+            opts.ttl = std::chrono::seconds{std::stol(next())};
+        } else if (arg == "--udp-port") {
+            opts.udp_port = std::stoi(next());
+        } else if (arg == "--log-level") {
+            std::string name = next();
+            if (!tlog::parse_level(name, opts.log_level))
+                throw std::invalid_argument("unknown log level " + name);
+        } else if (arg == "--summary-interval") {
+            opts.summary_interval = std::chrono::seconds{std::stol(next())};
+        } else if (arg == "--snapshot") {
+            opts.snapshot_path = next();
+        } else if (arg == "--snapshot-interval") {
+            opts.snapshot_interval = std::chrono::seconds{std::stol(next())};
+        } else if (arg == "--idle-timeout") {
+            opts.idle_timeout = std::chrono::seconds{std::stol(next())};
+        } else if (arg == "--conn-rate") {
+            opts.conn_rate = std::stod(next());
+        } else if (arg == "--announce-rate") {
+            opts.announce_rate = std::stod(next());
+        } else if (arg == "--max-connections") {
+            opts.max_connections = std::stoul(next());
+        } else if (arg == "--max-lag-ms") {
+            opts.max_lag = std::chrono::milliseconds{std::stol(next())};
+        } else if (arg == "--interval") {
+            opts.interval = std::chrono::seconds{std::stol(next())};
+        } else if (arg == "--max-interval") {
+            opts.max_interval = std::chrono::seconds{std::stol(next())};
+        } else if (arg == "--target-announce-rate") {
+            opts.target_announce_rate = std::stod(next());
+        } else if (arg == "--cluster") {
+            opts.cluster_nodes = next();
+        } else if (arg == "--node-id") {
+            opts.node_id = std::stoul(next());
+        } else if (arg == "--replicas") {
+            opts.replicas = std::stoul(next());
+        } else if (arg == "--locality") {
+            opts.locality = true;
+        } else if (arg == "--site-map") {
+            opts.site_map = next();
+            opts.locality = true;
+        } else if (arg == "--max-swarms") {
+            opts.max_swarms = std::stoul(next());
+        } else if (arg == "--max-swarm-peers") {
+            opts.max_swarm_peers = std::stoul(next());
+        } else if (arg == "--max-memory-mb") {
+            opts.max_memory_mb = std::stoul(next());
+        } else if (arg == "--overload-interval") {
+            opts.overload_interval = std::chrono::seconds{std::stol(next())};
+        } else {
+            // First positional argument is the port, like it always was
+            opts.port = static_cast<uint16_t>(std::stoi(arg));
+        }
+    }
+
+    // A negative ttl would wrap around into a huge expiry wheel
+    if (opts.ttl.count() <= 0)
+        throw std::invalid_argument("--ttl must be positive");
+    // IntervalPolicy scales and divides by the base interval
+    if (opts.interval.count() <= 0)
+        throw std::invalid_argument("--interval must be positive");
+    // Every keep-alive connection would be closed as soon as it went idle
+    if (opts.idle_timeout.count() <= 0)
+        throw std::invalid_argument("--idle-timeout must be positive");
+    if (opts.max_interval < opts.interval)
+        throw std::invalid_argument(
+            "--max-interval must be at least --interval");
+    // Snapshots would run back to back, each locking every shard
+    if (opts.snapshot_interval.count() <= 0)
+        throw std::invalid_argument("--snapshot-interval must be positive");
+    if (opts.udp_port < 0)
+        opts.udp_port = opts.port;
+    if (opts.threads == 0)
+        opts.threads = std::max(1u, std::thread::hardware_concurrency());
+    if (opts.shards == 0)
+        opts.shards = opts.threads * 4;
+    return opts;
+}
+
+void run_server(const ServerOptions &opts) {
+    tlog::set_level(opts.log_level);
+    tlog::start();
+
+    TLOG(summary) << "[run_server] Starting tracker on port " << opts.port
+                  << " with " << opts.threads << " thread(s) and "
+                  << opts.shards << " shard(s)";
+
+    // With --reuseport every thread runs its own io_context with its own
+    // acceptor, so accepting and serving a connection never leaves the core
+    // the kernel handed it to. The UDP endpoints, the cluster and the timers
+    // stay on the first context, so the lag probe then samples that
+    // thread's backlog as a stand-in for the others
+    const unsigned contexts = opts.reuse_port ? opts.threads : 1;
+    std::vector<std::unique_ptr<boost::asio::io_context>> iocs;
+    for (unsigned i = 0; i < contexts; ++i) {
+        iocs.push_back(std::make_unique<boost::asio::io_context>(
+            opts.reuse_port ? 1 : static_cast<int>(opts.threads)));
+    }
+    boost::asio::io_context &ioc = *iocs.front();
+    TrackerState state{opts.shards, opts.ttl};
+    if (opts.locality) {
+        SiteMap sites;
+        if (!opts.site_map.empty())
+            sites = SiteMap::load(opts.site_map);
+        TLOG(summary) << "[run_server] Locality mode on, " << sites.sites()
+                      << " site(s) with " << sites.prefixes()
+                      << " prefix(es)";
+        state.set_locality(std::move(sites));
+    }
+    if (opts.max_swarms || opts.max_swarm_peers || opts.max_memory_mb) {
+        state.set_limits({opts.max_swarms, opts.max_swarm_peers,
+                          opts.max_memory_mb << 20});
+        TLOG(summary) << "[run_server] Capped at " << opts.max_swarms
+                      << " swarm(s), " << opts.max_swarm_peers
+                      << " peer(s) per swarm and " << opts.max_memory_mb
+                      << " MB (0: no cap)";
+    }
+
+    // Restore before accepting anything, so the first announces after a
+    // restart already get full peer lists
+    std::optional<snapshotter> snapshots;
+    if (!opts.snapshot_path.empty()) {
+        load_snapshot(state, opts.snapshot_path);
+        snapshots.emplace(state, opts.snapshot_path, opts.snapshot_interval);
+        snapshots->start();
+    }
+
+    AdmissionControl admission{{opts.conn_rate, opts.announce_rate,
+                                opts.max_connections,
+                                opts.overload_interval}};
+
+    IntervalPolicy intervals{
+        {opts.interval, opts.max_interval, opts.target_announce_rate}};
+
+    std::shared_ptr<cluster_node> cluster;
+    if (!opts.cluster_nodes.empty()) {
+        cluster = std::make_shared<cluster_node>(
+            ioc, parse_cluster_nodes(opts.cluster_nodes), opts.node_id,
+            opts.replicas, state, opts.ttl);
+        cluster->run();
+        TLOG(summary) << "[run_server] Cluster node " << opts.node_id
+                      << " gossiping with " << opts.cluster_nodes;
+    }
+
+    for (auto &ctx : iocs) {
+        std::make_shared<listener>(*ctx, tcp::endpoint(tcp::v4(), opts.port),
+                                   state, opts, admission, intervals,
+                                   cluster.get())
+            ->run();
+    }
+
+    if (opts.udp_port > 0) {
+        auto udp_srv = std::make_shared<udp_tracker>(
+            ioc,
+            udp_tracker::udp::endpoint(boost::asio::ip::udp::v4(),
+                                       static_cast<uint16_t>(opts.udp_port)),
+            state, admission, intervals, cluster.get());
+        udp_srv->run();
+        TLOG(summary) << "[run_server] UDP tracker listening on udp://0.0.0.0:"
+                      << opts.udp_port;
+    }
+
+    boost::asio::steady_timer expiry_timer{ioc};
+    schedule_expiry(expiry_timer, state, admission, cluster.get());
+    boost::asio::steady_timer interval_timer{ioc};
+    schedule_interval_update(interval_timer, state, intervals);
+    boost::asio::steady_timer lag_timer{ioc};
+    if (opts.max_lag.count() > 0)
+        schedule_lag_probe(lag_timer, admission, opts.max_lag, 0);
+    boost::asio::steady_timer summary_timer{ioc};
+    TrackerState::Stats last_stats = state.stats();
+    if (opts.summary_interval.count() > 0)
+        schedule_summary(summary_timer, state, opts.summary_interval,
+                         last_stats);
+    TLOG(summary) << "[run_server] Tracker listening on http://0.0.0.0:"
+                  << opts.port << " with " << contexts << " acceptor(s)";
+
+    // Stop cleanly on SIGINT/SIGTERM so a deploy gets a final snapshot
+    boost::asio::signal_set signals{ioc, SIGINT, SIGTERM};
+    signals.async_wait([&iocs](boost::system::error_code ec, int sig) {
+        if (ec)
+            return;
+        TLOG(summary) << "[run_server] Caught signal " << sig
+                      << ", shutting down";
+        for (auto &ctx : iocs)
+            ctx->stop();
+    });
+
+    // The calling thread is part of the pool too
+    std::vector<std::thread> pool;
+    pool.reserve(opts.threads - 1);
+    for (unsigned i = 1; i < opts.threads; ++i) {
+        auto &ctx = *iocs[i % contexts];
+        pool.emplace_back([&ctx] { ctx.run(); });
+    }
+    ioc.run();
+    for (auto &t : pool) {
+        t.join();
+    }
+    TLOG(summary) << "[run_server] io_context.run() returned, shutting down";
+    if (snapshots)
+        snapshots->stop();
+    tlog::stop();
+}
+
 void run_server(int argc, char **argv) {
     try {
-        const uint16_t port =
-            (argc > 1) ? static_cast<uint16_t>(std::stoi(argv[1])) : 8080;
-
-        std::cout << "[run_server] Starting tracker on port " << port << "\n";
-
-        boost::asio::io_context ioc;
-        TrackerState state;
-        auto srv = std::make_shared<listener>(
-            ioc, tcp::endpoint(tcp::v4(), port), state);
-        srv->run();
-        std::cout << "[run_server] Tracker listening on http://0.0.0.0:" << port
-                  << "\n";
-        ioc.run();
-        std::cout << "[run_server] io_context.run() returned, shutting down\n";
+        run_server(parse_server_options(argc, argv));
     } catch (std::exception &e) {
         std::cerr << "[run_server] Fatal: " << e.what() << std::endl;
     }
@@ -1,4 +1,48 @@
 #pragma once
+#include "log.hpp"
 #include <boost/asio.hpp>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
 
+struct ServerOptions {
+    uint16_t port = 8080;
+    int udp_port = -1;      // UDP announce port, -1: same as port, 0: off
+    unsigned threads = 0;   // io_context threads, 0: one per core
+    bool reuse_port = false; // One SO_REUSEPORT acceptor per thread
+    std::size_t shards = 0; // TrackerState shards, 0: four per thread
+    std::chrono::seconds ttl{120}; // How long a peer lives without announcing
+    std::chrono::seconds idle_timeout{15}; // Keep-alive connection idle limit
+    LogLevel log_level = LogLevel::error;
+    std::chrono::seconds summary_interval{60}; // 0: no periodic summaries
+    std::string snapshot_path; // Empty: no snapshots, start empty
+    std::chrono::seconds snapshot_interval{30};
+    // Re-announce interval (see IntervalPolicy)
+    std::chrono::seconds interval{60};      // At light load, small swarms
+    std::chrono::seconds max_interval{1800};
+    double target_announce_rate = 10000; // Per second, 0: ignore load
+    // Clustered mode (see cluster_node): every node's gossip endpoint,
+    // "host:port,...", and which of them this node is. Empty: standalone
+    std::string cluster_nodes;
+    std::size_t node_id = 0;
+    std::size_t replicas = 2; // Nodes holding each swarm
+    // Admission control (see AdmissionControl), 0 turns each limit off
+    double conn_rate = 0;     // New connections per IP per second
+    double announce_rate = 0; // Announces per IP per second
+    std::size_t max_connections = 0;
+    std::chrono::milliseconds max_lag{100}; // How late timers may fire
+    std::chrono::seconds overload_interval{600}; // Retry hint when shedding
+    // Locality mode: peer lists favour peers near the announcer (see
+    // TrackerState::set_locality). A site map turns it on too
+    bool locality = false;
+    std::string site_map; // "<prefix> <site>" lines, empty: subnets only
+    // Memory caps (see TrackerState::Limits), 0 turns each one off
+    std::size_t max_swarms = 0;
+    std::size_t max_swarm_peers = 0;
+    std::size_t max_memory_mb = 0;
+};
+
+ServerOptions parse_server_options(int, char **);
+void run_server(const ServerOptions &);
 void run_server(int, char **);
@@ -0,0 +1,96 @@
+#include "snapshot.hpp"
+#include "log.hpp"
+#include <cstdio>
+#include <unistd.h>
+
+bool save_snapshot(TrackerState &state, const std::string &path) {
+    const auto start = steady_clock::now();
+    std::string buf;
+    state.write_snapshot(buf);
+
+    const std::string tmp = path + ".tmp";
+    std::FILE *f = std::fopen(tmp.c_str(), "wb");
+    if (!f) {
+        TLOG(error) << "[save_snapshot] Cannot open " << tmp;
+        return false;
+    }
+    // On disk before the rename, or a crash could leave the snapshot empty
+    bool ok = std::fwrite(buf.data(), 1, buf.size(), f) == buf.size();
+    ok = ok && std::fflush(f) == 0 && ::fsync(fileno(f)) == 0;
+    ok = std::fclose(f) == 0 && ok;
+    if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0) {
+        TLOG(error) << "[save_snapshot] Failed to write " << path;
+        std::remove(tmp.c_str());
+        return false;
+    }
+
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        steady_clock::now() - start);
+    TLOG(info) << "[save_snapshot] Wrote " << buf.size() << " bytes to "
+               << path << " in " << ms.count() << " ms";
+    return true;
+}
+
+std::size_t load_snapshot(TrackerState &state, const std::string &path) {
+    std::FILE *f = std::fopen(path.c_str(), "rb");
+    if (!f) {
+        TLOG(info) << "[load_snapshot] No snapshot at " << path
+                   << ", starting empty";
+        return 0;
+    }
+
+    const auto start = steady_clock::now();
+    std::string buf;
+    char chunk[1 << 16];
+    std::size_t n;
+    while ((n = std::fread(chunk, 1, sizeof(chunk), f)) > 0)
+        buf.append(chunk, n);
+    const bool read_error = std::ferror(f) != 0;
+    std::fclose(f);
+    if (read_error) {
+        TLOG(error) << "[load_snapshot] Failed to read " << path;
+        return 0;
+    }
+
+    std::size_t restored = state.restore_snapshot(buf);
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        steady_clock::now() - start);
+    TLOG(summary) << "[load_snapshot] Restored " << restored
+                  << " peer(s) from " << path << " in " << ms.count()
+                  << " ms";
+    return restored;
+}
+
+snapshotter::snapshotter(TrackerState &state, std::string path,
+                         std::chrono::seconds interval)
+    : state_(state), path_(std::move(path)), interval_(interval) {}
+
+snapshotter::~snapshotter() { stop(); }
+
+void snapshotter::start() {
+    if (thread_.joinable())
+        return;
+    thread_ = std::thread([this] { run(); });
+}
+
+void snapshotter::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (stopping_)
+            return;
+        stopping_ = true;
+    }
+    cv_.notify_one();
+    if (thread_.joinable())
+        thread_.join();
+    save_snapshot(state_, path_);
+}
+
+void snapshotter::run() {
+    std::unique_lock<std::mutex> lock(mtx_);
+    while (!cv_.wait_for(lock, interval_, [this] { return stopping_; })) {
+        lock.unlock();
+        save_snapshot(state_, path_);
+        lock.lock();
+    }
+}
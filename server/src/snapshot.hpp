@@ -0,0 +1,40 @@
+#pragma once
+#include "tracker_state.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/// Write a snapshot of `state` to `path`. The file is written next to `path`
+/// and renamed over it, so a crash mid-write never leaves a torn snapshot
+bool save_snapshot(TrackerState &state, const std::string &path);
+
+/// Restore `state` from the snapshot at `path`, if there is one. Returns how
+/// many peers were restored
+std::size_t load_snapshot(TrackerState &state, const std::string &path);
+
+/// Saves a snapshot every `interval` from its own thread, so neither the
+/// encoding nor the disk write ever runs on an io_context thread. stop()
+/// takes one last snapshot before returning
+class snapshotter {
+  public:
+    snapshotter(TrackerState &state, std::string path,
+                std::chrono::seconds interval);
+    ~snapshotter();
+
+    void start();
+    void stop();
+
+  private:
+    void run();
+
+    TrackerState &state_;
+    const std::string path_;
+    const std::chrono::seconds interval_;
+
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    bool stopping_ = false;
+    std::thread thread_;
+};
@@ -0,0 +1,1097 @@
+#include "tracker_state.hpp"
+#include "hashing.hpp"
+#include "locality.hpp"
+#include "log.hpp"
+#include <algorithm>
+#include <cstring>
+#include <optional>
+#include <random>
+#include <thread>
+
+std::string to_hex(std::string_view data) {
+    static const char *hex = "0123456789ABCDEF";
+    std::string out;
+    out.reserve(data.size() * 2);
+
+    for (unsigned char c : data) {
+        out.push_back(hex[c >> 4]);
+        out.push_back(hex[c & 0xF]);
+    }
+    return out;
+}
+
+namespace {
+
+uint64_t load_u64(const void *p) {
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+constexpr unsigned char kV4MappedPrefix[12] = {0, 0, 0, 0, 0,    0,
+                                               0, 0, 0, 0, 0xff, 0xff};
+
+} // namespace
+
+InfohashKey::InfohashKey(std::string_view infohash)
+    : len(static_cast<uint8_t>(std::min(infohash.size(), bytes.size()))) {
+    std::memcpy(bytes.data(), infohash.data(), len);
+}
+
+// Infohashes are already uniformly distributed; folding the words is enough
+std::size_t InfohashKeyHash::operator()(const InfohashKey &k) const noexcept {
+    const char *p = k.bytes.data();
+    return mix64(load_u64(p) ^ load_u64(p + 8) ^ load_u64(p + 16) ^
+                 load_u64(p + 24) ^ k.len);
+}
+
+PeerEndpoint::PeerEndpoint(const boost::asio::ip::address &addr,
+                           uint16_t port) {
+    if (addr.is_v4()) {
+        std::memcpy(bytes.data(), kV4MappedPrefix, sizeof(kV4MappedPrefix));
+        auto b = addr.to_v4().to_bytes();
+        std::memcpy(bytes.data() + 12, b.data(), b.size());
+    } else {
+        auto b = addr.to_v6().to_bytes();
+        std::memcpy(bytes.data(), b.data(), b.size());
+    }
+    bytes[16] = static_cast<unsigned char>(port >> 8);
+    bytes[17] = static_cast<unsigned char>(port & 0xFF);
+}
+
+bool PeerEndpoint::is_v4() const {
+    return std::memcmp(bytes.data(), kV4MappedPrefix,
+                       sizeof(kV4MappedPrefix)) == 0;
+}
+
+boost::asio::ip::address PeerEndpoint::addr() const {
+    if (is_v4()) {
+        boost::asio::ip::address_v4::bytes_type b;
+        std::memcpy(b.data(), bytes.data() + 12, b.size());
+        return boost::asio::ip::address_v4(b);
+    }
+    boost::asio::ip::address_v6::bytes_type b;
+    std::memcpy(b.data(), bytes.data(), b.size());
+    return boost::asio::ip::address_v6(b);
+}
+
+PeerId::PeerId(std::string_view id)
+    : len(static_cast<uint8_t>(std::min(id.size(), bytes.size()))) {
+    std::memcpy(bytes.data(), id.data(), len);
+}
+
+namespace {
+
+// Seed for a thread's peer sampling stream
+uint64_t &random_state() {
+    thread_local uint64_t state =
+        (uint64_t(std::random_device{}()) << 32) ^ std::random_device{}();
+    return state;
+}
+
+// splitmix64, on a copy of the state the caller keeps in a register
+uint64_t next_random(uint64_t &state) {
+    state += 0x9e3779b97f4a7c15ULL;
+    return mix64(state);
+}
+
+// Uniform in [0, bound) from the high half of a random word, without a
+// division (Lemire)
+uint32_t below(uint64_t random, uint32_t bound) {
+    return static_cast<uint32_t>(((random >> 32) * bound) >> 32);
+}
+
+uint64_t peer_hash(const PeerEndpoint &ep, const PeerId &id) {
+    const unsigned char *e = ep.bytes.data();
+    const char *p = id.bytes.data();
+    uint64_t tail = 0;
+    std::memcpy(&tail, p + 16, 4);
+    return mix64(load_u64(e) ^ mix64(load_u64(e + 8) ^ e[16] << 8 ^ e[17]) ^
+                 load_u64(p) ^ mix64(load_u64(p + 8) ^ tail << 8 ^ id.len));
+}
+
+} // namespace
+
+uint64_t Swarm::hash_of(std::size_t slot) const {
+    return peer_hash(endpoints[slot], ids[slot]);
+}
+
+std::size_t Swarm::find(const PeerEndpoint &ep, const PeerId &id) const {
+    if (index.empty())
+        return npos;
+    const std::size_t mask = index.size() - 1;
+    for (std::size_t i = peer_hash(ep, id) & mask;; i = (i + 1) & mask) {
+        const uint32_t v = index[i];
+        if (v == 0)
+            return npos;
+        if (endpoints[v - 1] == ep && ids[v - 1] == id)
+            return v - 1;
+    }
+}
+
+/// Where the index holds `slot`; it must be there
+std::size_t Swarm::position_of(std::size_t slot) const {
+    const std::size_t mask = index.size() - 1;
+    std::size_t i = hash_of(slot) & mask;
+    while (index[i] != slot + 1)
+        i = (i + 1) & mask;
+    return i;
+}
+
+void Swarm::place(std::size_t slot) {
+    const std::size_t mask = index.size() - 1;
+    std::size_t i = hash_of(slot) & mask;
+    while (index[i] != 0)
+        i = (i + 1) & mask;
+    index[i] = static_cast<uint32_t>(slot + 1);
+}
+
+void Swarm::rehash(std::size_t buckets) {
+    index.assign(buckets, 0);
+    for (std::size_t slot = 0; slot < size(); ++slot)
+        place(slot);
+}
+
+// Linear probing stays fast up to a load of 3/4
+void Swarm::reserve(std::size_t peers) {
+    endpoints.reserve(peers);
+    ids.reserve(peers);
+    last_seen.reserve(peers);
+    seeder.reserve(peers);
+    std::size_t buckets = index.empty() ? 8 : index.size();
+    while (peers * 4 > buckets * 3)
+        buckets *= 2;
+    if (buckets != index.size())
+        rehash(buckets);
+}
+
+void Swarm::insert(const PeerEndpoint &ep, const PeerId &id, uint32_t tick,
+                   bool is_seeder) {
+    if (is_seeder)
+        ++seeders;
+    endpoints.push_back(ep);
+    ids.push_back(id);
+    last_seen.push_back(tick);
+    seeder.push_back(is_seeder);
+    if (size() * 4 > index.size() * 3)
+        rehash(index.empty() ? 8 : index.size() * 2);
+    else
+        place(size() - 1);
+    ++version;
+}
+
+// Once at most a quarter of the columns is in use, so a swarm that has
+// shrunk for good doesn't keep its peak footprint, and one that is just
+// churning doesn't reallocate every drain
+void Swarm::shrink() {
+    const std::size_t n = size();
+    if (endpoints.capacity() <= 16 || n * 4 > endpoints.capacity())
+        return;
+    endpoints.shrink_to_fit();
+    ids.shrink_to_fit();
+    last_seen.shrink_to_fit();
+    seeder.shrink_to_fit();
+    std::size_t buckets = 8;
+    while (n * 4 > buckets * 3)
+        buckets *= 2;
+    if (buckets < index.size()) {
+        std::vector<uint32_t>().swap(index);
+        rehash(buckets);
+    }
+}
+
+Swarm::Footprint Swarm::footprint() const {
+    Footprint f;
+    f.peers = endpoints.capacity() * sizeof(PeerEndpoint) +
+              ids.capacity() * sizeof(PeerId) +
+              last_seen.capacity() * sizeof(uint32_t) +
+              seeder.capacity() * sizeof(uint8_t);
+    f.index = index.capacity() * sizeof(uint32_t);
+    f.caches = caches[0].memory() + caches[1].memory();
+    return f;
+}
+
+bool Swarm::erase(const PeerEndpoint &ep, const PeerId &id) {
+    const std::size_t slot = find(ep, id);
+    if (slot == npos)
+        return false;
+    erase_slot(slot);
+    return true;
+}
+
+/// Swap-and-pop: the last peer moves into `slot`, so only its index entry
+/// needs fixing up. The victim's entry is removed by shifting later entries
+/// of its probe run back, which keeps lookups free of tombstones
+void Swarm::erase_slot(std::size_t slot) {
+    if (seeder[slot])
+        --seeders;
+
+    const std::size_t mask = index.size() - 1;
+    std::size_t hole = position_of(slot);
+    for (std::size_t j = (hole + 1) & mask; index[j] != 0; j = (j + 1) & mask) {
+        // The entry at j may fill the hole unless its home lies in (hole, j]
+        const std::size_t home = hash_of(index[j] - 1) & mask;
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            index[hole] = index[j];
+            hole = j;
+        }
+    }
+    index[hole] = 0;
+
+    const std::size_t last = size() - 1;
+    if (slot != last) {
+        index[position_of(last)] = static_cast<uint32_t>(slot + 1);
+        endpoints[slot] = endpoints[last];
+        ids[slot] = ids[last];
+        last_seen[slot] = last_seen[last];
+        seeder[slot] = seeder[last];
+    }
+    endpoints.pop_back();
+    ids.pop_back();
+    last_seen.pop_back();
+    seeder.pop_back();
+    ++version;
+}
+
+namespace {
+
+// Chao's algorithm: the first `want` eligible peers fill the reservoir, and
+// after that a peer of weight w, with W the weight seen so far including
+// it, replaces a random pick with probability want * w / W. One random draw
+// per peer and nothing but integer arithmetic, so it stays close to the
+// cost of copying the first few peers. Branch-free past the fill, since the
+// seeder flags and the accept draws are coin flips to a branch predictor:
+// rejected peers land in the spare last entry
+struct Reservoir {
+    std::array<uint32_t, TrackerState::kMaxNumWant + 1> picks;
+    std::size_t want = 0;
+    std::size_t filled = 0;
+    uint32_t seen = 0; // W
+
+    void offer(uint32_t slot, uint32_t w, uint64_t &state) {
+        seen += w;
+        if (filled < want) {
+            if (w != 0)
+                picks[filled++] = slot;
+            return;
+        }
+        const uint64_t r = next_random(state);
+        const bool take = below(r, seen) < want * w;
+        picks[take ? below(r << 32, uint32_t(want)) : want] = slot;
+    }
+};
+
+} // namespace
+
+std::size_t Swarm::sample(std::size_t self, bool for_seeder, std::size_t want,
+                          uint32_t *out, const Nearness *near,
+                          PeerFamily family) const {
+    want = std::min(want, TrackerState::kMaxNumWant);
+    const std::size_t n = size();
+    if (want == 0 || n == 0)
+        return 0;
+
+    const uint32_t weights[2] = {1, for_seeder ? 0u : kSeederWeight};
+    // Indexed by is_v4()
+    const bool allowed[2] = {family != PeerFamily::v4,
+                             family != PeerFamily::v6};
+    const bool any_family = family == PeerFamily::any;
+    uint64_t state = random_state();
+    const std::size_t window = std::min(
+        n, std::max(near || !any_family ? kNearWindow : kSampleWindow,
+                    2 * want));
+    std::size_t slot = n > window ? below(next_random(state), uint32_t(n)) : 0;
+    auto next = [&] { slot = slot + 1 == n ? 0 : slot + 1; };
+    auto weight = [&] {
+        return weights[seeder[slot]] * (slot != self) *
+               (any_family || allowed[endpoints[slot].is_v4()]);
+    };
+
+    std::size_t count = 0;
+    if (!near) {
+        Reservoir r;
+        r.want = want;
+        for (std::size_t i = 0; i < window; ++i, next())
+            r.offer(static_cast<uint32_t>(slot), weight(), state);
+        count = r.filled;
+        std::copy(r.picks.begin(), r.picks.begin() + count, out);
+    } else {
+        // A reservoir per rank, drained nearest first, so far peers only
+        // make up what the near ones can't fill
+        Reservoir tiers[Nearness::kRanks];
+        for (Reservoir &r : tiers)
+            r.want = want;
+        for (std::size_t i = 0; i < window; ++i, next()) {
+            tiers[near->rank(endpoints[slot])].offer(
+                static_cast<uint32_t>(slot), weight(), state);
+        }
+        for (std::size_t t = Nearness::kRanks; t-- > 0 && count < want;) {
+            const std::size_t take = std::min(tiers[t].filled, want - count);
+            std::copy(tiers[t].picks.begin(), tiers[t].picks.begin() + take,
+                      out + count);
+            count += take;
+        }
+    }
+    random_state() = state;
+    return count;
+}
+
+// The wheel's epoch is put one ttl in the past so that peers restored from a
+// snapshot, which were last seen before this process started, still land on a
+// tick >= 0
+TrackerState::TrackerState(std::size_t shard_count, std::chrono::seconds ttl)
+    : ttl(ttl), shard_count_(std::max<std::size_t>(shard_count, 1)),
+      shards_(std::make_unique<Shard[]>(shard_count_)),
+      epoch_(steady_clock::now() - ttl - expiry_resolution),
+      ttl_ticks_((ttl + expiry_resolution - std::chrono::seconds{1}) /
+                 expiry_resolution) {
+    // A bucket comes due ttl_ticks_ + 1 ticks after it was filled, and is
+    // drained before the tick that would reuse it
+    for (std::size_t i = 0; i < shard_count_; ++i) {
+        shards_[i].wheel.resize(ttl_ticks_ + 2);
+    }
+}
+
+TrackerState::~TrackerState() = default;
+
+void TrackerState::set_locality(SiteMap sites) {
+    sites_ = std::make_unique<const SiteMap>(std::move(sites));
+}
+
+namespace {
+
+// A swarm map node: key and swarm, plus the node's next pointer and cached
+// hash
+constexpr std::size_t kSwarmNodeBytes =
+    sizeof(std::pair<const InfohashKey, Swarm>) + 2 * sizeof(void *);
+
+// What one more peer costs: its column entries and, at the index's lowest
+// load of 3/8, about three index entries
+constexpr std::size_t kPeerBytes = sizeof(PeerEndpoint) + sizeof(PeerId) +
+                                   sizeof(uint32_t) + sizeof(uint8_t) +
+                                   3 * sizeof(uint32_t);
+
+// Every cap but the per-swarm one is split evenly over the shards, rounded
+// up so no shard is left without room
+std::size_t per_shard(std::size_t total, std::size_t shards) {
+    return total == 0 ? 0 : (total + shards - 1) / shards;
+}
+
+} // namespace
+
+void TrackerState::set_limits(const Limits &limits) {
+    shard_limits_.swarms = per_shard(limits.swarms, shard_count_);
+    shard_limits_.peers_per_swarm = limits.peers_per_swarm;
+    shard_limits_.bytes = per_shard(limits.bytes, shard_count_);
+}
+
+std::size_t TrackerState::charged_bytes(const Shard &shard) const {
+    return shard.bytes.total() + shard.swarms.size() * kSwarmNodeBytes +
+           shard.swarms.bucket_count() * sizeof(void *);
+}
+
+void TrackerState::recharge(Shard &shard, const Swarm::Footprint &before,
+                            const Swarm &swarm) {
+    const Swarm::Footprint after = swarm.footprint();
+    shard.bytes.peers += after.peers - before.peers;
+    shard.bytes.index += after.index - before.index;
+    shard.bytes.caches += after.caches - before.caches;
+}
+
+void TrackerState::drop_swarm(Shard &shard, SwarmMap::iterator it) {
+    const Swarm::Footprint f = it->second.footprint();
+    shard.bytes.peers -= f.peers;
+    shard.bytes.index -= f.index;
+    shard.bytes.caches -= f.caches;
+    shard.peer_count -= it->second.size();
+    shard.swarms.erase(it);
+}
+
+Swarm *TrackerState::admit_swarm(Shard &shard, const InfohashKey &key,
+                                 uint64_t now_tick) {
+    auto it = shard.swarms.find(key);
+    if (it != shard.swarms.end())
+        return &it->second;
+
+    const Limits &cap = shard_limits_;
+    while ((cap.swarms != 0 && shard.swarms.size() >= cap.swarms) ||
+           (cap.bytes != 0 &&
+            charged_bytes(shard) + kSwarmNodeBytes > cap.bytes)) {
+        if (!evict_swarm(shard, nullptr, now_tick)) {
+            refused_.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+    }
+    Swarm &swarm = shard.swarms[key];
+    recharge(shard, {}, swarm);
+    return &swarm;
+}
+
+bool TrackerState::admit_peer(Shard &shard, const Swarm &swarm,
+                              uint64_t now_tick) {
+    const Limits &cap = shard_limits_;
+    if (cap.peers_per_swarm != 0 && swarm.size() >= cap.peers_per_swarm) {
+        refused_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    while (cap.bytes != 0 && charged_bytes(shard) + kPeerBytes > cap.bytes) {
+        if (!evict_swarm(shard, &swarm, now_tick)) {
+            refused_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Drop the swarm that has gone longest without an announce, other than
+/// `keep` and swarms announced to this tick. The wheel already orders
+/// swarms by their latest announce: the oldest bucket holding a swarm whose
+/// filed_tick is that bucket's tick holds the least recently used swarm. An
+/// entry passed over once stays passed over, since a swarm is only ever
+/// filed again under a later tick, so the scan resumes where the last one
+/// stopped. Returns false if nothing may be evicted
+bool TrackerState::evict_swarm(Shard &shard, const Swarm *keep,
+                               uint64_t now_tick) {
+    const uint64_t slots = shard.wheel.size();
+    uint64_t t = std::max({shard.next_due_tick, shard.evict_tick,
+                           now_tick + 1 - slots});
+    for (; t < now_tick; ++t) {
+        ExpiryBucket &bucket = shard.wheel[t % slots];
+        if (bucket.tick != t)
+            continue;
+        std::size_t pos = t == shard.evict_tick ? shard.evict_pos : 0;
+        for (; pos < bucket.swarms.size(); ++pos) {
+            auto it = shard.swarms.find(bucket.swarms[pos]);
+            if (it == shard.swarms.end() || &it->second == keep ||
+                it->second.filed_tick != static_cast<uint32_t>(t))
+                continue;
+            TLOG(debug) << "[TrackerState::evict_swarm] Evicting swarm "
+                        << to_hex(it->first.view()) << " with "
+                        << it->second.size() << " peer(s), idle for "
+                        << (now_tick - t) << " tick(s)";
+            shard.evict_tick = t;
+            shard.evict_pos = pos + 1;
+            drop_swarm(shard, it);
+            evicted_.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    shard.evict_tick = t;
+    shard.evict_pos = 0;
+    return false;
+}
+
+TrackerState::Shard &TrackerState::shard_for(const InfohashKey &key) {
+    return shards_[shard_index(key)];
+}
+
+// The high bits, so shards don't all see the same low bits the swarm map
+// buckets by
+std::size_t TrackerState::shard_index(const InfohashKey &key) const {
+    return (InfohashKeyHash{}(key) >> 32) % shard_count_;
+}
+
+uint64_t TrackerState::tick_of(steady_clock::time_point t) const {
+    return static_cast<uint64_t>((t - epoch_) / expiry_resolution);
+}
+
+// The epoch keeps now_tick above ttl_ticks_
+uint64_t TrackerState::cutoff_for(uint64_t now_tick) const {
+    return now_tick - ttl_ticks_ - 1;
+}
+
+/// File `swarm` under `tick`, at most once per tick. A bucket still holding
+/// an older lap of the wheel is entirely due, so it is drained first; that
+/// may empty `swarm` itself, which is left for gc() to drop
+void TrackerState::file_swarm(Shard &shard, const InfohashKey &key,
+                              Swarm &swarm, uint64_t tick, uint64_t now_tick) {
+    if (swarm.filed_tick == tick)
+        return;
+    ExpiryBucket &bucket = shard.wheel[tick % shard.wheel.size()];
+    if (bucket.tick != tick) {
+        drain_bucket(shard, bucket, cutoff_for(now_tick), &swarm);
+        bucket.tick = tick;
+    }
+    bucket.swarms.push_back(key);
+    swarm.filed_tick = static_cast<uint32_t>(tick);
+    // Restores file swarms under past ticks; evict_swarm must see them
+    if (tick < shard.evict_tick) {
+        shard.evict_tick = tick;
+        shard.evict_pos = 0;
+    }
+}
+
+/// Remove the peers of the swarms filed in `bucket` whose latest announce is
+/// at or before `cutoff`. Peers that announced since are left alone; their
+/// swarm was filed again under the newer tick. Swarms left without peers
+/// are dropped, other than `keep`, which the caller still holds
+std::size_t TrackerState::drain_bucket(Shard &shard, ExpiryBucket &bucket,
+                                       uint64_t cutoff, const Swarm *keep) {
+    std::size_t removed = 0;
+    for (const InfohashKey &key : bucket.swarms) {
+        auto sit = shard.swarms.find(key);
+        if (sit == shard.swarms.end())
+            continue;
+        Swarm &swarm = sit->second;
+        const Swarm::Footprint before = swarm.footprint();
+        for (std::size_t slot = 0; slot < swarm.size();) {
+            if (swarm.last_seen[slot] > cutoff) {
+                ++slot;
+                continue;
+            }
+            TLOG(trace) << "[TrackerState::gc] Removing stale peer in swarm "
+                        << to_hex(key.view())
+                        << " ip=" << swarm.endpoints[slot].addr()
+                        << " port=" << swarm.endpoints[slot].port()
+                        << " peer_id=" << swarm.ids[slot].view();
+            swarm.erase_slot(slot); // the last peer moves into `slot`
+            ++removed;
+        }
+        swarm.shrink();
+        recharge(shard, before, swarm);
+        if (swarm.size() == 0 && &swarm != keep)
+            drop_swarm(shard, sit);
+    }
+    bucket.swarms.clear();
+    shard.peer_count -= removed;
+    expired_.fetch_add(removed, std::memory_order_relaxed);
+    return removed;
+}
+
+std::size_t TrackerState::gc(steady_clock::time_point now) {
+    const uint64_t now_tick = tick_of(now);
+    if (now_tick <= ttl_ticks_)
+        return 0;
+
+    // Everything filed at or before this tick has outlived the ttl
+    const uint64_t due = cutoff_for(now_tick);
+    const uint64_t slots = ttl_ticks_ + 2;
+    std::size_t removed = 0;
+
+    // One shard at a time, so announces on the other shards keep flowing
+    for (std::size_t i = 0; i < shard_count_; ++i) {
+        Shard &shard = shards_[i];
+        std::lock_guard<std::mutex> lock(shard.mtx);
+
+        // After a long pause only the last lap of the wheel can still hold
+        // anything; older buckets were drained as upserts reused them
+        uint64_t t = shard.next_due_tick;
+        if (due >= slots && t < due + 1 - slots)
+            t = due + 1 - slots;
+        for (; t <= due; ++t) {
+            ExpiryBucket &bucket = shard.wheel[t % slots];
+            if (bucket.tick == t)
+                removed += drain_bucket(shard, bucket, due);
+        }
+        shard.next_due_tick = due + 1;
+    }
+
+    if (removed > 0) {
+        TLOG(debug) << "[TrackerState::gc] Expired " << removed
+                    << " stale peer(s)";
+    }
+    return removed;
+}
+
+/// Upon connection, if the peer exists in the list for a certain infohash,
+/// update their last_seen variable, otherwise add them to the end
+std::size_t TrackerState::upsert_peer(std::string_view infohash,
+                                      const boost::asio::ip::address &addr,
+                                      uint16_t port, std::string_view peer_id,
+                                      bool seeder, bool completed,
+                                      bool count,
+                                      steady_clock::time_point now) {
+    if (count)
+        announces_.fetch_add(1, std::memory_order_relaxed);
+    const InfohashKey key(infohash);
+    Shard &shard = shard_for(key);
+    std::lock_guard<std::mutex> lock(shard.mtx);
+
+    const uint64_t tick = tick_of(now);
+    Swarm *admitted = admit_swarm(shard, key, tick);
+    if (!admitted) {
+        TLOG(debug) << "[TrackerState::upsert_peer] No room for swarm "
+                    << to_hex(infohash);
+        return 0;
+    }
+    Swarm &swarm = *admitted;
+    if (completed)
+        ++swarm.completed;
+
+    TLOG(trace) << "[TrackerState::upsert_peer] infohash=" << to_hex(infohash)
+                << " ip=" << addr << " port=" << port << " peer_id=" << peer_id
+                << " current_peer_count=" << swarm.size();
+
+    // if we already know this peer, just update their time
+    const PeerEndpoint ep(addr, port);
+    const PeerId id(peer_id);
+    const std::size_t slot = swarm.find(ep, id);
+    if (slot != Swarm::npos) {
+        TLOG(trace) << "[TrackerState::upsert_peer] Updating existing "
+                       "peer last_seen";
+        swarm.last_seen[slot] = static_cast<uint32_t>(tick);
+        if (bool(swarm.seeder[slot]) != seeder) {
+            swarm.seeder[slot] = seeder;
+            seeder ? ++swarm.seeders : --swarm.seeders;
+        }
+    } else if (admit_peer(shard, swarm, tick)) {
+        TLOG(trace) << "[TrackerState::upsert_peer] Adding new peer";
+        const Swarm::Footprint before = swarm.footprint();
+        swarm.insert(ep, id, static_cast<uint32_t>(tick), seeder);
+        recharge(shard, before, swarm);
+        ++shard.peer_count;
+    } else {
+        TLOG(debug) << "[TrackerState::upsert_peer] Swarm "
+                    << to_hex(infohash) << " is full, not adding peer";
+    }
+
+    // Even a refused announce shows the swarm is in use
+    file_swarm(shard, key, swarm, tick, tick);
+    return swarm.size();
+}
+
+/// If the peer is in the swarm for the given infohash, remove it
+void TrackerState::remove_peer(std::string_view infohash,
+                               const boost::asio::ip::address &addr,
+                               uint16_t port, std::string_view peer_id,
+                               bool count) {
+    if (count)
+        announces_.fetch_add(1, std::memory_order_relaxed);
+    const InfohashKey key(infohash);
+    Shard &shard = shard_for(key);
+    std::lock_guard<std::mutex> lock(shard.mtx);
+
+    auto it = shard.swarms.find(key);
+    if (it == shard.swarms.end()) {
+        TLOG(trace) << "[TrackerState::remove_peer] No swarm found for "
+                       "infohash="
+                    << to_hex(infohash);
+        return;
+    }
+    auto &swarm = it->second;
+    bool removed = swarm.erase(PeerEndpoint(addr, port), PeerId(peer_id));
+    if (removed)
+        --shard.peer_count;
+    TLOG(trace) << "[TrackerState::remove_peer] infohash=" << to_hex(infohash)
+                << " removed_peers=" << (removed ? 1 : 0)
+                << " remaining=" << swarm.size();
+}
+
+// Returns a sample of peers excluding your own, with a bound on the size of
+// the list
+std::vector<PeerEndpoint>
+TrackerState::list_peers(std::string_view infohash,
+                         const boost::asio::ip::address &self_addr,
+                         uint16_t self_port, std::string_view self_peer_id,
+                         size_t max_peers, bool self_seeder,
+                         PeerFamily family) {
+    std::vector<PeerEndpoint> out;
+    const InfohashKey key(infohash);
+    Shard &shard = shard_for(key);
+    std::lock_guard<std::mutex> lock(shard.mtx);
+
+    auto it = shard.swarms.find(key);
+    if (it == shard.swarms.end()) {
+        TLOG(trace) << "[TrackerState::list_peers] No swarm for infohash="
+                    << to_hex(infohash);
+        return out;
+    }
+    const Swarm &swarm = it->second;
+
+    TLOG(trace) << "[TrackerState::list_peers] Building peer list for "
+                   "infohash="
+                << to_hex(infohash) << " total_peers_in_swarm=" << swarm.size()
+                << " max_peers=" << max_peers;
+
+    const PeerEndpoint self_ep(self_addr, self_port);
+    const std::size_t self = swarm.find(self_ep, PeerId(self_peer_id));
+    std::optional<Nearness> near;
+    if (sites_)
+        near.emplace(self_ep, *sites_);
+    std::array<uint32_t, kMaxNumWant> picked;
+    const std::size_t count =
+        swarm.sample(self, self_seeder, max_peers, picked.data(),
+                     near ? &*near : nullptr, family);
+    out.reserve(count);
+    for (std::size_t i = 0; i < count; ++i)
+        out.push_back(swarm.endpoints[picked[i]]);
+
+    TLOG(trace) << "[TrackerState::list_peers] Returning " << out.size()
+                << " peer(s)";
+    return out;
+}
+
+std::string TrackerState::peer_list_body(
+    std::string_view infohash, const boost::asio::ip::address &self_addr,
+    uint16_t self_port, std::string_view self_peer_id, PeerListFormat format,
+    AnnounceTiming timing, size_t max_peers, bool self_seeder) {
+    std::string body;
+    peer_list_body(body, infohash, self_addr, self_port, self_peer_id, format,
+                   timing, max_peers, self_seeder);
+    return body;
+}
+
+void TrackerState::peer_list_body(std::string &out, std::string_view infohash,
+                                  const boost::asio::ip::address &self_addr,
+                                  uint16_t self_port,
+                                  std::string_view self_peer_id,
+                                  PeerListFormat format, AnnounceTiming timing,
+                                  size_t max_peers, bool self_seeder) {
+    const InfohashKey key(infohash);
+    Shard &shard = shard_for(key);
+    std::lock_guard<std::mutex> lock(shard.mtx);
+
+    auto it = shard.swarms.find(key);
+    if (it == shard.swarms.end()) {
+        // Nobody to list
+        write_peer_list(out, nullptr, nullptr, 0, format, timing);
+        return;
+    }
+
+    Swarm &swarm = it->second;
+    max_peers = std::min(max_peers, kMaxNumWant);
+    const PeerEndpoint self_ep(self_addr, self_port);
+    const std::size_t self = swarm.find(self_ep, PeerId(self_peer_id));
+    const std::size_t others = swarm.size() - (self != Swarm::npos);
+
+    if (sites_ || self_seeder || others > max_peers) {
+        std::optional<Nearness> near;
+        if (sites_)
+            near.emplace(self_ep, *sites_);
+        std::array<uint32_t, kMaxNumWant> picked;
+        const std::size_t count = swarm.sample(self, self_seeder, max_peers,
+                                               picked.data(),
+                                               near ? &*near : nullptr);
+        write_peer_list(out, swarm.endpoints.data(), picked.data(), count,
+                        format, timing);
+        return;
+    }
+
+    // Every other peer goes out, so there is nothing to pick and the cached
+    // records (which then cover the whole swarm) will do
+    PeerListCache &cache = swarm.caches[static_cast<int>(format)];
+    if (!cache.fresh(swarm.version, kMaxNumWant)) {
+        TLOG(debug) << "[TrackerState::peer_list_body] Rebuilding cached peer "
+                       "list for infohash="
+                    << to_hex(infohash) << " version=" << swarm.version;
+        const Swarm::Footprint before = swarm.footprint();
+        cache.rebuild(swarm.endpoints, kMaxNumWant, format, swarm.version);
+        recharge(shard, before, swarm);
+    }
+    // Swarm::npos and PeerListCache::npos agree
+    cache.write_body(out, cache.skip_for(self), timing);
+}
+
+std::size_t TrackerState::swarm_size(std::string_view infohash) {
+    const InfohashKey key(infohash);
+    Shard &shard = shard_for(key);
+    std::lock_guard<std::mutex> lock(shard.mtx);
+
+    auto it = shard.swarms.find(key);
+    return it == shard.swarms.end() ? 0 : it->second.size();
+}
+
+TrackerState::ScrapeCounts TrackerState::scrape(std::string_view infohash) {
+    ScrapeCounts out;
+    const InfohashKey key(infohash);
+    Shard &shard = shard_for(key);
+    std::lock_guard<std::mutex> lock(shard.mtx);
+
+    auto it = shard.swarms.find(key);
+    if (it == shard.swarms.end())
+        return out;
+    const Swarm &swarm = it->second;
+    out.seeders = swarm.seeders;
+    out.leechers = swarm.size() - swarm.seeders;
+    out.completed = swarm.completed;
+    return out;
+}
+
+TrackerState::Stats TrackerState::stats() {
+    Stats out;
+    MemoryUsage &mem = out.memory;
+    for (std::size_t i = 0; i < shard_count_; ++i) {
+        Shard &shard = shards_[i];
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        out.swarms += shard.swarms.size();
+        out.peers += shard.peer_count;
+        mem.swarms.peers += shard.bytes.peers;
+        mem.swarms.index += shard.bytes.index;
+        mem.swarms.caches += shard.bytes.caches;
+        mem.table += charged_bytes(shard) - shard.bytes.total();
+        mem.wheel += shard.wheel.capacity() * sizeof(ExpiryBucket);
+        for (const ExpiryBucket &bucket : shard.wheel)
+            mem.wheel += bucket.swarms.capacity() * sizeof(InfohashKey);
+    }
+    out.announces = announces_.load(std::memory_order_relaxed);
+    out.expired = expired_.load(std::memory_order_relaxed);
+    out.evicted = evicted_.load(std::memory_order_relaxed);
+    out.refused = refused_.load(std::memory_order_relaxed);
+    return out;
+}
+
+// Snapshot layout, all integers little-endian:
+//
+//   header:  "BTTS" | u32 format version | u64 unix time (ms) | u64 swarms
+//   swarm:   u8 infohash length | infohash | u64 completed | u32 peers
+//            | peer...
+//   peer:    u8 family (4 or 6) | 4 or 16 address bytes | u16 port
+//            | u8 peer_id length | peer_id | u32 age (ms) at snapshot time
+//            | u8 flags (bit 0: seeder)
+namespace {
+
+constexpr char kSnapshotMagic[4] = {'B', 'T', 'T', 'S'};
+constexpr uint32_t kSnapshotVersion = 2;
+
+template <typename T> void put_le(std::string &out, T v) {
+    char bytes[sizeof(T)];
+    for (std::size_t i = 0; i < sizeof(T); ++i)
+        bytes[i] = static_cast<char>(v >> (8 * i));
+    out.append(bytes, sizeof(T));
+}
+
+void put_bytes8(std::string &out, std::string_view s) {
+    put_le<uint8_t>(out, static_cast<uint8_t>(s.size()));
+    out.append(s);
+}
+
+/// Bounds-checked cursor over a snapshot. Any short read sets `ok` to false
+/// and makes every later read return zeroes
+struct snapshot_reader {
+    std::string_view data;
+    std::size_t pos = 0;
+    bool ok = true;
+
+    const char *take(std::size_t n) {
+        if (!ok || data.size() - pos < n) {
+            ok = false;
+            return nullptr;
+        }
+        const char *p = data.data() + pos;
+        pos += n;
+        return p;
+    }
+
+    template <typename T> T get_le() {
+        const char *p = take(sizeof(T));
+        T v = 0;
+        if (p) {
+            for (std::size_t i = 0; i < sizeof(T); ++i)
+                v |= static_cast<T>(static_cast<unsigned char>(p[i]))
+                     << (8 * i);
+        }
+        return v;
+    }
+
+    std::string_view get_bytes8() {
+        std::size_t n = get_le<uint8_t>();
+        const char *p = take(n);
+        return p ? std::string_view(p, n) : std::string_view{};
+    }
+};
+
+uint64_t unix_ms_now() {
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch())
+            .count());
+}
+
+} // namespace
+
+void TrackerState::write_snapshot(std::string &out) {
+    const std::size_t start = out.size();
+    out.append(kSnapshotMagic, sizeof(kSnapshotMagic));
+    put_le<uint32_t>(out, kSnapshotVersion);
+    put_le<uint64_t>(out, unix_ms_now());
+    const std::size_t count_at = out.size();
+    put_le<uint64_t>(out, 0); // swarm count, patched below
+
+    uint64_t swarms = 0;
+    const uint64_t now_tick = tick_of(steady_clock::now());
+    for (std::size_t i = 0; i < shard_count_; ++i) {
+        Shard &shard = shards_[i];
+        std::lock_guard<std::mutex> lock(shard.mtx);
+
+        for (const auto &[key, swarm] : shard.swarms) {
+            // About to be dropped by gc(), see drain_bucket()
+            if (swarm.size() == 0)
+                continue;
+            ++swarms;
+            put_bytes8(out, key.view());
+            put_le<uint64_t>(out, swarm.completed);
+            put_le<uint32_t>(out, static_cast<uint32_t>(swarm.size()));
+            for (std::size_t slot = 0; slot < swarm.size(); ++slot) {
+                const PeerEndpoint &ep = swarm.endpoints[slot];
+                if (ep.is_v4()) {
+                    put_le<uint8_t>(out, 4);
+                    out.append(reinterpret_cast<const char *>(&ep.bytes[12]),
+                               4);
+                } else {
+                    put_le<uint8_t>(out, 6);
+                    out.append(reinterpret_cast<const char *>(&ep.bytes[0]),
+                               16);
+                }
+                put_le<uint16_t>(out, ep.port());
+                put_bytes8(out, swarm.ids[slot].view());
+                // Ages are only as precise as the expiry ticks
+                const auto age = (now_tick - swarm.last_seen[slot]) *
+                                 expiry_resolution;
+                put_le<uint32_t>(
+                    out, static_cast<uint32_t>(
+                             std::chrono::milliseconds(age).count()));
+                put_le<uint8_t>(out, swarm.seeder[slot] ? 1 : 0);
+            }
+        }
+    }
+
+    std::string count;
+    put_le<uint64_t>(count, swarms);
+    out.replace(count_at, count.size(), count);
+    TLOG(debug) << "[TrackerState::write_snapshot] Wrote " << swarms
+                << " swarm(s) in " << (out.size() - start) << " bytes";
+}
+
+std::size_t TrackerState::restore_snapshot(std::string_view data) {
+    snapshot_reader in{data};
+    const char *magic = in.take(sizeof(kSnapshotMagic));
+    if (!magic ||
+        std::memcmp(magic, kSnapshotMagic, sizeof(kSnapshotMagic)) != 0 ||
+        in.get_le<uint32_t>() != kSnapshotVersion) {
+        TLOG(error) << "[TrackerState::restore_snapshot] Not a version "
+                    << kSnapshotVersion << " snapshot";
+        return 0;
+    }
+    const uint64_t taken_ms = in.get_le<uint64_t>();
+    const uint64_t swarm_count = in.get_le<uint64_t>();
+
+    // First pass: validate the whole file and find where each swarm starts,
+    // grouped by the shard it belongs to
+    std::vector<std::vector<std::size_t>> by_shard(shard_count_);
+    for (uint64_t s = 0; s < swarm_count && in.ok; ++s) {
+        const std::size_t at = in.pos;
+        std::string_view infohash = in.get_bytes8();
+        in.take(8);
+        const uint32_t peers = in.get_le<uint32_t>();
+        for (uint32_t n = 0; n < peers && in.ok; ++n) {
+            const uint8_t family = in.get_le<uint8_t>();
+            if (family != 4 && family != 6) {
+                in.ok = false;
+                break;
+            }
+            in.take(family == 4 ? 4 : 16);
+            in.take(2);
+            in.get_bytes8();
+            in.take(5);
+        }
+        if (in.ok)
+            by_shard[shard_index(InfohashKey(infohash))].push_back(at);
+    }
+    if (!in.ok || in.pos != data.size()) {
+        TLOG(error) << "[TrackerState::restore_snapshot] Snapshot is truncated "
+                       "or corrupt, ignoring it";
+        return 0;
+    }
+
+    // Ages in the file are relative to when it was written
+    const uint64_t now_ms = unix_ms_now();
+    const auto offline = std::chrono::milliseconds{
+        now_ms > taken_ms ? now_ms - taken_ms : 0};
+    const auto now = steady_clock::now();
+    const uint64_t now_tick = tick_of(now);
+
+    // Second pass: each worker owns a disjoint set of shards, so the only
+    // locking is the one uncontended lock per shard
+    std::atomic<std::size_t> restored{0};
+    auto fill = [&](std::size_t first, std::size_t step) {
+        std::size_t local = 0;
+        std::vector<uint32_t> ticks;
+        for (std::size_t i = first; i < shard_count_; i += step) {
+            Shard &shard = shards_[i];
+            std::lock_guard<std::mutex> lock(shard.mtx);
+            shard.swarms.reserve(shard.swarms.size() + by_shard[i].size());
+            for (std::size_t at : by_shard[i]) {
+                snapshot_reader r{data, at};
+                const InfohashKey key(r.get_bytes8());
+                const uint64_t completed = r.get_le<uint64_t>();
+                const uint32_t peers = r.get_le<uint32_t>();
+                Swarm *admitted = admit_swarm(shard, key, now_tick);
+                if (!admitted)
+                    continue;
+                Swarm &swarm = *admitted;
+                swarm.completed += completed;
+                const bool merge = swarm.size() > 0;
+                std::size_t room = peers;
+                if (shard_limits_.peers_per_swarm != 0) {
+                    room = std::min<std::size_t>(
+                        room, shard_limits_.peers_per_swarm -
+                                  std::min(swarm.size(),
+                                           shard_limits_.peers_per_swarm));
+                }
+                const Swarm::Footprint before = swarm.footprint();
+                swarm.reserve(swarm.size() + room);
+                recharge(shard, before, swarm);
+                ticks.clear();
+
+                for (uint32_t n = 0; n < peers; ++n) {
+                    boost::asio::ip::address addr;
+                    if (r.get_le<uint8_t>() == 4) {
+                        boost::asio::ip::address_v4::bytes_type b;
+                        std::memcpy(b.data(), r.take(b.size()), b.size());
+                        addr = boost::asio::ip::address_v4(b);
+                    } else {
+                        boost::asio::ip::address_v6::bytes_type b;
+                        std::memcpy(b.data(), r.take(b.size()), b.size());
+                        addr = boost::asio::ip::address_v6(b);
+                    }
+                    const PeerEndpoint ep(addr, r.get_le<uint16_t>());
+                    const PeerId id(r.get_bytes8());
+                    const auto age =
+                        std::chrono::milliseconds{r.get_le<uint32_t>()} +
+                        offline;
+                    const bool seeder = r.get_le<uint8_t>() & 1;
+                    if (age > ttl)
+                        continue;
+                    if (merge && swarm.find(ep, id) != Swarm::npos)
+                        continue; // announced again since we came up
+                    if (!admit_peer(shard, swarm, now_tick))
+                        continue;
+
+                    const auto tick =
+                        static_cast<uint32_t>(tick_of(now - age));
+                    swarm.insert(ep, id, tick, seeder);
+                    ticks.push_back(tick);
+                    ++shard.peer_count;
+                    ++local;
+                }
+
+                // The swarm goes in the bucket of every tick its peers were
+                // last seen at, as if they had announced live
+                std::sort(ticks.begin(), ticks.end());
+                ticks.erase(std::unique(ticks.begin(), ticks.end()),
+                            ticks.end());
+                for (uint32_t tick : ticks)
+                    file_swarm(shard, key, swarm, tick, now_tick);
+                // Every peer outlived the ttl: gc() would have dropped it
+                if (swarm.size() == 0)
+                    drop_swarm(shard, shard.swarms.find(key));
+            }
+        }
+        restored.fetch_add(local, std::memory_order_relaxed);
+    };
+
+    const std::size_t workers = std::min<std::size_t>(
+        shard_count_, std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<std::thread> pool;
+    pool.reserve(workers - 1);
+    for (std::size_t w = 1; w < workers; ++w)
+        pool.emplace_back(fill, w, workers);
+    fill(0, workers);
+    for (auto &t : pool)
+        t.join();
+
+    TLOG(info) << "[TrackerState::restore_snapshot] Restored " << restored
+               << " peer(s) from " << swarm_count << " swarm(s), "
+               << offline.count() << " ms after the snapshot was taken";
+    return restored;
+}
@@ -0,0 +1,364 @@
+#pragma once
+#include "peer_list.hpp"
+#include <array>
+#include <atomic>
+#include <boost/asio/ip/address.hpp>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+using steady_clock = std::chrono::steady_clock;
+
+class SiteMap;
+struct Nearness;
+
+std::string to_hex(std::string_view data);
+
+/// Swarm key: the infohash in a fixed 32-byte buffer, wide enough for a v2
+/// (SHA-256) hash. Shorter hashes are zero-padded and keep their length
+struct InfohashKey {
+    std::array<char, 32> bytes{};
+    uint8_t len = 0;
+
+    InfohashKey() = default;
+    explicit InfohashKey(std::string_view infohash);
+
+    std::string_view view() const { return {bytes.data(), len}; }
+    bool operator==(const InfohashKey &) const = default;
+};
+
+struct InfohashKeyHash {
+    std::size_t operator()(const InfohashKey &k) const noexcept;
+};
+
+/// A peer's address and port packed the way compact peer lists carry them:
+/// 16 address bytes (IPv4 stored v4-mapped) and a big-endian port, 18 bytes
+/// with no padding. An IPv4 peer and its v4-mapped form are the same peer
+struct PeerEndpoint {
+    std::array<unsigned char, 18> bytes{};
+
+    PeerEndpoint() = default;
+    PeerEndpoint(const boost::asio::ip::address &addr, uint16_t port);
+
+    /// IPv4 (stored v4-mapped); the address is then bytes[12..15]
+    bool is_v4() const;
+    boost::asio::ip::address addr() const;
+    uint16_t port() const { return uint16_t(bytes[16] << 8 | bytes[17]); }
+
+    bool operator==(const PeerEndpoint &) const = default;
+};
+
+/// Which address family a peer list may hold
+enum class PeerFamily : uint8_t { any, v4, v6 };
+
+/// Peer ids are 20 bytes (BEP 3). Longer ones are cut to 20, shorter ones
+/// keep their length
+struct PeerId {
+    std::array<char, 20> bytes{};
+    uint8_t len = 0;
+
+    PeerId() = default;
+    explicit PeerId(std::string_view id);
+
+    std::string_view view() const { return {bytes.data(), len}; }
+    bool operator==(const PeerId &) const = default;
+};
+
+/// Peers of one infohash, stored column-wise: slot i of every column is the
+/// same peer, and the columns are kept dense. Lookups go through `index`, an
+/// open-addressed table of slot + 1 (0 is empty) keyed by endpoint and peer
+/// id, so lookups and swap-and-pop removals are O(1) without a heap node per
+/// peer. `last_seen` is the expiry tick of the peer's latest announce.
+/// `version` moves whenever a peer joins or leaves (not on re-announces) and
+/// tells the serialized peer list caches when they are out of date.
+/// `seeders` is kept in step by insert/erase and whoever flips a peer's
+/// seeder flag, so scrapes never walk the peers
+struct Swarm {
+    /// Heap bytes the swarm holds, by structure, counted from capacities
+    struct Footprint {
+        std::size_t peers = 0;  // The peer columns
+        std::size_t index = 0;  // The endpoint + peer id lookup table
+        std::size_t caches = 0; // Serialized peer lists
+
+        std::size_t total() const { return peers + index + caches; }
+    };
+
+    static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+    /// How much likelier a seeder is to be sampled than a leecher
+    static constexpr unsigned kSeederWeight = 2;
+    /// Slots one sample() looks at, or twice what it picks if that's more
+    static constexpr std::size_t kSampleWindow = 256;
+    /// Same, in locality mode or when only one address family is wanted,
+    /// where the peers that count may be few and far between
+    static constexpr std::size_t kNearWindow = 1024;
+
+    std::vector<PeerEndpoint> endpoints;
+    std::vector<PeerId> ids;
+    std::vector<uint32_t> last_seen;
+    std::vector<uint8_t> seeder;
+    std::vector<uint32_t> index; // size is 0 or a power of two
+
+    uint64_t version = 0;
+    std::size_t seeders = 0;
+    uint64_t completed = 0; // event=completed announces seen
+    uint32_t filed_tick = 0; // Expiry bucket the swarm was last filed under
+    PeerListCache caches[2]; // Indexed by PeerListFormat
+
+    std::size_t size() const { return endpoints.size(); }
+
+    /// Slot of the peer, or npos
+    std::size_t find(const PeerEndpoint &ep, const PeerId &id) const;
+    void insert(const PeerEndpoint &ep, const PeerId &id, uint32_t tick,
+                bool is_seeder);
+    bool erase(const PeerEndpoint &ep, const PeerId &id);
+    void erase_slot(std::size_t slot);
+    void reserve(std::size_t peers);
+    /// Give back memory left over from when the swarm was much bigger
+    void shrink();
+
+    Footprint footprint() const;
+
+    /// Pick up to `want` random peers other than slot `self` into `out`,
+    /// returning how many. Seeders are about kSeederWeight times as likely
+    /// to be picked as leechers, and never picked `for_seeder`, who has
+    /// nothing to fetch from them. Weighted reservoir sampling over a window
+    /// of slots from a random start, so the cost is bounded however big the
+    /// swarm is, and nothing is copied but the picks. Given `near`, peers
+    /// nearer the announcer come first and farther ones only fill up the
+    /// rest. Peers not of `family` are never picked
+    std::size_t sample(std::size_t self, bool for_seeder, std::size_t want,
+                       uint32_t *out, const Nearness *near = nullptr,
+                       PeerFamily family = PeerFamily::any) const;
+
+  private:
+    uint64_t hash_of(std::size_t slot) const;
+    std::size_t position_of(std::size_t slot) const;
+    void place(std::size_t slot);
+    void rehash(std::size_t buckets);
+};
+
+/// All swarms known to the tracker. Swarms are partitioned by infohash over a
+/// fixed number of shards, each with its own lock, so announces for different
+/// swarms can be served from different threads without contending.
+///
+/// Stale peers are expired incrementally: every shard keeps a timer wheel of
+/// expiry buckets, one per `expiry_resolution` of wall time, and each swarm is
+/// filed in the bucket of every tick it was announced to (at most once per
+/// tick). gc() only drains the buckets that have aged past the ttl, scanning
+/// the `last_seen` column of each swarm filed there, so its work is
+/// proportional to the swarms that were active one ttl ago rather than to
+/// every tracked swarm. A busy swarm is scanned about once per tick; that is
+/// a pass over one u32 per peer, and it keeps the wheel down to one entry
+/// per active swarm instead of one per announce. A swarm whose last peer
+/// has gone is dropped when its bucket is drained, completed count and all;
+/// snapshots leave such swarms out for the same reason.
+///
+/// Memory can be capped (see Limits). The caps are split evenly over the
+/// shards and enforced per shard, under the shard's own lock: a new swarm
+/// that doesn't fit evicts the swarm that has gone longest without an
+/// announce, which the wheel already knows, and a new peer that doesn't fit
+/// is not tracked (it still gets its peer list).
+class TrackerState {
+  public:
+    static constexpr std::chrono::seconds expiry_resolution{1};
+
+    explicit TrackerState(std::size_t shard_count = 16,
+                          std::chrono::seconds ttl = std::chrono::seconds{120});
+    ~TrackerState();
+
+    /// Turn on locality mode: peer lists favour peers in the announcer's
+    /// subnet, then at its site in `sites` (which may be empty), and are
+    /// topped up with random peers. Near peers are only looked for among
+    /// the Swarm::kNearWindow peers one sample() scans, from a random
+    /// starting slot; in bigger swarms those beyond it aren't preferred on
+    /// that announce, since peers aren't indexed by site. Call before
+    /// serving anything
+    void set_locality(SiteMap sites);
+
+    /// Caps on what the tracker holds, 0 for no cap. `bytes` counts the
+    /// swarms and their peers, lookup tables and cached peer lists, not the
+    /// expiry wheel, and is approximate: a swarm may overshoot it by the
+    /// one allocation that pushed it over
+    struct Limits {
+        std::size_t swarms = 0;
+        std::size_t peers_per_swarm = 0;
+        std::size_t bytes = 0;
+    };
+
+    /// Apply `limits` from now on. Call before serving anything
+    void set_limits(const Limits &limits);
+
+    const std::chrono::seconds ttl; // How long until peer is considered stale
+
+    /// Peers handed out per announce when the client doesn't say (numwant),
+    /// and the most it may ask for
+    static constexpr std::size_t kDefaultNumWant = 50;
+    static constexpr std::size_t kMaxNumWant = 200;
+
+    /// Expire every peer whose bucket has come due by `now`. Meant to be
+    /// called about once per `expiry_resolution`; returns how many peers
+    /// were removed
+    std::size_t gc(steady_clock::time_point now = steady_clock::now());
+
+    /// Add the peer or refresh its last_seen. `seeder` is whether it
+    /// announced left=0; `completed` whether this was event=completed.
+    /// `count` is whether this is a client announce for stats().announces;
+    /// changes replayed from another cluster node pass false so an announce
+    /// is counted once cluster-wide. `now` is when it was seen, and must not
+    /// go back from one call to the next. Returns the swarm's size afterwards
+    std::size_t upsert_peer(std::string_view infohash,
+                            const boost::asio::ip::address &addr,
+                            uint16_t port, std::string_view peer_id,
+                            bool seeder = false, bool completed = false,
+                            bool count = true,
+                            steady_clock::time_point now = steady_clock::now());
+
+    void remove_peer(std::string_view infohash,
+                     const boost::asio::ip::address &addr, uint16_t port,
+                     std::string_view peer_id, bool count = true);
+
+    /// Endpoints of up to `max_peers` (at most kMaxNumWant) peers of the
+    /// swarm other than the announcer, sampled as Swarm::sample() does;
+    /// `self_seeder` is whether the announcer is seeding, and only peers of
+    /// `family` are listed
+    std::vector<PeerEndpoint>
+    list_peers(std::string_view infohash,
+               const boost::asio::ip::address &self_addr, uint16_t self_port,
+               std::string_view self_peer_id,
+               size_t max_peers = kDefaultNumWant, bool self_seeder = false,
+               PeerFamily family = PeerFamily::any);
+
+    /// Ready-to-send announce response body listing the same. When every
+    /// other peer fits (and locality mode is off) it is served from the
+    /// swarm's cache
+    std::string peer_list_body(std::string_view infohash,
+                               const boost::asio::ip::address &self_addr,
+                               uint16_t self_port,
+                               std::string_view self_peer_id,
+                               PeerListFormat format,
+                               AnnounceTiming timing = {},
+                               size_t max_peers = kDefaultNumWant,
+                               bool self_seeder = false);
+
+    /// Same, appended to `out`, so a caller can keep reusing one buffer
+    void peer_list_body(std::string &out, std::string_view infohash,
+                        const boost::asio::ip::address &self_addr,
+                        uint16_t self_port, std::string_view self_peer_id,
+                        PeerListFormat format, AnnounceTiming timing = {},
+                        size_t max_peers = kDefaultNumWant,
+                        bool self_seeder = false);
+
+    /// Number of peers currently in the swarm for `infohash`
+    std::size_t swarm_size(std::string_view infohash);
+
+    struct ScrapeCounts {
+        std::size_t seeders = 0;
+        std::size_t leechers = 0;
+        uint64_t completed = 0;
+    };
+
+    /// Swarm health for `infohash`, read from the swarm's counters
+    ScrapeCounts scrape(std::string_view infohash);
+
+    /// Approximate heap bytes held, by structure
+    struct MemoryUsage {
+        Swarm::Footprint swarms; // Summed over every swarm
+        std::size_t table = 0;   // Swarm map nodes and buckets
+        std::size_t wheel = 0;   // Expiry buckets
+
+        std::size_t total() const {
+            return swarms.total() + table + wheel;
+        }
+    };
+
+    struct Stats {
+        std::size_t swarms = 0;
+        std::size_t peers = 0;
+        uint64_t announces = 0; // upserts + removals since startup
+        uint64_t expired = 0;   // peers dropped by gc() since startup
+        uint64_t evicted = 0;   // idle swarms dropped to make room
+        uint64_t refused = 0;   // swarms and peers turned away by the caps
+        MemoryUsage memory;
+    };
+
+    /// Totals across all shards. Costs one lock per shard plus a walk over
+    /// its expiry wheel, not per swarm or peer
+    Stats stats();
+
+    std::size_t shard_count() const { return shard_count_; }
+
+    /// Append every tracked peer to `out` in the snapshot format described in
+    /// tracker_state.cpp. Locks one shard at a time; peers are stored with
+    /// their age rather than a steady_clock time so the file outlives the
+    /// process
+    void write_snapshot(std::string &out);
+
+    /// Re-add the peers of a snapshot written by write_snapshot(), aging them
+    /// by the wall time since it was taken and dropping any that have
+    /// outlived the ttl. Shards are filled in parallel. Returns how many
+    /// peers were restored; a malformed snapshot is rejected as a whole
+    std::size_t restore_snapshot(std::string_view data);
+
+  private:
+    using SwarmMap = std::unordered_map<InfohashKey, Swarm, InfohashKeyHash>;
+
+    struct ExpiryBucket {
+        uint64_t tick = 0;
+        std::vector<InfohashKey> swarms;
+    };
+
+    // Padded out to a cache line so neighbouring shard locks don't false-share
+    struct alignas(64) Shard {
+        std::mutex mtx;
+        // infohash -> peers in that swarm
+        SwarmMap swarms;
+        // Indexed by tick % wheel.size()
+        std::vector<ExpiryBucket> wheel;
+        uint64_t next_due_tick = 0; // Oldest bucket gc() hasn't drained yet
+        std::size_t peer_count = 0;
+        Swarm::Footprint bytes; // Summed over `swarms`
+        // Where the last eviction left off in the wheel (see evict_swarm)
+        uint64_t evict_tick = 0;
+        std::size_t evict_pos = 0;
+    };
+
+    Shard &shard_for(const InfohashKey &key);
+    std::size_t shard_index(const InfohashKey &key) const;
+    uint64_t tick_of(steady_clock::time_point t) const;
+    /// Newest tick whose peers have outlived the ttl by `now_tick`
+    uint64_t cutoff_for(uint64_t now_tick) const;
+    void file_swarm(Shard &shard, const InfohashKey &key, Swarm &swarm,
+                    uint64_t tick, uint64_t now_tick);
+    std::size_t drain_bucket(Shard &shard, ExpiryBucket &bucket,
+                             uint64_t cutoff, const Swarm *keep = nullptr);
+
+    /// Shard bytes counted against Limits::bytes
+    std::size_t charged_bytes(const Shard &shard) const;
+    /// Swarm for `key`, created if there is room for it (evicting an idle
+    /// swarm if need be), or null if there isn't
+    Swarm *admit_swarm(Shard &shard, const InfohashKey &key,
+                       uint64_t now_tick);
+    /// Whether `swarm` may take one more peer
+    bool admit_peer(Shard &shard, const Swarm &swarm, uint64_t now_tick);
+    bool evict_swarm(Shard &shard, const Swarm *keep, uint64_t now_tick);
+    void drop_swarm(Shard &shard, SwarmMap::iterator it);
+    /// Fold the change in `swarm`'s footprint since `before` into the shard
+    static void recharge(Shard &shard, const Swarm::Footprint &before,
+                         const Swarm &swarm);
+
+    std::size_t shard_count_;
+    std::unique_ptr<Shard[]> shards_;
+    steady_clock::time_point epoch_;
+    uint64_t ttl_ticks_;
+    std::atomic<uint64_t> announces_{0};
+    std::atomic<uint64_t> expired_{0};
+    std::atomic<uint64_t> evicted_{0};
+    std::atomic<uint64_t> refused_{0};
+    Limits shard_limits_; // Limits split over the shards
+    std::unique_ptr<const SiteMap> sites_; // null: locality mode off
+};
@@ -0,0 +1,312 @@
+#include "udp_tracker.hpp"
+#include "hashing.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <random>
+#include <string>
+
+namespace {
+
+constexpr uint64_t kProtocolId = 0x41727101980ULL;
+
+enum : uint32_t {
+    kActionConnect = 0,
+    kActionAnnounce = 1,
+    kActionScrape = 2,
+    kActionError = 3,
+};
+
+enum : uint32_t {
+    kEventNone = 0,
+    kEventCompleted = 1,
+    kEventStarted = 2,
+    kEventStopped = 3,
+};
+
+constexpr std::size_t kInfohashLen = 32;
+constexpr std::size_t kPeerIdLen = 20;
+constexpr std::size_t kAnnounceLen = 110;
+constexpr std::size_t kMaxPeers = 200;
+
+// Connection ids stay valid for the window they were issued in and the next
+constexpr auto kConnectionWindow = std::chrono::seconds{60};
+
+uint32_t read_u32(const unsigned char *p) {
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) |
+           (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+uint64_t read_u64(const unsigned char *p) {
+    return (uint64_t(read_u32(p)) << 32) | read_u32(p + 4);
+}
+
+void write_u32(unsigned char *p, uint32_t v) {
+    p[0] = static_cast<unsigned char>(v >> 24);
+    p[1] = static_cast<unsigned char>(v >> 16);
+    p[2] = static_cast<unsigned char>(v >> 8);
+    p[3] = static_cast<unsigned char>(v);
+}
+
+void write_u64(unsigned char *p, uint64_t v) {
+    write_u32(p, static_cast<uint32_t>(v >> 32));
+    write_u32(p + 4, static_cast<uint32_t>(v));
+}
+
+uint64_t current_window() {
+    auto since_epoch = std::chrono::steady_clock::now().time_since_epoch();
+    return static_cast<uint64_t>(since_epoch / kConnectionWindow);
+}
+
+} // namespace
+
+udp_tracker::udp_tracker(boost::asio::io_context &ioc, udp::endpoint ep,
+                         TrackerState &st, AdmissionControl &admission,
+                         const IntervalPolicy &intervals,
+                         cluster_node *cluster)
+    : socket_(ioc), state_(st), admission_(admission), intervals_(intervals),
+      cluster_(cluster) {
+    TLOG(info) << "[udp_tracker] Constructing UDP tracker on " << ep;
+
+    std::random_device rd;
+    secret_ = (uint64_t(rd()) << 32) | rd();
+
+    boost::system::error_code ec;
+    socket_.open(ep.protocol(), ec);
+    if (ec)
+        throw boost::system::system_error(ec);
+    socket_.bind(ep, ec);
+    if (ec)
+        throw boost::system::system_error(ec);
+    // See send()
+    socket_.non_blocking(true, ec);
+    if (ec)
+        throw boost::system::system_error(ec);
+}
+
+void udp_tracker::run() {
+    TLOG(info) << "[udp_tracker::run] Starting receive loop";
+    do_receive();
+}
+
+void udp_tracker::do_receive() {
+    socket_.async_receive_from(
+        boost::asio::buffer(recv_buffer_), remote_,
+        [self = shared_from_this()](boost::system::error_code ec,
+                                    std::size_t n) {
+            if (!ec) {
+                metrics::udp_bytes_in.add(n);
+                self->handle_datagram(n);
+            } else if (ec == boost::asio::error::operation_aborted) {
+                return;
+            } else {
+                TLOG(warn) << "[udp_tracker::do_receive] Error receiving: "
+                           << ec.message();
+            }
+            self->do_receive();
+        });
+}
+
+uint64_t udp_tracker::connection_id(const udp::endpoint &ep,
+                                    uint64_t window) const {
+    uint64_t h = mix64(secret_ ^ window);
+    if (ep.address().is_v4()) {
+        h = mix64(h ^ ep.address().to_v4().to_uint());
+    } else {
+        auto bytes = ep.address().to_v6().to_bytes();
+        uint64_t hi, lo;
+        std::memcpy(&hi, bytes.data(), 8);
+        std::memcpy(&lo, bytes.data() + 8, 8);
+        h = mix64(mix64(h ^ hi) ^ lo);
+    }
+    return mix64(h ^ ep.port());
+}
+
+bool udp_tracker::valid_connection_id(uint64_t id,
+                                      const udp::endpoint &ep) const {
+    const uint64_t window = current_window();
+    return id == connection_id(ep, window) ||
+           id == connection_id(ep, window - 1);
+}
+
+void udp_tracker::handle_datagram(std::size_t n) {
+    // Every request starts with connection_id, action, transaction_id
+    if (n < 16)
+        return;
+
+    const uint64_t conn = read_u64(recv_buffer_.data());
+    const uint32_t action = read_u32(recv_buffer_.data() + 8);
+    const uint32_t txn = read_u32(recv_buffer_.data() + 12);
+
+    if (action == kActionConnect) {
+        if (conn != kProtocolId)
+            return;
+        metrics::count_udp(metrics::udp_action::connect);
+        return handle_connect(txn);
+    }
+
+    if (!valid_connection_id(conn, remote_))
+        return send_error(txn, "bad connection id");
+
+    switch (action) {
+    case kActionAnnounce:
+        metrics::count_udp(metrics::udp_action::announce);
+        return handle_announce(txn, n);
+    case kActionScrape:
+        metrics::count_udp(metrics::udp_action::scrape);
+        return handle_scrape(txn, n);
+    default:
+        return send_error(txn, "unknown action");
+    }
+}
+
+void udp_tracker::handle_connect(uint32_t txn) {
+    unsigned char *out = send_buffer_.data();
+    write_u32(out, kActionConnect);
+    write_u32(out + 4, txn);
+    write_u64(out + 8, connection_id(remote_, current_window()));
+    send(16);
+}
+
+void udp_tracker::handle_announce(uint32_t txn, std::size_t n) {
+    if (n < kAnnounceLen)
+        return send_error(txn, "short announce");
+    const auto start = steady_clock::now();
+
+    // Shed before touching the swarm. An overloaded tracker still answers,
+    // with an empty peer list and the long overload interval, so clients
+    // back off instead of retrying
+    switch (admission_.admit_announce(remote_.address())) {
+    case AdmissionControl::Verdict::admit:
+        break;
+    case AdmissionControl::Verdict::overloaded: {
+        unsigned char *out = send_buffer_.data();
+        write_u32(out, kActionAnnounce);
+        write_u32(out + 4, txn);
+        write_u32(out + 8, static_cast<uint32_t>(
+                               admission_.limits.overload_interval.count()));
+        write_u32(out + 12, 0);
+        write_u32(out + 16, 0);
+        return send(20);
+    }
+    case AdmissionControl::Verdict::rate_limited:
+        return send_error(txn, "rate limited");
+    }
+
+    const unsigned char *in = recv_buffer_.data();
+    std::string infohash(reinterpret_cast<const char *>(in + 16),
+                         kInfohashLen);
+
+    // 20 bytes on the wire; clients with shorter ids pad with NULs
+    std::string peer_id(reinterpret_cast<const char *>(in + 48), kPeerIdLen);
+    peer_id.erase(peer_id.find_last_not_of('\0') + 1);
+
+    const bool seeder = read_u64(in + 76) == 0; // left
+    const uint32_t event = read_u32(in + 92);
+    const int32_t num_want = static_cast<int32_t>(read_u32(in + 104));
+    const uint16_t port = static_cast<uint16_t>((in[108] << 8) | in[109]);
+
+    // Like the HTTP path, trust the address we saw over the ip field
+    const auto addr = remote_.address();
+
+    std::size_t swarm_size = 0;
+    if (event == kEventStopped) {
+        state_.remove_peer(infohash, addr, port, peer_id);
+    } else {
+        swarm_size = state_.upsert_peer(infohash, addr, port, peer_id, seeder,
+                                        event == kEventCompleted);
+    }
+    if (cluster_) {
+        cluster_->publish({event == kEventStopped ? PeerDelta::Kind::remove
+                                                  : PeerDelta::Kind::upsert,
+                           seeder, event == kEventCompleted, infohash, addr,
+                           port, peer_id});
+    }
+
+    // Only answer with peers of the requester's address family, which the
+    // sample is drawn from, so other peers don't eat into num_want
+    const bool v6 = addr.is_v6() && !addr.to_v6().is_v4_mapped();
+    const std::size_t record = v6 ? 18 : 6;
+    const std::size_t room = (send_buffer_.size() - 20) / record;
+    std::size_t want = num_want < 0 ? TrackerState::kDefaultNumWant
+                                    : static_cast<std::size_t>(num_want);
+    want = std::min({want, kMaxPeers, room});
+
+    auto peers = state_.list_peers(infohash, addr, port, peer_id, want, seeder,
+                                   v6 ? PeerFamily::v6 : PeerFamily::v4);
+    const auto counts = state_.scrape(infohash);
+
+    unsigned char *out = send_buffer_.data();
+    write_u32(out, kActionAnnounce);
+    write_u32(out + 4, txn);
+    write_u32(out + 8, intervals_.timing(swarm_size, peer_id).interval);
+    write_u32(out + 12, static_cast<uint32_t>(counts.leechers));
+    write_u32(out + 16, static_cast<uint32_t>(counts.seeders));
+
+    std::size_t len = 20;
+    for (const auto &peer : peers) {
+        // Endpoints are stored in wire order already
+        const std::size_t skip = v6 ? 0 : 12;
+        std::memcpy(out + len, peer.bytes.data() + skip, record);
+        len += record;
+    }
+
+    metrics::observe_announce(true, steady_clock::now() - start);
+    send(len);
+}
+
+void udp_tracker::handle_scrape(uint32_t txn, std::size_t n) {
+    const std::size_t count =
+        std::min((n - 16) / kInfohashLen, (send_buffer_.size() - 8) / 12);
+
+    unsigned char *out = send_buffer_.data();
+    write_u32(out, kActionScrape);
+    write_u32(out + 4, txn);
+
+    std::size_t len = 8;
+    for (std::size_t i = 0; i < count; ++i) {
+        std::string infohash(
+            reinterpret_cast<const char *>(recv_buffer_.data() + 16 +
+                                           i * kInfohashLen),
+            kInfohashLen);
+        const auto counts = state_.scrape(infohash);
+        write_u32(out + len, static_cast<uint32_t>(counts.seeders));
+        write_u32(out + len + 4, static_cast<uint32_t>(counts.completed));
+        write_u32(out + len + 8, static_cast<uint32_t>(counts.leechers));
+        len += 12;
+    }
+
+    send(len);
+}
+
+void udp_tracker::send_error(uint32_t txn, const char *msg) {
+    metrics::count_udp(metrics::udp_action::error);
+    unsigned char *out = send_buffer_.data();
+    write_u32(out, kActionError);
+    write_u32(out + 4, txn);
+    std::size_t len = std::min(std::strlen(msg), send_buffer_.size() - 8);
+    std::memcpy(out + 8, msg, len);
+    send(8 + len);
+}
+
+// Replies are sent inline; the receive loop is paused until this returns, so
+// the shared send buffer is never in use twice. The socket is non-blocking:
+// when its send buffer is full the reply is dropped, as the network could
+// have, and the client retries, rather than stalling the io thread
+void udp_tracker::send(std::size_t n) {
+    boost::system::error_code ec;
+    socket_.send_to(boost::asio::buffer(send_buffer_.data(), n), remote_, 0,
+                    ec);
+    if (ec == boost::asio::error::would_block) {
+        metrics::udp_replies_dropped.add();
+        return;
+    }
+    if (ec) {
+        TLOG(warn) << "[udp_tracker::send] Error sending to " << remote_ << ": "
+                   << ec.message();
+        return;
+    }
+    metrics::udp_bytes_out.add(n);
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include "admission.hpp"
+#include "announce_interval.hpp"
+#include "cluster.hpp"
+#include "tracker_state.hpp"
+#include <array>
+#include <boost/asio.hpp>
+#include <cstdint>
+#include <memory>
+
+/// UDP announce/scrape endpoint in the spirit of BEP 15: a client first trades
+/// a connect packet for a connection id, then announces or scrapes with that
+/// id, one datagram each way.
+///
+/// Differences from BEP 15: infohashes are our full 32-byte SHA-256 hashes
+/// (so announce requests are 110 bytes and scrape entries 32 bytes), and
+/// trailing NUL padding is stripped from the 20-byte peer_id so it matches
+/// what the same client sends over HTTP.
+class udp_tracker : public std::enable_shared_from_this<udp_tracker> {
+  public:
+    using udp = boost::asio::ip::udp;
+
+    udp_tracker(boost::asio::io_context &ioc, udp::endpoint ep,
+                TrackerState &st, AdmissionControl &admission,
+                const IntervalPolicy &intervals, cluster_node *cluster);
+
+    void run();
+
+  private:
+    void do_receive();
+    void handle_datagram(std::size_t n);
+    void handle_connect(uint32_t txn);
+    void handle_announce(uint32_t txn, std::size_t n);
+    void handle_scrape(uint32_t txn, std::size_t n);
+    void send_error(uint32_t txn, const char *msg);
+    void send(std::size_t n);
+
+    uint64_t connection_id(const udp::endpoint &ep, uint64_t window) const;
+    bool valid_connection_id(uint64_t id, const udp::endpoint &ep) const;
+
+    udp::socket socket_;
+    udp::endpoint remote_;
+    TrackerState &state_;
+    AdmissionControl &admission_;
+    const IntervalPolicy &intervals_;
+    cluster_node *cluster_; // null when standalone
+    uint64_t secret_;
+
+    std::array<unsigned char, 2048> recv_buffer_{};
+    std::array<unsigned char, 2048> send_buffer_{};
+};
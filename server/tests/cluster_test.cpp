@@ -0,0 +1,179 @@
+#include "cluster.hpp"
+#include <boost/asio/ip/address.hpp>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Tests for clustered mode: the hash ring, and nodes gossiping over
+// loopback, each with its own io_context and TrackerState as separate
+// tracker processes would have. Run by ctest. Each test returns whether it
+// passed; failures are reported on stderr
+
+namespace {
+
+using udp = boost::asio::ip::udp;
+
+const auto kLocalhost = boost::asio::ip::make_address("127.0.0.1");
+
+#define EXPECT(cond)                                                          \
+    do {                                                                      \
+        if (!(cond)) {                                                        \
+            std::cerr << __func__ << ": " << __FILE__ << ":" << __LINE__      \
+                      << ": expected " #cond << "\n";                         \
+            return false;                                                     \
+        }                                                                     \
+    } while (0)
+
+// One tracker of a cluster, gossiping from its own thread
+struct Node {
+    boost::asio::io_context ioc;
+    TrackerState state{4};
+    std::shared_ptr<cluster_node> cluster;
+    std::thread thread;
+
+    Node(const std::vector<udp::endpoint> &nodes, std::size_t self,
+         std::size_t replicas) {
+        cluster = std::make_shared<cluster_node>(
+            ioc, nodes, self, replicas, state, std::chrono::seconds{120});
+        cluster->run();
+        thread = std::thread([this] { ioc.run(); });
+    }
+    ~Node() {
+        ioc.stop();
+        thread.join();
+    }
+
+    // Announce a peer here, as an HTTP or UDP announce would
+    void announce(const std::string &infohash, uint16_t port) {
+        state.upsert_peer(infohash, kLocalhost, port, "-AA0001-node");
+        cluster->publish({PeerDelta::Kind::upsert, false, false, infohash,
+                          kLocalhost, port, "-AA0001-node"});
+    }
+    void stop(const std::string &infohash, uint16_t port) {
+        state.remove_peer(infohash, kLocalhost, port, "-AA0001-node");
+        cluster->publish({PeerDelta::Kind::remove, false, false, infohash,
+                          kLocalhost, port, "-AA0001-node"});
+    }
+    std::size_t peers(const std::string &infohash) {
+        const auto s = state.scrape(infohash);
+        return s.seeders + s.leechers;
+    }
+};
+
+// Free loopback ports for `n` nodes. Another process could take one before
+// the node binds it, which is as likely as a collision between test runs
+std::vector<udp::endpoint> cluster_endpoints(std::size_t n) {
+    boost::asio::io_context ioc;
+    std::vector<udp::socket> probes;
+    std::vector<udp::endpoint> out;
+    for (std::size_t i = 0; i < n; ++i) {
+        probes.emplace_back(ioc, udp::endpoint(kLocalhost, 0));
+        out.push_back(probes.back().local_endpoint());
+    }
+    return out;
+}
+
+// Whether `cond` holds within two seconds, which is hundreds of flushes
+bool eventually(const std::function<bool()> &cond) {
+    const auto deadline =
+        std::chrono::steady_clock::now() + std::chrono::seconds{2};
+    while (!cond()) {
+        if (std::chrono::steady_clock::now() > deadline)
+            return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds{5});
+    }
+    return true;
+}
+
+// An infohash whose owners, with `replicas`, start with `primary`
+std::string owned_by(const HashRing &ring, std::size_t replicas,
+                     std::size_t primary) {
+    HashRing::Owners owners;
+    for (int i = 0;; ++i) {
+        std::string ih(20, 'x');
+        ih.replace(0, std::to_string(i).size(), std::to_string(i));
+        if (ring.owners(ih, replicas, owners) > 0 && owners[0] == primary)
+            return ih;
+    }
+}
+
+// Owners are distinct and as many as asked for, up to the node count, and
+// taking a node out only moves the swarms it owned
+bool ring_ownership() {
+    const HashRing three({"a:1", "b:2", "c:3"});
+    const HashRing two({"a:1", "b:2"});
+    HashRing::Owners owners;
+    std::size_t moved = 0;
+    for (int i = 0; i < 1000; ++i) {
+        const std::string ih = "infohash-" + std::to_string(i);
+        EXPECT(three.owners(ih, 2, owners) == 2 && owners[0] != owners[1]);
+        EXPECT(three.owners(ih, 5, owners) == 3);
+        EXPECT(three.owners(ih, 1, owners) == 1);
+        const std::size_t primary = owners[0];
+        two.owners(ih, 1, owners);
+        if (primary != 2)
+            EXPECT(owners[0] == primary);
+        else
+            ++moved;
+    }
+    // Node c has about a third of the swarms
+    EXPECT(moved > 200 && moved < 470);
+    return true;
+}
+
+// With every node owning every swarm, a peer announced to one shows up on
+// the other, and goes when it stops. Replayed deltas aren't announces
+bool deltas_reach_owners() {
+    const auto endpoints = cluster_endpoints(2);
+    Node a(endpoints, 0, 2), b(endpoints, 1, 2);
+    const std::string ih(20, 'h');
+
+    a.announce(ih, 6881);
+    EXPECT(eventually([&] { return b.peers(ih) == 1; }));
+    b.announce(ih, 6882);
+    EXPECT(eventually([&] { return a.peers(ih) == 2; }));
+    EXPECT(a.state.stats().announces == 1 && b.state.stats().announces == 1);
+
+    a.stop(ih, 6881);
+    EXPECT(eventually([&] { return b.peers(ih) == 1; }));
+    return true;
+}
+
+// With one owner per swarm, a non-owner's announce reaches the owner, which
+// from then on passes the swarm's other changes on to that non-owner
+bool primary_forwards_to_subscribers() {
+    const auto endpoints = cluster_endpoints(3);
+    std::vector<std::string> names;
+    for (const auto &ep : endpoints) {
+        std::ostringstream oss;
+        oss << ep;
+        names.push_back(oss.str());
+    }
+    const std::string ih = owned_by(HashRing(names), 1, 0);
+    Node owner(endpoints, 0, 1), b(endpoints, 1, 1), c(endpoints, 2, 1);
+
+    c.announce(ih, 6881);
+    EXPECT(eventually([&] { return owner.peers(ih) == 1; }));
+    b.announce(ih, 6882);
+    EXPECT(eventually([&] { return c.peers(ih) == 2; }));
+    // b never served the swarm before its announce, so it only knows its own
+    // peer and whatever changed after
+    EXPECT(owner.peers(ih) == 2 && b.peers(ih) == 1);
+    return true;
+}
+
+} // namespace
+
+int main() {
+    bool passed = ring_ownership();
+    passed = deltas_reach_owners() && passed;
+    passed = primary_forwards_to_subscribers() && passed;
+    std::cout << (passed ? "PASS" : "FAIL") << "\n";
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,378 @@
+#include "admission.hpp"
+#include "announce_query.hpp"
+#include "announce_request.hpp"
+#include "tracker_state.hpp"
+#include <algorithm>
+#include <boost/asio/ip/address.hpp>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <set>
+#include <string>
+#include <utility>
+
+// Regression tests for TrackerState and the announce parsers, run by ctest.
+// Each test returns whether it passed; failures are reported on stderr
+
+namespace {
+
+const auto kLocalhost = boost::asio::ip::make_address("127.0.0.1");
+const std::string kInfohash(20, 'a');
+
+#define EXPECT(cond)                                                          \
+    do {                                                                      \
+        if (!(cond)) {                                                        \
+            std::cerr << __func__ << ": " << __FILE__ << ":" << __LINE__      \
+                      << ": expected " #cond << "\n";                         \
+            return false;                                                     \
+        }                                                                     \
+    } while (0)
+
+// A full swarm refuses a newcomer after its only peer has expired, with the
+// wheel bucket it is filed under never drained by gc(): filing the swarm
+// drains that bucket, which empties the swarm the announce is still using
+bool refused_peer_in_emptied_swarm() {
+    TrackerState state(1, std::chrono::seconds{1});
+    state.set_limits({.swarms = 0, .peers_per_swarm = 1, .bytes = 0});
+    // Past the ttl and then some, without waiting for it
+    const auto later = steady_clock::now() + std::chrono::seconds{3};
+
+    EXPECT(state.upsert_peer(kInfohash, kLocalhost, 6881,
+                             "-AA0001-000000000001", false, false) == 1);
+    EXPECT(state.upsert_peer(kInfohash, kLocalhost, 6882,
+                             "-AA0001-000000000002", false, false, true,
+                             later) == 0);
+
+    // The emptied swarm is kept, so the newcomer gets in next time
+    state.gc(later);
+    EXPECT(state.upsert_peer(kInfohash, kLocalhost, 6882,
+                             "-AA0001-000000000002", false, false, true,
+                             later) == 1);
+    return true;
+}
+
+// Peers of the other address family don't count against num_want: with
+// few IPv4 peers among many IPv6 ones, an IPv4 announcer gets all of them
+bool sample_of_one_family() {
+    TrackerState state(1);
+    const auto v6 = boost::asio::ip::make_address("2001:db8::1");
+    for (uint16_t port = 1; port <= 300; ++port)
+        state.upsert_peer(kInfohash, v6, port, "-AA0001-v6");
+    for (uint16_t port = 1; port <= 20; ++port)
+        state.upsert_peer(kInfohash, kLocalhost, port, "-AA0001-v4");
+
+    const auto peers = state.list_peers(kInfohash, kLocalhost, 1,
+                                        "-AA0001-v4", 50, false,
+                                        PeerFamily::v4);
+    EXPECT(peers.size() == 19);
+    for (const PeerEndpoint &peer : peers)
+        EXPECT(peer.is_v4());
+    return true;
+}
+
+// A swarm's download count survives a snapshot round trip as long as the
+// swarm has peers. One whose peers have all stopped is left out, as gc()
+// would drop it
+bool snapshot_keeps_completed() {
+    const std::string stopped(20, 'b');
+    std::string snapshot;
+    {
+        TrackerState state(2);
+        state.upsert_peer(kInfohash, kLocalhost, 6881, "-AA0001-seed", true,
+                          true);
+        state.upsert_peer(kInfohash, kLocalhost, 6882, "-AA0001-leech");
+        state.upsert_peer(stopped, kLocalhost, 6883, "-AA0001-gone", true,
+                          true);
+        state.remove_peer(stopped, kLocalhost, 6883, "-AA0001-gone");
+        state.write_snapshot(snapshot);
+    }
+
+    TrackerState state(2);
+    EXPECT(state.restore_snapshot(snapshot) == 2);
+    const auto live = state.scrape(kInfohash);
+    EXPECT(live.seeders == 1 && live.leechers == 1 && live.completed == 1);
+    const auto gone = state.scrape(stopped);
+    EXPECT(gone.seeders == 0 && gone.leechers == 0 && gone.completed == 0);
+    return true;
+}
+
+// Random inserts and erases into one swarm, checked against a std::set
+// after every step. A few hundred keys over a table that grows and shrinks
+// keeps probe runs long and wrapping, which is where backshift deletion
+// can go wrong
+bool peer_index_churn() {
+    Swarm swarm;
+    std::set<std::pair<uint16_t, std::string>> expected;
+    std::mt19937 rng(42);
+    const auto v6 = boost::asio::ip::make_address("2001:db8::1");
+
+    auto key = [&](uint16_t port, const std::string &id) {
+        return std::make_pair(PeerEndpoint(port % 2 ? v6 : kLocalhost, port),
+                              PeerId(id));
+    };
+    for (int step = 0; step < 20000; ++step) {
+        const uint16_t port = static_cast<uint16_t>(rng() % 300);
+        // Same endpoint, different ids: distinct peers
+        const std::string id = "-AA0001-" + std::to_string(rng() % 2);
+        const auto [ep, pid] = key(port, id);
+        const bool present = expected.count({port, id}) != 0;
+        EXPECT((swarm.find(ep, pid) != Swarm::npos) == present);
+
+        // Inserts win early on, erases later, so the table grows and shrinks
+        if (!present && rng() % 100 < (step < 10000 ? 70u : 30u)) {
+            swarm.insert(ep, pid, 0, rng() % 2);
+            expected.emplace(port, id);
+        } else if (present && rng() % 2) {
+            EXPECT(swarm.erase(ep, pid));
+            expected.erase({port, id});
+        } else if (!present) {
+            EXPECT(!swarm.erase(ep, pid));
+        }
+        if (step % 1000 == 999)
+            swarm.shrink();
+        EXPECT(swarm.size() == expected.size());
+    }
+
+    // Every peer is found at its own slot, and the seeder count adds up
+    std::size_t seeders = 0;
+    for (const auto &[port, id] : expected) {
+        const auto [ep, pid] = key(port, id);
+        const std::size_t slot = swarm.find(ep, pid);
+        EXPECT(slot != Swarm::npos);
+        EXPECT(swarm.endpoints[slot] == ep && swarm.ids[slot] == pid);
+        seeders += swarm.seeder[slot];
+    }
+    EXPECT(swarm.seeders == seeders);
+
+    // Draining empties the table without losing track of anyone
+    while (swarm.size() > 0) {
+        const std::size_t slot = rng() % swarm.size();
+        const PeerEndpoint ep = swarm.endpoints[slot];
+        const PeerId pid = swarm.ids[slot];
+        swarm.erase_slot(slot);
+        expected.erase({ep.port(), std::string(pid.view())});
+        EXPECT(swarm.find(ep, pid) == Swarm::npos);
+        EXPECT(swarm.size() == expected.size());
+    }
+    EXPECT(swarm.seeders == 0);
+    return true;
+}
+
+// A 32-byte infohash percent-encoded, as clients send it
+const std::string kEncodedInfohash = [] {
+    std::string out;
+    for (int i = 0; i < 32; ++i)
+        out += "%0" + std::string(1, "0123456789abcdef"[i % 16]);
+    return out;
+}();
+
+QueryError parse(const std::string &query, AnnounceQuery &q) {
+    q = AnnounceQuery{};
+    return parse_announce_query("/announce?" + query, q);
+}
+
+// Malformed, oversized and repeated parameters: each is either rejected
+// with the right error or ignored, and the first of a repeat wins
+bool announce_query_edge_cases() {
+    const std::string ih = "infohash=" + kEncodedInfohash;
+    const std::string ok = ih + "&peer_id=-AA0001-&port=6881";
+    AnnounceQuery q;
+
+    EXPECT(parse(ok + "&left=0&compact=1&numwant=80&event=completed", q) ==
+           QueryError::none);
+    EXPECT(q.infohash[1] == 1 && q.peer_id() == "-AA0001-" &&
+           q.port == 6881 && q.has_left && q.left == 0 && q.compact &&
+           q.num_want == 80 && q.event == AnnounceEvent::completed);
+    EXPECT(parse_announce_query("/announce", q) == QueryError::missing);
+
+    // Malformed: lengths, ports, a stray '%', pairs without '='
+    EXPECT(parse("infohash=%00&peer_id=x&port=1", q) ==
+           QueryError::bad_infohash);
+    EXPECT(parse("infohash=" + kEncodedInfohash + "%00&peer_id=x&port=1",
+                 q) == QueryError::bad_infohash);
+    EXPECT(parse(ih + "&peer_id=&port=1", q) == QueryError::bad_peer_id);
+    EXPECT(parse(ih + "&peer_id=-AA0001-0123456789ab+&port=1", q) ==
+           QueryError::bad_peer_id);
+    for (const char *port : {"", "-1", "65536", "12a", "0x10"})
+        EXPECT(parse(ih + "&peer_id=x&port=" + port, q) ==
+               QueryError::bad_port);
+    EXPECT(parse(ih + "&peer_id=%zz%4&port=1", q) == QueryError::none);
+    EXPECT(q.peer_id() == "%zz%4");
+    EXPECT(parse(ih + "&peer_id&port=1", q) == QueryError::missing);
+    EXPECT(parse(ok + "&left=ten&numwant=-5&event=paused&compact=yes", q) ==
+           QueryError::none);
+    EXPECT(!q.has_left && q.num_want == -1 &&
+           q.event == AnnounceEvent::none && !q.compact);
+
+    // Oversized: numbers past their type, a value far past its buffer
+    EXPECT(parse(ih + "&peer_id=x&port=" + std::string(25, '9'), q) ==
+           QueryError::bad_port);
+    EXPECT(parse(ok + "&left=18446744073709551616&numwant=100001", q) ==
+           QueryError::none);
+    EXPECT(!q.has_left && q.num_want == -1);
+    EXPECT(parse(ok + "&left=18446744073709551615", q) == QueryError::none);
+    EXPECT(q.has_left && q.left == UINT64_MAX);
+    EXPECT(parse("infohash=" + std::string(10000, 'a') + "&peer_id=x&port=1",
+                 q) == QueryError::bad_infohash);
+
+    // Repeated: the first one counts, even when a later one is bad
+    EXPECT(parse(ok + "&port=1&infohash=%00&peer_id=", q) ==
+           QueryError::none);
+    EXPECT(q.port == 6881 && q.peer_id() == "-AA0001-");
+    EXPECT(parse(ih + "&peer_id=x&port=bad&port=1", q) ==
+           QueryError::bad_port);
+    EXPECT(parse(ok + "&left=5&left=0&numwant=1&numwant=2", q) ==
+           QueryError::none);
+    EXPECT(q.left == 5 && q.num_want == 1);
+    // An escaped key is still the key
+    EXPECT(parse(ih + "&peer_id=x&%70ort=7", q) == QueryError::none);
+    EXPECT(q.port == 7);
+    return true;
+}
+
+// Feed `head` to the parser the way the session's read loop does, a few
+// bytes more each time, and return what it made of all of it. Every
+// shorter prefix has to ask for more
+HeadParse parse_in_reads(const std::string &head, std::size_t read_size,
+                         AnnounceRequest &out, bool &asked_for_more) {
+    asked_for_more = true;
+    HeadParse r = HeadParse::need_more;
+    for (std::size_t have = 0; r == HeadParse::need_more;) {
+        have = std::min(head.size(), have + read_size);
+        r = parse_announce_request(std::string_view(head).substr(0, have),
+                                   out);
+        if (have == head.size())
+            break;
+        asked_for_more = asked_for_more && r == HeadParse::need_more;
+    }
+    return r;
+}
+
+// Heads split across reads, including between the CR and LF of a line and
+// with the next pipelined request right behind, parse the same as whole
+// ones. Heads past kMaxAnnounceHead go to Beast however they arrive
+bool announce_head_in_pieces() {
+    const std::string target = "/announce?infohash=" + kEncodedInfohash +
+                               "&peer_id=-AA0001-&port=6881";
+    const std::string head = "GET " + target +
+                             " HTTP/1.1\r\nHost: tracker\r\n"
+                             "Connection: keep-alive, Close\r\n\r\n";
+
+    for (std::size_t read_size : {std::size_t{1}, std::size_t{2},
+                                  std::size_t{7}, head.size()}) {
+        AnnounceRequest req;
+        bool asked = false;
+        EXPECT(parse_in_reads(head, read_size, req, asked) ==
+               HeadParse::done);
+        EXPECT(asked && req.target == target && req.version == 11 &&
+               !req.keep_alive && req.size == head.size());
+    }
+
+    // The next request's bytes are left alone
+    AnnounceRequest req;
+    EXPECT(parse_announce_request(head + "GET /announce?info", req) ==
+           HeadParse::done);
+    EXPECT(req.size == head.size());
+    // HTTP/1.0 is only kept alive when asked to
+    EXPECT(parse_announce_request("GET " + target + " HTTP/1.0\r\n\r\n",
+                                  req) == HeadParse::done);
+    EXPECT(req.version == 10 && !req.keep_alive);
+
+    // Not an announce, or not one we take: decided as soon as it shows
+    EXPECT(parse_announce_request("GET /scr", req) == HeadParse::fallback);
+    EXPECT(parse_announce_request("GET /ann", req) == HeadParse::need_more);
+    EXPECT(parse_announce_request("GET " + target + " HTTP/1.1\n", req) ==
+           HeadParse::fallback);
+    EXPECT(parse_announce_request("GET " + target +
+                                      " HTTP/1.1\r\nContent-Length: 4\r\n"
+                                      "\r\n",
+                                  req) == HeadParse::fallback);
+    EXPECT(parse_announce_request("GET " + target +
+                                      " HTTP/1.1\r\nHost: a\r\n b\r\n\r\n",
+                                  req) == HeadParse::fallback);
+
+    // Just under the cap is still ours; at the cap it is Beast's, before
+    // the blank line has even arrived
+    const std::string first = "GET " + target + " HTTP/1.1\r\nX-Pad: ";
+    const std::string end = "\r\n\r\n";
+    const std::string fits =
+        first + std::string(kMaxAnnounceHead - first.size() - end.size(), 'p') +
+        end;
+    bool asked = false;
+    EXPECT(parse_in_reads(fits, 512, req, asked) == HeadParse::done);
+    EXPECT(asked && req.size == kMaxAnnounceHead);
+
+    const std::string big = first + std::string(kMaxAnnounceHead, 'p') + end;
+    EXPECT(parse_in_reads(big, 512, req, asked) == HeadParse::fallback);
+    for (std::size_t have = 1; have < kMaxAnnounceHead; have += 97) {
+        EXPECT(parse_announce_request(std::string_view(big).substr(0, have),
+                                      req) == HeadParse::need_more);
+    }
+    EXPECT(parse_announce_request(
+               std::string_view(big).substr(0, kMaxAnnounceHead), req) ==
+           HeadParse::fallback);
+    return true;
+}
+
+// An IP's announce bucket holds two seconds' worth, refuses once empty and
+// refills at the rate; other IPs have buckets of their own
+bool admission_refill_and_refusal() {
+    using Verdict = AdmissionControl::Verdict;
+    AdmissionControl admission({.announce_rate = 2});
+    const auto other = boost::asio::ip::make_address("127.0.0.2");
+    const auto t0 = steady_clock::now();
+
+    for (int i = 0; i < 4; ++i)
+        EXPECT(admission.admit_announce(kLocalhost, t0) == Verdict::admit);
+    EXPECT(admission.admit_announce(kLocalhost, t0) == Verdict::rate_limited);
+    EXPECT(admission.admit_announce(other, t0) == Verdict::admit);
+
+    // Half a second is one token, and a long pause no more than a burst
+    const auto t1 = t0 + std::chrono::milliseconds{500};
+    EXPECT(admission.admit_announce(kLocalhost, t1) == Verdict::admit);
+    EXPECT(admission.admit_announce(kLocalhost, t1) == Verdict::rate_limited);
+    const auto t2 = t1 + std::chrono::hours{1};
+    for (int i = 0; i < 4; ++i)
+        EXPECT(admission.admit_announce(kLocalhost, t2) == Verdict::admit);
+    EXPECT(admission.admit_announce(kLocalhost, t2) == Verdict::rate_limited);
+    return true;
+}
+
+// A batch naming far more swarms than the burst is let through, and the
+// IP's next announces wait until it has been paid for. The debt survives
+// sweeps, which only drop buckets that are full again
+bool admission_batch_past_burst() {
+    using Verdict = AdmissionControl::Verdict;
+    AdmissionControl admission({.announce_rate = 2});
+    const auto t0 = steady_clock::now();
+
+    // 4 tokens; one for the batch, 127 more charged: 124 owed
+    EXPECT(admission.admit_announce(kLocalhost, t0) == Verdict::admit);
+    admission.charge_announces(kLocalhost, 127, t0);
+    for (int i = 0; i < 16; ++i)
+        admission.sweep(t0 + std::chrono::seconds{10});
+
+    // Paid off after 62s at 2 per second, with a token to spare after 62.5s
+    const auto owed = t0 + std::chrono::seconds{62};
+    EXPECT(admission.admit_announce(kLocalhost, owed) == Verdict::rate_limited);
+    const auto paid = owed + std::chrono::milliseconds{500};
+    EXPECT(admission.admit_announce(kLocalhost, paid) == Verdict::admit);
+    EXPECT(admission.admit_announce(kLocalhost, paid) == Verdict::rate_limited);
+    return true;
+}
+
+} // namespace
+
+int main() {
+    bool passed = refused_peer_in_emptied_swarm();
+    passed = sample_of_one_family() && passed;
+    passed = snapshot_keeps_completed() && passed;
+    passed = peer_index_churn() && passed;
+    passed = announce_query_edge_cases() && passed;
+    passed = announce_head_in_pieces() && passed;
+    passed = admission_refill_and_refusal() && passed;
+    passed = admission_batch_past_burst() && passed;
+    std::cout << (passed ? "PASS" : "FAIL") << "\n";
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}